@@ -0,0 +1,463 @@
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+using namespace std;
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include "expire_map.h"
+#include "sharded_expire_map.h"
+#include "flat_expire_map.h"
+#include "sampled_expire_map.h"
+
+//
+// Benchmark of the ExpireMap variants
+// ==============================================================================
+//
+// Runs a mix of put/get/remove from a number of threads against each selected map
+// and prints one row per map and thread count, as CSV or JSON:
+// - ops_per_sec: operations of all threads over the wall time of the run.
+// - <op>_p50_ns, <op>_p99_ns, <op>_p999_ns: latency percentiles of each operation,
+//   in nanoseconds. Each operation is timed with the monotonic clock, so the
+//   latencies include about the cost of one clock read.
+// - lag_*_us: time from the expiry of an entry to its removal by eviction, in
+//   microseconds. Empty for maps that erase expired entries lazily.
+//
+// The map is filled with all keys before the run. Lags are collected during the
+// run and for --drain_ms after it.
+//
+// Usage: bench_expire_map [--option=value ...]
+//   --maps=expire,sharded   Maps to run: expire, wheel, fifo, distlock, sharded,
+//                           flat, sampled. fifo is meant for a fixed --ttl.
+//   --threads=1,2,4,8       Thread counts to run each map with
+//   --keys=1048576          Number of distinct keys
+//   --ops=1000000           Operations per thread
+//   --mix=10:85:5           Percentages of put:get:remove
+//   --dist=uniform          Key distribution: uniform or zipf
+//   --theta=0.99            Skew of the zipf distribution (0 < theta < 1)
+//   --ttl=uniform:1:100     Timeouts in ms: fixed:MS, uniform:MIN:MAX or exp:MEAN
+//   --drain_ms=200          Time to keep collecting eviction lags after the run
+//   --format=csv            Output format: csv or json
+//
+
+typedef ExpireMap<int, int> BenchExpireMap;
+typedef ExpireMap<int, int, TimingWheelExpiryIndex<int> > BenchWheelExpireMap;
+typedef ExpireMap<int, int, FifoExpiryIndex<int> > BenchFifoExpireMap;
+typedef ExpireMap<int, int, OrderedExpiryIndex<int>, DistributedRWLock<> > BenchDistLockExpireMap;
+typedef ShardedExpireMap<int, int> BenchShardedExpireMap;
+typedef FlatExpireMap<int, int> BenchFlatExpireMap;
+typedef SampledExpireMap<int, int> BenchSampledExpireMap;
+
+typedef struct BenchConfig {
+    vector<string> maps;
+    vector<int> threads;
+    int keys;
+    long ops;
+    int put_pct;
+    int get_pct;
+    int remove_pct;
+    string dist;
+    double theta;
+    string ttl;
+    string ttl_kind;            // fixed, uniform or exp
+    double ttl_a;               // Timeout, minimum or mean
+    double ttl_b;               // Maximum of uniform
+    long drain_ms;
+    string format;
+    BenchConfig()
+        : maps(), threads(), keys(1 << 20), ops(1000000), put_pct(10), get_pct(85),
+          remove_pct(5), dist("uniform"), theta(0.99), ttl("uniform:1:100"),
+          ttl_kind("uniform"), ttl_a(1), ttl_b(100), drain_ms(200), format("csv") { }
+} BenchConfig;
+
+// xorshift64* generator, one per thread
+class Rng {
+    private:
+        unsigned long long _state;
+    public:
+        explicit Rng(unsigned long long seed) : _state(seed | 1) { }
+        unsigned long long next() {
+            _state ^= _state >> 12;
+            _state ^= _state << 25;
+            _state ^= _state >> 27;
+            return _state * 0x2545F4914F6CDD1DULL;
+        }
+        // Uniform in [0, 1)
+        double uniform() { return (next() >> 11) * (1.0 / 9007199254740992.0); }
+};
+
+// Zipf distribution over [0, n) as generated by YCSB (Gray et al., "Quickly
+// generating billion-record synthetic databases"). Rank 0 is the most popular key.
+class ZipfGenerator {
+    private:
+        long _n;
+        double _theta;
+        double _alpha;
+        double _zetan;
+        double _eta;
+    public:
+        ZipfGenerator(long n, double theta) : _n(n), _theta(theta) {
+            double zeta2 = 1 + pow(0.5, theta);
+            _zetan = 0;
+            for (long i = 1; i <= n; ++i) {
+                _zetan += 1 / pow((double)i, theta);
+            }
+            _alpha = 1 / (1 - theta);
+            _eta = (1 - pow(2.0 / n, 1 - theta)) / (1 - zeta2 / _zetan);
+        }
+        long next(Rng& rng) const {
+            double u = rng.uniform();
+            double uz = u * _zetan;
+            if (uz < 1) return 0;
+            if (uz < 1 + pow(0.5, _theta)) return 1;
+            long rank = (long)(_n * pow(_eta * u - _eta + 1, _alpha));
+            return rank < _n ? rank : _n - 1;
+        }
+};
+
+// Latencies of one thread
+typedef struct ThreadLatencies {
+    LatencyHistogram put;
+    LatencyHistogram get;
+    LatencyHistogram remove;
+} ThreadLatencies;
+
+template <class Map>
+struct BenchThread {
+    Map* exp_map;
+    const BenchConfig* config;
+    const ZipfGenerator* zipf;
+    pthread_barrier_t* start;
+    int id;
+    ThreadLatencies* latencies;
+    // Monotonic time at which the thread started and finished its operations
+    long long begin_ns;
+    long long end_ns;
+    // Sum of the values read by get
+    long long value_sum;
+};
+
+// Sum of the values read by all runs, stored so that the reads are used
+long long value_sink = 0;
+
+long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+long next_ttl_ms(const BenchConfig& config, Rng& rng) {
+    double ttl = config.ttl_a;
+    if (config.ttl_kind == "uniform") {
+        ttl = config.ttl_a + rng.uniform() * (config.ttl_b - config.ttl_a + 1);
+    } else if (config.ttl_kind == "exp") {
+        ttl = -config.ttl_a * log(1 - rng.uniform());
+    }
+    return ttl < 1 ? 1 : (long)ttl;
+}
+
+int next_key(const BenchConfig& config, const ZipfGenerator* zipf, Rng& rng) {
+    if (zipf) {
+        return (int)zipf->next(rng);
+    }
+    return (int)(rng.next() % config.keys);
+}
+
+template <class Map>
+void* bench_thread(void* arg) {
+    BenchThread<Map>* params = (BenchThread<Map>*)arg;
+    const BenchConfig& config = *params->config;
+    Map* exp_map = params->exp_map;
+    ThreadLatencies* latencies = params->latencies;
+    Rng rng(0x9E3779B97F4A7C15ULL * (params->id + 1));
+    long long value_sum = 0;
+    pthread_barrier_wait(params->start);
+    params->begin_ns = now_ns();
+    for (long i = 0; i < config.ops; ++i) {
+        int key = next_key(config, params->zipf, rng);
+        int op = rng.next() % 100;
+        if (op < config.put_pct) {
+            long ttl_ms = next_ttl_ms(config, rng);
+            long long start = now_ns();
+            exp_map->put(key, key + 1, ttl_ms);
+            latencies->put.record(now_ns() - start);
+        } else if (op < config.put_pct + config.get_pct) {
+            long long start = now_ns();
+            value_sum += exp_map->get(key);
+            latencies->get.record(now_ns() - start);
+        } else {
+            long long start = now_ns();
+            exp_map->remove(key);
+            latencies->remove.record(now_ns() - start);
+        }
+    }
+    params->end_ns = now_ns();
+    params->value_sum = value_sum;
+    return NULL;
+}
+
+// Adds the eviction lags of the map to lags. Returns false if the map does not
+// evict on expiry.
+template <class Map>
+bool eviction_lags(const Map& exp_map, LatencyHistogram& lags) {
+    return false;
+}
+template <class Key, class Value, class ExpiryIndex, class Lock, class Clock, class Stats>
+bool eviction_lags(const ExpireMap<Key, Value, ExpiryIndex, Lock, Clock, Stats>& exp_map,
+                   LatencyHistogram& lags) {
+    exp_map.eviction_lags(lags);
+    return true;
+}
+template <class Key, class Value, class Shard>
+bool eviction_lags(const ShardedExpireMap<Key, Value, Shard>& exp_map, LatencyHistogram& lags) {
+    exp_map.eviction_lags(lags);
+    return true;
+}
+
+// Result of a run, as (column, value) pairs. Empty values are missing.
+typedef vector<pair<string, string> > BenchRow;
+
+template <class T>
+string to_str(T value) {
+    ostringstream out;
+    out << value;
+    return out.str();
+}
+
+void add_percentiles(BenchRow& row, const string& prefix, const LatencyHistogram& latencies,
+                     const string& unit) {
+    bool empty = latencies.count() == 0;
+    row.push_back(make_pair(prefix + "_p50_" + unit, empty ? "" : to_str(latencies.percentile(50))));
+    row.push_back(make_pair(prefix + "_p99_" + unit, empty ? "" : to_str(latencies.percentile(99))));
+    row.push_back(make_pair(prefix + "_p999_" + unit,
+                            empty ? "" : to_str(latencies.percentile(99.9))));
+}
+
+template <class Map>
+BenchRow run_bench(const string& name, const BenchConfig& config, int num_threads) {
+    Map* exp_map = new Map();
+    Rng rng(42);
+    for (int key = 0; key < config.keys; ++key) {
+        exp_map->put(key, key + 1, next_ttl_ms(config, rng));
+    }
+    ZipfGenerator* zipf = NULL;
+    if (config.dist == "zipf") {
+        zipf = new ZipfGenerator(config.keys, config.theta);
+    }
+    pthread_barrier_t start;
+    pthread_barrier_init(&start, NULL /* attr */, num_threads + 1);
+    vector<pthread_t> threads(num_threads);
+    vector<BenchThread<Map> > params(num_threads);
+    vector<ThreadLatencies*> latencies(num_threads);
+    for (int i = 0; i < num_threads; ++i) {
+        latencies[i] = new ThreadLatencies();
+        BenchThread<Map> param = { exp_map, &config, zipf, &start, i, latencies[i], 0, 0, 0 };
+        params[i] = param;
+        pthread_create(&threads[i], NULL /* attr */, bench_thread<Map>, &params[i]);
+    }
+    pthread_barrier_wait(&start);
+    for (int i = 0; i < num_threads; ++i) {
+        pthread_join(threads[i], NULL /* ret */);
+    }
+    // The run lasts from the first thread starting to the last one finishing, as
+    // timed by the threads themselves: the workers may be done before this thread
+    // returns from the barrier.
+    long long begin = params[0].begin_ns;
+    long long end = params[0].end_ns;
+    for (int i = 1; i < num_threads; ++i) {
+        begin = min(begin, params[i].begin_ns);
+        end = max(end, params[i].end_ns);
+    }
+    for (int i = 0; i < num_threads; ++i) {
+        value_sink += params[i].value_sum;
+    }
+    double seconds = (end - begin) / 1e9;
+    pthread_barrier_destroy(&start);
+    // Let entries expiring at the end of the run be evicted
+    usleep(config.drain_ms * 1000);
+
+    ThreadLatencies total;
+    for (int i = 0; i < num_threads; ++i) {
+        total.put.merge(latencies[i]->put);
+        total.get.merge(latencies[i]->get);
+        total.remove.merge(latencies[i]->remove);
+        delete latencies[i];
+    }
+    LatencyHistogram lags;
+    bool has_lags = eviction_lags(*exp_map, lags) && lags.count() > 0;
+    delete zipf;
+    delete exp_map;
+
+    long total_ops = config.ops * num_threads;
+    BenchRow row;
+    row.push_back(make_pair("map", name));
+    row.push_back(make_pair("threads", to_str(num_threads)));
+    row.push_back(make_pair("keys", to_str(config.keys)));
+    row.push_back(make_pair("dist", config.dist == "zipf" ? "zipf:" + to_str(config.theta)
+                                                          : config.dist));
+    row.push_back(make_pair("mix", to_str(config.put_pct) + ":" + to_str(config.get_pct) + ":" +
+                                   to_str(config.remove_pct)));
+    row.push_back(make_pair("ttl", config.ttl));
+    row.push_back(make_pair("ops", to_str(total_ops)));
+    row.push_back(make_pair("seconds", to_str(seconds)));
+    row.push_back(make_pair("ops_per_sec", to_str((long long)(total_ops / seconds))));
+    add_percentiles(row, "put", total.put, "ns");
+    add_percentiles(row, "get", total.get, "ns");
+    add_percentiles(row, "remove", total.remove, "ns");
+    row.push_back(make_pair("lag_count", has_lags ? to_str(lags.count()) : ""));
+    LatencyHistogram none;
+    add_percentiles(row, "lag", has_lags ? lags : none, "us");
+    row.push_back(make_pair("lag_max_us", has_lags ? to_str(lags.max()) : ""));
+    return row;
+}
+
+bool is_number(const string& value) {
+    if (value.empty()) return false;
+    char* end = NULL;
+    strtod(value.c_str(), &end);
+    return *end == '\0';
+}
+
+void print_row(const BenchRow& row, const string& format, bool first) {
+    if (format == "json") {
+        cout << (first ? "[\n" : ",\n") << "  {";
+        for (size_t i = 0; i < row.size(); ++i) {
+            const string& value = row[i].second;
+            cout << (i ? ", " : "") << "\"" << row[i].first << "\": ";
+            if (value.empty()) {
+                cout << "null";
+            } else if (is_number(value)) {
+                cout << value;
+            } else {
+                cout << "\"" << value << "\"";
+            }
+        }
+        cout << "}";
+        return;
+    }
+    if (first) {
+        for (size_t i = 0; i < row.size(); ++i) {
+            cout << (i ? "," : "") << row[i].first;
+        }
+        cout << endl;
+    }
+    for (size_t i = 0; i < row.size(); ++i) {
+        cout << (i ? "," : "") << row[i].second;
+    }
+    cout << endl;
+}
+
+vector<string> split(const string& value, char sep) {
+    vector<string> parts;
+    stringstream in(value);
+    string part;
+    while (getline(in, part, sep)) {
+        parts.push_back(part);
+    }
+    return parts;
+}
+
+void usage(const char* prog) {
+    cerr << "Usage: " << prog << " [--maps=expire,wheel,fifo,distlock,sharded,flat,sampled]"
+         << " [--threads=1,2,4,8] [--keys=N] [--ops=N] [--mix=PUT:GET:REMOVE]"
+         << " [--dist=uniform|zipf] [--theta=T] [--ttl=fixed:MS|uniform:MIN:MAX|exp:MEAN]"
+         << " [--drain_ms=MS] [--format=csv|json]" << endl;
+    exit(1);
+}
+
+BenchConfig parse_args(int argc, char *argv[]) {
+    BenchConfig config;
+    string maps = "expire,sharded";
+    string threads = "1,2,4,8";
+    string mix = "10:85:5";
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        size_t eq = arg.find('=');
+        if (arg.compare(0, 2, "--") != 0 || eq == string::npos) usage(argv[0]);
+        string name = arg.substr(2, eq - 2);
+        string value = arg.substr(eq + 1);
+        if (name == "maps") maps = value;
+        else if (name == "threads") threads = value;
+        else if (name == "keys") config.keys = atoi(value.c_str());
+        else if (name == "ops") config.ops = atol(value.c_str());
+        else if (name == "mix") mix = value;
+        else if (name == "dist") config.dist = value;
+        else if (name == "theta") config.theta = atof(value.c_str());
+        else if (name == "ttl") config.ttl = value;
+        else if (name == "drain_ms") config.drain_ms = atol(value.c_str());
+        else if (name == "format") config.format = value;
+        else usage(argv[0]);
+    }
+    config.maps = split(maps, ',');
+    vector<string> counts = split(threads, ',');
+    for (size_t i = 0; i < counts.size(); ++i) {
+        config.threads.push_back(atoi(counts[i].c_str()));
+        if (config.threads.back() <= 0) usage(argv[0]);
+    }
+    vector<string> pcts = split(mix, ':');
+    if (pcts.size() != 3) usage(argv[0]);
+    config.put_pct = atoi(pcts[0].c_str());
+    config.get_pct = atoi(pcts[1].c_str());
+    config.remove_pct = atoi(pcts[2].c_str());
+    if (config.put_pct < 0 || config.get_pct < 0 || config.remove_pct < 0 ||
+        config.put_pct + config.get_pct + config.remove_pct != 100) {
+        usage(argv[0]);
+    }
+    vector<string> ttl = split(config.ttl, ':');
+    if (ttl.empty()) usage(argv[0]);
+    config.ttl_kind = ttl[0];
+    if ((config.ttl_kind == "fixed" || config.ttl_kind == "exp") && ttl.size() == 2) {
+        config.ttl_a = atof(ttl[1].c_str());
+    } else if (config.ttl_kind == "uniform" && ttl.size() == 3) {
+        config.ttl_a = atof(ttl[1].c_str());
+        config.ttl_b = atof(ttl[2].c_str());
+    } else {
+        usage(argv[0]);
+    }
+    if (config.ttl_a <= 0 || config.ttl_b < config.ttl_a) usage(argv[0]);
+    if (config.keys <= 0 || config.ops <= 0 || config.drain_ms < 0) usage(argv[0]);
+    if (config.dist != "uniform" && config.dist != "zipf") usage(argv[0]);
+    if (config.theta <= 0 || config.theta >= 1) usage(argv[0]);
+    if (config.format != "csv" && config.format != "json") usage(argv[0]);
+    return config;
+}
+
+int main(int argc, char *argv[]) {
+    BenchConfig config = parse_args(argc, argv);
+    bool first = true;
+    for (size_t m = 0; m < config.maps.size(); ++m) {
+        const string& name = config.maps[m];
+        for (size_t t = 0; t < config.threads.size(); ++t) {
+            int num_threads = config.threads[t];
+            BenchRow row;
+            if (name == "expire") {
+                row = run_bench<BenchExpireMap>(name, config, num_threads);
+            } else if (name == "wheel") {
+                row = run_bench<BenchWheelExpireMap>(name, config, num_threads);
+            } else if (name == "fifo") {
+                row = run_bench<BenchFifoExpireMap>(name, config, num_threads);
+            } else if (name == "distlock") {
+                row = run_bench<BenchDistLockExpireMap>(name, config, num_threads);
+            } else if (name == "sharded") {
+                row = run_bench<BenchShardedExpireMap>(name, config, num_threads);
+            } else if (name == "flat") {
+                row = run_bench<BenchFlatExpireMap>(name, config, num_threads);
+            } else if (name == "sampled") {
+                row = run_bench<BenchSampledExpireMap>(name, config, num_threads);
+            } else {
+                usage(argv[0]);
+            }
+            print_row(row, config.format, first);
+            first = false;
+        }
+    }
+    if (config.format == "json" && !first) {
+        cout << "\n]" << endl;
+    }
+    return 0;
+}
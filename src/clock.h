@@ -0,0 +1,103 @@
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#include <atomic>
+using namespace std;
+#include <chrono>
+using namespace std::chrono;
+#include <pthread.h>
+#include <unistd.h>
+
+//
+// Clock policies
+// ==============================================================================
+//
+// Time source of an ExpireMap, selected with the Clock template parameter. Every
+// policy provides
+//
+// static long long now()
+// - Current time in microseconds. The epoch is arbitrary but fixed for the life of
+//   the process, so times of different clocks must not be compared.
+//
+
+//
+// SteadyClock
+// ------------------------------------------------------------------------------
+// std::chrono::steady_clock. Monotonic. Each call reads the clock, which is a
+// syscall on platforms without a vDSO clock.
+//
+struct SteadyClock {
+    static long long now() {
+        return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+    }
+};
+
+//
+// CoarseClock
+// ------------------------------------------------------------------------------
+// SteadyClock cached in an atomic. A background ticker thread, shared by all users
+// of the clock, refreshes it every IntervalUs microseconds. Reading the clock is a
+// single relaxed atomic load. The time lags the steady clock by up to IntervalUs
+// (more if the ticker is descheduled), so entries may expire up to that much
+// early on put and be served up to that much late on get.
+//
+// The ticker is started on first use and stopped at process exit.
+//
+template <long long IntervalUs = 1000>
+class CoarseClock {
+    private: // Types
+        struct Ticker {
+            atomic<long long> time;
+            atomic<bool> shutdown;
+            pthread_t thread;
+            Ticker() : time(SteadyClock::now()), shutdown(false) {
+                pthread_create(&thread, NULL /* attr */, tick, this);
+            }
+            ~Ticker() {
+                shutdown = true;
+                pthread_join(thread, NULL /* ret */);
+            }
+            static void* tick(void* arg) {
+                Ticker* ticker = (Ticker*)arg;
+                while (!ticker->shutdown.load(memory_order_relaxed)) {
+                    usleep(IntervalUs);
+                    ticker->time.store(SteadyClock::now(), memory_order_relaxed);
+                }
+                return NULL;
+            }
+        };
+
+    private: // Helpers
+        static Ticker& _ticker() {
+            static Ticker ticker;
+            return ticker;
+        }
+
+    public: // Accessors
+        static long long now() { return _ticker().time.load(memory_order_relaxed); }
+}; // CoarseClock
+
+//
+// ManualClock
+// ------------------------------------------------------------------------------
+// Clock that only moves when told to. Meant for deterministic tests. Time is
+// shared by all users of the clock. Starts at 0.
+//
+class ManualClock {
+    private: // Data
+        static atomic<long long>& _time() {
+            static atomic<long long> time(0);
+            return time;
+        }
+
+    public: // Accessors
+        static long long now() { return _time().load(memory_order_acquire); }
+        // Sets the time. Time must not move backwards.
+        static void set(long long time) { _time().store(time, memory_order_release); }
+        // Moves the time forward by us microseconds. Returns the new time.
+        static long long advance(long long us) {
+            return _time().fetch_add(us, memory_order_acq_rel) + us;
+        }
+}; // ManualClock
+
+#endif // CLOCK_H
@@ -0,0 +1,187 @@
+#ifndef EVENT_RING_H
+#define EVENT_RING_H
+
+#include <vector>
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+using namespace std;
+#include <sched.h>
+
+//
+// EventRing
+// ==============================================================================
+//
+// Bounded lock free multi producer multi consumer queue (the bounded MPMC queue of
+// Dmitry Vyukov). Capacity is rounded up to a power of two. Each cell carries a
+// sequence number that tells producers whether the cell is free and consumers
+// whether it is full, so a push or pop is one CAS on the shared position plus a
+// store to the cell. Producers and consumers only contend on their own position,
+// each on its own cache line.
+//
+// The overflow policy tells producers what to do when the ring is full:
+// - kDropOnOverflow: drop the element and count it in dropped().
+// - kBlockOnOverflow: wait for consumers to make room. A producer must not wait
+//   while it is the only consumer.
+//
+// bool try_push(T&& value)
+// - Moves value into the ring unless it is full. value is untouched on failure.
+//
+// bool push(T&& value)
+// - try_push following the overflow policy. Returns false if the value was dropped.
+//
+// bool try_pop(T& value)
+// size_t pop_batch(vector<T>& out, size_t max_items)
+// - Moves up to max_items elements to the end of out. Returns the number moved.
+//
+// T must be default constructible and move assignable.
+//
+enum OverflowPolicy {
+    kDropOnOverflow,
+    kBlockOnOverflow
+};
+
+template <class T>
+class EventRing {
+    private: // Types
+        static const int kCacheLine = 64;
+        struct Cell {
+            atomic<size_t> sequence;
+            T value;
+        };
+
+    private: // Data
+        Cell* _cells;
+        size_t _mask;
+        OverflowPolicy _policy;
+        alignas(kCacheLine) atomic<size_t> _push_pos;
+        alignas(kCacheLine) atomic<size_t> _pop_pos;
+        alignas(kCacheLine) atomic<uint64_t> _dropped;
+
+    public: // Constructor/Desctructor
+        explicit EventRing(size_t capacity, OverflowPolicy policy = kDropOnOverflow)
+            : _cells(NULL), _mask(0), _policy(policy), _push_pos(0), _pop_pos(0), _dropped(0) {
+            size_t size = 2;
+            while (size < capacity) {
+                size <<= 1;
+            }
+            _cells = new Cell[size];
+            _mask = size - 1;
+            for (size_t i = 0; i < size; ++i) {
+                _cells[i].sequence.store(i, memory_order_relaxed);
+            }
+        }
+        ~EventRing() { delete[] _cells; }
+
+    public: // Accessors
+        bool try_push(T&& value) {
+            size_t pos = _push_pos.load(memory_order_relaxed);
+            Cell* cell;
+            while (true) {
+                cell = &_cells[pos & _mask];
+                size_t sequence = cell->sequence.load(memory_order_acquire);
+                intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+                if (diff == 0) {
+                    // Cell is free. Claim it.
+                    if (_push_pos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) {
+                        break;
+                    }
+                } else if (diff < 0) {
+                    // Cell still holds the element of the previous lap
+                    return false;
+                } else {
+                    pos = _push_pos.load(memory_order_relaxed);
+                }
+            }
+            cell->value = move(value);
+            cell->sequence.store(pos + 1, memory_order_release);
+            return true;
+        }
+        bool push(T&& value) {
+            if (try_push(move(value))) {
+                return true;
+            }
+            if (_policy == kDropOnOverflow) {
+                count_dropped(1);
+                return false;
+            }
+            while (!try_push(move(value))) {
+                sched_yield();
+            }
+            return true;
+        }
+        bool try_pop(T& value) {
+            size_t pos = _pop_pos.load(memory_order_relaxed);
+            Cell* cell;
+            while (true) {
+                cell = &_cells[pos & _mask];
+                size_t sequence = cell->sequence.load(memory_order_acquire);
+                intptr_t diff = (intptr_t)sequence - (intptr_t)(pos + 1);
+                if (diff == 0) {
+                    // Cell is full. Claim it.
+                    if (_pop_pos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) {
+                        break;
+                    }
+                } else if (diff < 0) {
+                    // Empty
+                    return false;
+                } else {
+                    pos = _pop_pos.load(memory_order_relaxed);
+                }
+            }
+            value = move(cell->value);
+            // Free the cell for the push of the next lap
+            cell->sequence.store(pos + _mask + 1, memory_order_release);
+            return true;
+        }
+        size_t pop_batch(vector<T>& out, size_t max_items) {
+            size_t popped = 0;
+            T value;
+            while (popped < max_items && try_pop(value)) {
+                out.push_back(move(value));
+                ++popped;
+            }
+            return popped;
+        }
+        // Counts elements dropped by producers applying the overflow policy themselves
+        void count_dropped(uint64_t n) { _dropped.fetch_add(n, memory_order_relaxed); }
+        uint64_t dropped() const { return _dropped.load(memory_order_relaxed); }
+        OverflowPolicy policy() const { return _policy; }
+        size_t capacity() const { return _mask + 1; }
+        // Number of elements in the ring. Approximate while producers or consumers run.
+        size_t size() const {
+            size_t push_pos = _push_pos.load(memory_order_relaxed);
+            size_t pop_pos = _pop_pos.load(memory_order_relaxed);
+            return push_pos > pop_pos ? push_pos - pop_pos : 0;
+        }
+
+    private: // Not copyable
+        EventRing(const EventRing&);
+        EventRing& operator=(const EventRing&);
+}; // EventRing
+
+//
+// ExpireEvent
+// ==============================================================================
+//
+// Entry that left an ExpireMap, with the reason it left. Published to an EventRing
+// set with ExpireMap::set_event_ring().
+//
+enum ExpireReason {
+    kExpired,       // Evicted after its expiry
+    kEvicted,       // Evicted to keep the map within its capacity
+    kRemoved        // Removed by remove or multi_remove
+};
+
+template <class Key, class Value>
+struct ExpireEvent {
+    Key key;
+    Value value;
+    ExpireReason reason;
+    ExpireEvent() : key(), value(), reason(kExpired) { }
+    ExpireEvent(Key&& p_key, Value&& p_value, ExpireReason p_reason)
+        : key(move(p_key)), value(move(p_value)), reason(p_reason) { }
+};
+
+#endif // EVENT_RING_H
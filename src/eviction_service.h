@@ -0,0 +1,199 @@
+#ifndef EVICTION_SERVICE_H
+#define EVICTION_SERVICE_H
+
+#include <map>
+#include <time.h>
+#include <cassert>
+using namespace std;
+#include <pthread.h>
+#include "clock.h"
+
+//
+// EvictionService
+// ==============================================================================
+//
+// A single eviction thread shared by many maps. By default every ExpireMap spawns
+// its own eviction thread that wakes up at least every 4 ms, even when the map is
+// idle. A map constructed with an EvictionService has no thread of its own.
+// Instead it registers with the service, and the service thread evicts it when
+// its earliest expiry is due.
+//
+// The service thread sleeps on a condition variable (on the monotonic clock) till
+// the earliest deadline of all registered maps. A map arms its deadline after each
+// round of eviction. A put only signals the service when it creates an expiry
+// earlier than the deadline armed for its map, so an idle service does not wake
+// up at all and a busy one wakes up once per distinct deadline.
+//
+// Deadlines are delays relative to the time of arming, so maps on any Clock can
+// share a service. The wait itself always follows the steady clock.
+//
+// The service must outlive the maps registered with it. shared() returns a process
+// wide instance that is destroyed at exit, after any map constructed after its
+// first use.
+//
+class EvictionService {
+    public: // Types
+        // Implemented by maps that register with the service
+        class Client {
+            public:
+                virtual ~Client() { }
+                // Runs a round of eviction. Returns microseconds till the next expiry or
+                // -1 if nothing is left to expire.
+                virtual long long evict() = 0;
+        };
+
+    private: // Types
+        typedef multimap<long long, Client*> Deadlines;
+        typedef map<Client*, Deadlines::iterator> Armed;
+
+    private: // Data
+        Deadlines _deadlines;       // Armed deadline of each client, earliest first
+        Armed _armed;               // Registered clients and their armed deadline.
+                                    // Clients without a deadline map to _deadlines.end().
+        Client* _running;           // Client being evicted by the service thread, if any
+        bool _shutdown;
+        long long _wakeups;         // Number of times the service thread woke up
+        pthread_mutex_t _lock;      // Protects all of the above
+        pthread_cond_t _wake;       // Signalled when the earliest deadline moves forward
+        pthread_cond_t _done;       // Signalled when the service thread finishes a client
+        pthread_t _thread;
+
+    public: // Constructor/Desctructor
+        EvictionService() : _running(NULL), _shutdown(false), _wakeups(0) {
+            int ret = pthread_mutex_init(&_lock, NULL /* attr */);
+            assert(ret == 0);
+            pthread_condattr_t attr;
+            pthread_condattr_init(&attr);
+            pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+            ret = pthread_cond_init(&_wake, &attr);
+            assert(ret == 0);
+            pthread_condattr_destroy(&attr);
+            ret = pthread_cond_init(&_done, NULL /* attr */);
+            assert(ret == 0);
+            pthread_create(&_thread, NULL /* attr */, run, this);
+        }
+        ~EvictionService() {
+            pthread_mutex_lock(&_lock);
+            assert(_armed.empty());
+            _shutdown = true;
+            pthread_cond_signal(&_wake);
+            pthread_mutex_unlock(&_lock);
+            pthread_join(_thread, NULL /* ret */);
+            pthread_cond_destroy(&_done);
+            pthread_cond_destroy(&_wake);
+            pthread_mutex_destroy(&_lock);
+        }
+
+    public: // Accessors
+        // Process wide service
+        static EvictionService& shared() {
+            static EvictionService service;
+            return service;
+        }
+        // Registers client. The client is not evicted till it arms a deadline.
+        void add(Client* client) {
+            pthread_mutex_lock(&_lock);
+            assert(_armed.find(client) == _armed.end());
+            _armed.insert(make_pair(client, _deadlines.end()));
+            pthread_mutex_unlock(&_lock);
+        }
+        // Unregisters client. Blocks while the service thread is evicting it, so the
+        // client is never called after this returns.
+        void remove(Client* client) {
+            pthread_mutex_lock(&_lock);
+            while (_running == client) {
+                pthread_cond_wait(&_done, &_lock);
+            }
+            Armed::iterator iter = _armed.find(client);
+            assert(iter != _armed.end());
+            if (iter->second != _deadlines.end()) {
+                _deadlines.erase(iter->second);
+            }
+            _armed.erase(iter);
+            pthread_mutex_unlock(&_lock);
+        }
+        // Arms a deadline delay_us microseconds from now for client, unless an earlier
+        // one is already armed. Wakes up the service thread only if the deadline is
+        // earlier than all armed deadlines.
+        void schedule(Client* client, long long delay_us) {
+            long long deadline = SteadyClock::now() + (delay_us > 0 ? delay_us : 0);
+            pthread_mutex_lock(&_lock);
+            if (_arm(client, deadline) && _deadlines.begin()->second == client) {
+                pthread_cond_signal(&_wake);
+            }
+            pthread_mutex_unlock(&_lock);
+        }
+
+    private: // Helpers
+        // Arms deadline for client if it is earlier than its armed deadline. Returns
+        // true if the deadline was armed. Called with _lock held.
+        bool _arm(Client* client, long long deadline) {
+            Armed::iterator iter = _armed.find(client);
+            if (iter == _armed.end()) {
+                // Unregistered or being unregistered
+                return false;
+            }
+            if (iter->second != _deadlines.end()) {
+                if (iter->second->first <= deadline) {
+                    return false;
+                }
+                _deadlines.erase(iter->second);
+            }
+            iter->second = _deadlines.insert(make_pair(deadline, client));
+            return true;
+        }
+        // Service thread
+        static void* run(void* arg) {
+            EvictionService* service = (EvictionService*)arg;
+            pthread_mutex_lock(&service->_lock);
+            while (!service->_shutdown) {
+                if (service->_deadlines.empty()) {
+                    pthread_cond_wait(&service->_wake, &service->_lock);
+                    ++service->_wakeups;
+                    continue;
+                }
+                Deadlines::iterator first = service->_deadlines.begin();
+                long long curtime = SteadyClock::now();
+                if (first->first > curtime) {
+                    struct timespec until;
+                    until.tv_sec = first->first / 1000000;
+                    until.tv_nsec = (first->first % 1000000) * 1000;
+                    pthread_cond_timedwait(&service->_wake, &service->_lock, &until);
+                    ++service->_wakeups;
+                    continue;
+                }
+                // Disarm the client and evict it without holding the lock, so that puts
+                // on other maps can arm deadlines meanwhile
+                Client* client = first->second;
+                service->_armed[client] = service->_deadlines.end();
+                service->_deadlines.erase(first);
+                service->_running = client;
+                pthread_mutex_unlock(&service->_lock);
+                long long next = client->evict();
+                curtime = SteadyClock::now();
+                pthread_mutex_lock(&service->_lock);
+                service->_running = NULL;
+                if (next >= 0) {
+                    service->_arm(client, curtime + next);
+                }
+                pthread_cond_broadcast(&service->_done);
+            }
+            pthread_mutex_unlock(&service->_lock);
+            return NULL;
+        }
+
+    public: // APIs for test
+        // Returns the number of times the service thread woke up
+        long long debug_wakeups() {
+            pthread_mutex_lock(&_lock);
+            long long wakeups = _wakeups;
+            pthread_mutex_unlock(&_lock);
+            return wakeups;
+        }
+
+    private: // Not copyable
+        EvictionService(const EvictionService&);
+        EvictionService& operator=(const EvictionService&);
+}; // EvictionService
+
+#endif // EVICTION_SERVICE_H
@@ -5,11 +5,35 @@
 #include <map>
 #include <set>
 #include <iostream>
+#include <functional>
+#include <algorithm>
+#include <string>
+#include <type_traits>
+#include <memory>
+#include <memory_resource>
+#include <optional>
+#include <tuple>
+#include <utility>
 #include <cassert>
+#include <climits>
+#include <cstdint>
+#include <atomic>
+#include <exception>
 using namespace std;
-#include <chrono>
-using namespace std::chrono;
 #include <pthread.h>
+#include <unistd.h>
+#include <sched.h>
+#include "expiry_index.h"
+#include "key_traits.h"
+#include "rw_lock.h"
+#include "clock.h"
+#include "eviction_service.h"
+#include "histogram.h"
+#include "pool_resource.h"
+#include "stats.h"
+#include "snapshot.h"
+#include "event_ring.h"
+#include "loader_pool.h"
 
 //
 // ExpireMap
@@ -18,7 +42,35 @@ using namespace std::chrono;
 // This class provides a map that stores KV pairs with an associated expiry time.
 // Entries become invalid after the expiry given while adding an element.
 //
-// Constructor does not take any arguments.
+// Constructor optionally takes an EvictionService. By default each ExpireMap runs
+// its own eviction thread. With a service the map has no thread and is evicted by
+// the thread of the service, which only wakes up when an entry is due.
+//
+// Constructor also optionally takes a memory resource that allocates the nodes of
+// the data table and of the expiry index. Defaults to the global heap. A
+// NodePoolResource (see pool_resource.h) recycles the nodes freed by eviction, so
+// steady state churn does not allocate from the global heap. Keys and values that
+// allocate memory of their own still do so with their own allocators.
+//
+// The structure used to track expiry of entries is selected with the ExpiryIndex
+// template parameter (see expiry_index.h). Defaults to an ordered map of expiry
+// times. TimingWheelExpiryIndex trades exact expiry (entries are evicted up to one
+// tick late) for O(1) schedule and cancel.
+//
+// Each key is stored once, in the data table. The expiry index holds keys that fit
+// in a pointer by value and other keys by their address in the data table (see
+// key_traits.h). Lookups take a KeyView, which is const Key& except for string
+// keys: a StringKeyView is built from a string, a string_view or a C string
+// without copying the key, so get and remove allocate nothing, and a caller may
+// pass the hash of the key along with it.
+//
+// The lock protecting the data table is selected with the Lock template parameter
+// (see rw_lock.h). Defaults to a pthread rwlock. DistributedRWLock keeps readers
+// from writing to shared memory so that get scales with the number of threads.
+//
+// The time source is selected with the Clock template parameter (see clock.h).
+// Defaults to the monotonic steady clock. CoarseClock replaces the clock read on
+// every operation by an atomic load. ManualClock makes tests deterministic.
 //
 // void put(K key, V value, long timeoutMs)
 // - Adds a the key value pair to the map. The KV pair is valid from the
@@ -29,46 +81,252 @@ using namespace std::chrono;
 // - When a put is called for an existing key, the value and timeout are
 //  overwritten with the new input.
 // - Put calls with zero or negative timeout are ignored
+// - Key and value are moved into the map, so put(move(key), move(value), ...)
+//   copies neither. emplace(key, timeoutMs, args...) builds the value from args.
 //
-// V get(K key)
+// V get(KeyView key)
 // - Returns an unexpired value for the key if it exists in the map
-// - Returns NULL otherwise
+// - Returns Value() otherwise (NULL for pointers, 0 for numbers)
+//
+// optional<V> try_get(KeyView key)
+// - Same as get, but tells a miss apart from a stored Value().
 //
-// void remove(Key key)
+// bool with_value(KeyView key, Visitor visitor)
+// - Calls visitor(const V&) on the unexpired value of the key under the read lock,
+//   without copying it. Returns false if there is no such value. The visitor must
+//   not call back into the map.
+//
+// Large values can be stored as shared_ptr<const V> (SharedValueExpireMap), so that
+// get only copies a pointer and readers can keep using the value after it is
+// overwritten, removed or expired.
+//
+// void remove(KeyView key)
 // - Removes an entry from the ExpireMap
 //
-template <class Key, class Value>
-class ExpireMap {
+// bool touch(KeyView key, long timeoutMs), V get_and_touch(KeyView key, long timeoutMs)
+// - Sliding expiration. Moves the expiry of an unexpired entry to timeoutMs from
+//   now, without rewriting the value. get_and_touch also returns the value, or
+//   Value() if there is none. touch returns false if there is no unexpired entry.
+// - Extending the expiry only stores the new expiry in the entry with the data
+//   table read locked. The expiry queue keeps the old expiry, and when eviction
+//   pops the entry there it puts it back at its new expiry instead of evicting it.
+//   A key touched on every access is thus moved in the expiry queue at most once
+//   per timeout. Moving the expiry closer takes the write lock and moves the entry
+//   in the expiry queue right away, like put.
+//
+// V get_or_load(const K& key, Loader loader, long timeoutMs)
+// - Same as get, but on a miss calls loader(key) to get the value and puts it with
+//   timeoutMs. Misses on a key are coalesced: while one caller runs the loader, the
+//   others wait for and share its result instead of all calling the backend at
+//   once. An exception thrown by the loader is rethrown to all of them and nothing
+//   is put.
+// - set_refresh_ahead(pool, fraction) turns on refresh-ahead: a hit in the last
+//   fraction of timeoutMs returns the current value and reloads the key once on
+//   the LoaderPool (see loader_pool.h), so hot keys are replaced before they expire.
+//   Errors of background reloads are dropped and the old value expires as usual.
+//   The map waits for its outstanding reloads when destroyed.
+//
+// Eviction holds the data table write lock for bounded slices and releases it in
+// between, so that a burst of expiries does not stall readers. A slice evicts up
+// to 1024 keys by default. set_eviction_slice() bounds slices by a number of keys
+// and/or by microseconds of lock hold. Pause lengths are recorded in a histogram,
+// and so is the lag from the expiry of each entry to its removal.
+//
+// The map is bounded only by the timeouts of its entries unless set_capacity() sets
+// a limit on the number of entries and/or on their total size in bytes as measured
+// by a user supplied sizer. A put that takes the map over the limit evicts entries
+// by sampled LRU: a few random entries are sampled and the least recently accessed
+// one is evicted (expired ones first). While a limit is set, get records the time
+// of access in the entry with a relaxed atomic store, taking no lock beyond the
+// read lock. The time is kept at a resolution of kAccessResolutionUs, so a hot key
+// is written at most once per millisecond. Without a limit get writes nothing to
+// the entry. Capacity evictions and expirations are counted separately.
+//
+// multi_put/multi_get/multi_remove
+// - Same as put/get/remove on each key of a range. The clock is read once and each
+//   lock is taken once for the whole batch.
+//
+// bool save_snapshot(const string& path), bool load_snapshot(const string& path)
+// - Save the unexpired entries to a file and load them back, for a warm restart.
+//   Entries keep their remaining time to live across the restart (see snapshot.h
+//   for the format). Keys and values must be trivially copyable, or a codec that
+//   converts them to bytes is passed as a second argument. Loading skips entries
+//   that have expired since the save and builds the expiry index in bulk, in
+//   order of expiry. Loaded entries overwrite entries with the same key. Both
+//   return false if the file cannot be written or read, or is not a snapshot of
+//   the key and value types. A failed load leaves the map unchanged. save also
+//   returns false, writing nothing, if a codec encodes a key or value of 4 GiB or
+//   more.
+// - save copies every unexpired entry and sorts the copies by expiry before
+//   writing them, so it needs about as much memory again as the entries of the
+//   map while it runs. load with a codec decodes the whole file before changing
+//   the map, and so holds a copy of its entries too.
+//
+// size_t for_each_live(Visitor visitor), void snapshot(vector<SnapshotEntry>& entries)
+// - Enumerate the entries unexpired at the start of the call, as they were at that
+//   point in time, without holding writers off for the whole walk. for_each_live
+//   calls visitor(const K&, const V&) once per entry, with no lock held, so the
+//   visitor may call back into the map. Returns the number of entries visited.
+// - Every write numbers the entry it changes. A scan records the number of the last
+//   write and the time when it starts, then walks the buckets of the data table a
+//   slice at a time under the read lock, skipping entries written after the start.
+//   A write that changes or erases an entry the walk has not reached yet saves the
+//   entry as it was for the scan first. An insert that would rehash the table
+//   first saves the entries of every bucket the walk has not reached yet, since a
+//   rehash moves entries between buckets, and the walk ends there. So the table
+//   grows as usual during a scan, at the cost of one copy of the rest of the walk
+//   per scan that sees a rehash. Each scan keeps its own progress and
+//   saved entries, so scans may overlap, and a visitor may start another scan, such
+//   as for_each_live, snapshot or save_snapshot, on the same map.
+// - parallel_for_each_live(num_threads, visitor) splits the buckets into num_threads
+//   ranges walked by a thread each. visitor is called concurrently.
+// - save_snapshot collects entries with the same scan.
+//
+// void set_event_ring(EventRing<Event>* ring)
+// - Publishes every entry that leaves the map (key, value and reason: expired,
+//   evicted over capacity or removed) to ring, for consumers that drain it in
+//   batches on threads of their own (see event_ring.h). Entries are collected while
+//   the data table is write locked and published after it is unlocked, so a full
+//   ring never holds up readers. With kDropOnOverflow events that do not fit are
+//   dropped and counted by the ring. With kBlockOnOverflow eviction on expiry waits
+//   for room, which slows eviction down to the pace of the consumers. Waiting stops
+//   when the map is destroyed. Callers never wait: events of removes, of capacity
+//   evictions in put and of loads that do not fit are dropped and counted under
+//   either policy. The ring may be shared by several maps and must
+//   outlive them. NULL, the default, turns events off.
+//
+// Statistics are collected by the Stats template parameter (see stats.h). NoStats,
+// the default, compiles to nothing. ThreadStats counts hits, misses, gets of
+// expired entries, puts and removes in per thread counters, and records the wait
+// of contended lock acquisitions and the sizes of eviction slices. stats() fills a
+// snapshot with these and with the always on eviction metrics and sizes.
+//
+template <class Key, class Value, class ExpiryIndex = OrderedExpiryIndex<Key>,
+          class Lock = PthreadRWLock, class Clock = SteadyClock, class Stats = NoStats>
+class ExpireMap : private EvictionService::Client {
     public: // Types
+        // How keys are stored, hashed and looked up
+        typedef KeyTraits<Key> KeyTrait;
+        typedef typename KeyTrait::View KeyView;
+        typedef typename KeyTrait::Hash KeyHash;
+        typedef typename KeyTrait::IndexKey IndexKey;
+        // Type to track expired KVs in order of expiry. Holds the keys of the data
+        // table as IndexKey.
+        typedef typename ExpiryIndex::template Rebind<IndexKey> ExpiryQueue;
+        typedef typename ExpiryQueue::Handle ExpiryHandle;
+        typedef vector<pair<long long, IndexKey> > ExpiredEntries;
         // Types for hash table to store and lookup KVs
+        // Each value carries the handle of its entry in the expiry queue so that overwrite
+        // and remove unlink the entry without looking it up again.
+        // last_access is updated by get with the data table read locked, while a
+        // capacity limit is set.
+        // expiry is raised by touch with the data table read locked. The expiry queue
+        // keeps the expiry of the last write, which is never later than expiry.
+        // version is the number of the last write of the entry, for scans.
         typedef struct TimedValue {
             Value value;
-            long long expiry;
-            TimedValue() : value(), expiry(0) { }
-            TimedValue(Value p_value, long long p_expiry)
-                : value(p_value), expiry(p_expiry) { }
+            atomic<long long> expiry;
+            ExpiryHandle handle;
+            atomic<long long> last_access;
+            uint64_t version;
+            TimedValue() : value(), expiry(0), handle(), last_access(0), version(0) { }
+            TimedValue(const TimedValue& other)
+                : value(other.value), expiry(other.expiry.load(memory_order_relaxed)),
+                  handle(other.handle),
+                  last_access(other.last_access.load(memory_order_relaxed)),
+                  version(other.version) { }
         } TimedValue;
-        typedef unordered_map<Key, TimedValue> KVStore;
-        // Type to track expired KVs
-        // This is an ordered map keyed by expiry times in order from earliest to latest.
-        // The value for each expiry time is a unique set of keys expiring at that time.
-        typedef map<long long, set<Key> > ExpiryQueue;
-        typedef typename ExpiryQueue::iterator ExpiryIterator;
-        typedef typename set<Key>::iterator KeyIterator;
+        typedef pmr::unordered_map<Key, TimedValue, KeyHash, typename KeyTrait::Equal> KVStore;
+        // Size in bytes accounted for an entry
+        typedef function<size_t(const Key&, const Value&)> Sizer;
+        // Entry that left the map, and the ring events are published to
+        typedef ExpireEvent<Key, Value> Event;
+        typedef EventRing<Event> EventStream;
+        // Entry of a point in time view of the map. expiry is a deadline on the wall
+        // clock when read from a snapshot file.
+        typedef struct SnapshotEntry {
+            long long expiry;
+            Key key;
+            Value value;
+        } SnapshotEntry;
+
+    private: // Types
+        // Load of a key by get_or_load, shared by the callers that miss on the key while
+        // it runs. Fields are set before done and read after it, under _flight_lock.
+        typedef struct Flight {
+            bool done;
+            Value value;
+            exception_ptr error;
+            Flight() : done(false), value(), error() { }
+        } Flight;
+        typedef unordered_map<Key, shared_ptr<Flight> > Flights;
+        // Running scan. Protected by data_tbl_lock.
+        typedef struct Scan {
+            uint64_t version;           // Last write included in the scan
+            long long time;             // Entries expired at this time are left out
+            size_t range_size;          // Buckets per range of the scan
+            vector<size_t> progress;    // Next bucket each range of the scan walks
+            vector<SnapshotEntry> saved;    // Entries changed before the scan reached them
+            bool walked;                // Set once the buckets left to walk are saved
+        } Scan;
+        // Range of buckets walked by one thread of a scan
+        template <class Visitor>
+        struct ScanRange {
+            ExpireMap* exp_map;
+            Scan* scan;
+            Visitor* visitor;
+            size_t range;
+            size_t visited;
+        };
 
     private: // Data
         KVStore _data_table;        // Hash table to store and lookup KVs
         ExpiryQueue _expiry_queue;  // Queue to track KVs in order of expiry
-        bool _shutdown;             // Tracks if shutdown has been initiated. Set in the
+        atomic<bool> _shutdown;     // Tracks if shutdown has been initiated. Set in the
                                     // destructor. ExpireMap stops serving set/get requests once
                                     // this has been set.
         pthread_t eviction_thread;  // Thread that evicts invalid entries from the data table
+                                    // when there is no eviction service
+        EvictionService* _service;  // Service that evicts the map, if any
+        long long _armed_expiry;    // Earliest expiry the service is armed for. Protected
+                                    // by expiry_q_lock.
+        atomic<size_t> _slice_keys; // Most keys evicted per slice of eviction
+        atomic<long long> _slice_us; // Most microseconds of lock hold per slice of eviction
+        LatencyHistogram _eviction_pauses; // Time the data table is write locked per slice
+        LatencyHistogram _eviction_lags;   // Time from expiry to removal of each entry
+        // Capacity limit. Protected by data_tbl_lock.
+        size_t _max_entries;        // Most entries in the data table
+        size_t _max_bytes;          // Most bytes accounted by _sizer
+        Sizer _sizer;               // Accounts the bytes of an entry, if set
+        size_t _bytes;              // Bytes accounted for the entries in the data table
+        bool _track_access;         // Set while a limit is set. get records accesses.
+        unsigned long long _rng;    // State of the generator of entries to sample
+        atomic<uint64_t> _expirations;          // Entries evicted on expiry
+        atomic<uint64_t> _capacity_evictions;   // Entries evicted over capacity
+        [[no_unique_address]] Stats _stats;     // Hot path statistics, if enabled
+        // Event stream. Protected by data_tbl_lock.
+        EventStream* _events;       // Ring events are published to, if set
+        vector<Event> _pending_events;  // Events to publish when the data table is unlocked
+        // Scans. Protected by data_tbl_lock.
+        uint64_t _version;          // Number of the last write
+        vector<Scan*> _scans;       // Running scans
+        // Loads. Protected by _flight_lock.
+        Flights _flights;           // Keys being loaded by get_or_load
+        int _refreshes;             // Reloads queued or running on _loader_pool
+        LoaderPool* _loader_pool;   // Pool running refresh-ahead reloads, if any. Set
+        double _refresh_ahead;      // before use, read without the lock.
     private: // Data protection
-        pthread_rwlock_t data_tbl_lock;
+        // Lock order is data_tbl_lock followed by expiry_q_lock. The expiry queue is only
+        // modified with the data table write locked, so handles in the data table always
+        // refer to live entries in the expiry queue.
+        Lock data_tbl_lock;
         pthread_mutex_t expiry_q_lock;
+        // Taken before data_tbl_lock, never while holding it
+        pthread_mutex_t _flight_lock;
+        pthread_cond_t _flight_done;    // Signalled when a flight or a reload finishes
 
     public: // Constructor/Desctructor
-    ExpireMap();
+    explicit ExpireMap(EvictionService* service = NULL, pmr::memory_resource* resource = NULL);
     ~ExpireMap();
 
     public: // Accessors
@@ -79,36 +337,269 @@ class ExpireMap {
         // If the newly added entry is not removed after timeoutMs since it's added to
         // the map, remove it.
         void put(Key key, Value value, long timeoutMs);
-        // Get the value associated with the key if present; otherwise, return null.
-        Value get(Key key);
+        // Same as put with the value constructed from args
+        template <class... Args>
+        void emplace(Key key, long timeoutMs, Args&&... args) {
+            put(move(key), Value(forward<Args>(args)...), timeoutMs);
+        }
+        // Get the value associated with the key if present; otherwise, return Value().
+        Value get(KeyView key);
+        // Get the value associated with the key if present; otherwise, return nullopt.
+        optional<Value> try_get(KeyView key);
+        // Call visitor with the value associated with the key under the read lock, if
+        // present. Returns true if the visitor was called.
+        template <class Visitor>
+        bool with_value(KeyView key, Visitor visitor);
         // Remove the entry associated with key, if any.
-        void remove(Key key);
+        void remove(KeyView key);
+        // Move the expiry of the key to timeoutMs from now, if the key is present.
+        // Returns true if the key was present.
+        bool touch(KeyView key, long timeoutMs) { return _touch(key, timeoutMs, NULL); }
+        // Same as touch, returning the value associated with the key if present;
+        // otherwise, return Value().
+        Value get_and_touch(KeyView key, long timeoutMs) {
+            Value value = Value();
+            _touch(key, timeoutMs, &value);
+            return value;
+        }
+        // Get the value associated with the key if present; otherwise, load it with
+        // loader(key), coalescing concurrent misses on the key, and put it.
+        template <class Loader>
+        Value get_or_load(const Key& key, Loader loader, long timeoutMs);
+        // Reload keys hit by get_or_load in the last fraction of their timeout on pool.
+        // NULL turns refresh-ahead off. Call before the map is used by other threads.
+        void set_refresh_ahead(LoaderPool* pool, double fraction);
+
+    public: // Eviction
+        // Default number of keys evicted per slice
+        static const size_t kDefaultSliceKeys = 1024;
+        // Keys popped between checks of the time of a slice with a time limit
+        static const size_t kEvictChunk = 64;
+        // Bounds each slice of eviction to max_keys keys and max_hold_us microseconds of
+        // holding the data table write lock. SIZE_MAX and LLONG_MAX lift the bounds. A
+        // slice always evicts at least one key.
+        void set_eviction_slice(size_t max_keys, long long max_hold_us = LLONG_MAX);
+        // Adds the lengths of all eviction slices so far, in microseconds, to pauses
+        void eviction_pauses(LatencyHistogram& pauses) const {
+            pauses.merge(_eviction_pauses);
+        }
+        // Adds the time from expiry to removal of every entry evicted on expiry so far,
+        // in microseconds, to lags
+        void eviction_lags(LatencyHistogram& lags) const {
+            lags.merge(_eviction_lags);
+        }
+
+    public: // Capacity
+        // Entries sampled per capacity eviction
+        static const int kCapacitySamples = 5;
+        // Resolution of the time of last access recorded by get
+        static const long long kAccessResolutionUs = 1000;
+        // Limits the map to max_entries entries and, if sizer is set, to max_bytes bytes
+        // as accounted by sizer. The sizer must return the same size for an entry every
+        // time. Evicts entries right away if the map is over the new limit. SIZE_MAX
+        // lifts a limit.
+        void set_capacity(size_t max_entries, size_t max_bytes = SIZE_MAX,
+                          Sizer sizer = Sizer());
+        // Number of entries evicted on expiry
+        uint64_t expirations() const { return _expirations.load(memory_order_relaxed); }
+        // Number of entries evicted to stay within the capacity limit
+        uint64_t capacity_evictions() const {
+            return _capacity_evictions.load(memory_order_relaxed);
+        }
+
+    public: // Statistics
+        // Adds the statistics of the map to stats
+        void stats(ExpireMapStats& stats);
+
+    public: // Scans
+        // Buckets walked per acquisition of the read lock by a scan
+        static const size_t kScanBuckets = 256;
+        // Calls visitor(key, value) for each entry unexpired at the start of the call, as
+        // it was then. Returns the number of entries visited.
+        template <class Visitor>
+        size_t for_each_live(Visitor visitor) { return parallel_for_each_live(1, visitor); }
+        // Same as for_each_live with the buckets split between num_threads threads
+        template <class Visitor>
+        size_t parallel_for_each_live(int num_threads, Visitor visitor);
+        // Copies the entries unexpired now, as they are now, to entries
+        void snapshot(vector<SnapshotEntry>& entries);
+
+    public: // Events
+        // Publishes entries leaving the map to ring. NULL turns events off.
+        void set_event_ring(EventStream* ring);
+
+    public: // Snapshot
+        // Writes the unexpired entries to path. Returns false on error. Holds a copy of
+        // the entries while writing.
+        bool save_snapshot(const string& path);
+        template <class Codec>
+        bool save_snapshot(const string& path, Codec codec);
+        // Adds the entries of the snapshot at path that have not expired. Returns false
+        // on error, without changing the map.
+        bool load_snapshot(const string& path);
+        template <class Codec>
+        bool load_snapshot(const string& path, Codec codec);
+
+    public: // Batch accessors
+        // Puts the i-th key of [first, last) with the i-th value of values. All entries
+        // get the same timeout and the same expiry.
+        template <class KeyIter, class ValueIter>
+        void multi_put(KeyIter first, KeyIter last, ValueIter values, long timeoutMs);
+        // Gets the value of each key of [first, last) into values, Value() for keys that
+        // are absent or expired. hits is resized to the number of keys and hits[i] is set if
+        // the i-th key was found. Returns the number of keys found.
+        template <class KeyIter, class ValueIter>
+        size_t multi_get(KeyIter first, KeyIter last, ValueIter values, vector<bool>& hits);
+        // Removes the entries of the keys of [first, last). Returns the number of entries
+        // removed.
+        template <class KeyIter>
+        size_t multi_remove(KeyIter first, KeyIter last);
 
     private: // Helpers
+        // Inserts or overwrites key. Called with the data table and expiry queue locked.
+        // Returns the entry of the key. in_order tells that keys are put in order of
+        // expiry, so that the expiry queue appends them.
+        typename KVStore::iterator _put_locked(Key&& key, Value&& value, long long expiry,
+                                               long long curtime, bool in_order = false);
+        // Runs a scan on num_threads threads, calling visitor(key, value, expiry) for
+        // each entry. Returns the number of entries visited.
+        template <class Visitor>
+        size_t _scan(int num_threads, Visitor& visitor);
+        // Walks the buckets of range of scan
+        template <class Visitor>
+        size_t _scan_range(Scan& scan, size_t range, Visitor& visitor);
+        // Appends the entries of bucket included in scan to entries. Called with the
+        // data table locked.
+        void _scan_bucket(const Scan& scan, size_t bucket, vector<SnapshotEntry>& entries);
+        template <class Visitor>
+        static void* _scan_thread(void* arg);
+        // Saves the entry for each running scan, unless the scan has walked its bucket
+        // already or does not include it. Called with the data table write
+        // locked before the entry is changed or erased.
+        void _save_for_scan(typename KVStore::iterator iter);
+        // Returns true if inserting count entries may rehash the data table
+        bool _may_rehash(size_t count) const {
+            return _data_table.size() + count >=
+                   _data_table.max_load_factor() * _data_table.bucket_count();
+        }
+        // Saves the buckets running scans have not walked yet if inserting count entries
+        // may rehash the table. Called with the data table write locked before inserts.
+        void _save_before_rehash(size_t count);
+        // Copies the unexpired entries in order of expiry. Sets wall_offset to the
+        // wall clock time minus the time of the map.
+        void _collect(vector<SnapshotEntry>& entries, long long& wall_offset);
+        // Puts count entries read by source(deadline, key, value), which returns false
+        // to skip an entry. Deadlines are on the wall clock and in ascending order.
+        // Entries whose deadline has passed are skipped.
+        template <class Source>
+        void _bulk_load(size_t count, Source source);
+        // Returns the entry of key if it is unexpired at curtime and records the access.
+        // Returns the end of the data table otherwise. Called with the data table read
+        // locked.
+        typename KVStore::iterator _find_live(KeyView key, long long curtime);
+        // Copies the value and expiry of key if it is unexpired at curtime. Returns false
+        // otherwise.
+        bool _get_live(KeyView key, long long curtime, Value& value, long long& expiry);
+        // Moves the expiry of key to timeoutMs from now and copies its value to value,
+        // if set. Returns false if key is absent or expired.
+        bool _touch(KeyView key, long timeoutMs, Value* value);
+        // Runs loader for the flight of key, puts the value and completes the flight
+        template <class Loader>
+        void _load(const Key& key, Loader& loader, long timeoutMs, shared_ptr<Flight> flight);
+        // Starts a reload of key on the loader pool unless key is being loaded already
+        template <class Loader>
+        void _refresh(const Key& key, Loader& loader, long timeoutMs);
+        // Erases an entry from the data table. Its expiry queue entry must be gone.
+        // Queues an event with reason if events are on. Called with the data table
+        // write locked.
+        void _erase_locked(typename KVStore::iterator iter, ExpireReason reason);
+        // Evicts entries other than keep (if set) while the map is over capacity. Called
+        // with the data table and expiry queue locked.
+        void _enforce_capacity_locked(const Key* keep, long long curtime);
+        // Returns the least recently accessed of a few sampled entries other than keep,
+        // preferring expired ones. Returns the end of the data table if there is none.
+        typename KVStore::iterator _sample_victim(const Key* keep, long long curtime);
+        // Removes key if present. Called with the data table and expiry queue locked.
+        // Returns true if an entry was removed.
+        bool _remove_locked(KeyView key);
+        // Returns true if the eviction service has to be woken up for a new entry
+        // expiring at expiry. Called with the expiry queue locked.
+        bool _arm_locked(long long expiry);
         // Evicts all expired entries from data table in order of earliest expired to latest.
         // Clears expired entries from expiry queue.
-        // Returns time to sleep in microseconds.
+        // Returns time till the next expiry in microseconds, -1 if there is none.
         long long _evict();
-        // Erase an entry from the expiry queue
-        // No op if the entry does not exist in the expiry queue. Eviction could have discarded
-        // the entry by the time this function got to the removal. So asserting that they key
-        // exists in the expiry queue is invalid
-        void _byol_erase_from_expiry_queue(long long expiry, Key key);
+        // Called by the eviction service. Stops once the map is being destroyed.
+        long long evict() {
+            long long next = _evict();
+            return _shutdown ? -1 : next;
+        }
+        // Take the data table and expiry queue locks, recording the acquisition and
+        // the wait of contended acquisitions if stats are enabled
+        void _rdlock_table();
+        void _wrlock_table();
+        void _lock_queue();
+        // Unlocks the data table write lock and publishes the events queued under it.
+        // Only eviction on expiry passes block, to wait for room in a kBlockOnOverflow
+        // ring.
+        void _wrunlock_table(bool block = false);
+        // Pushes events to ring. Waits for room if block is set and the ring blocks on
+        // overflow, and drops and counts the events that do not fit otherwise.
+        void _publish(vector<Event>& events, EventStream* ring, bool block);
+        // Returns current time in microseconds
+        static long long _now();
 
     public: // Garbage collection
         // Function for eviction thread
         static void* eviction(void* arg);
 
     public: // APIs for test
+        // Returns bytes accounted for the entries in the data table
+        size_t debug_bytes() {
+            data_tbl_lock.rdlock();
+            size_t bytes = _bytes;
+            data_tbl_lock.rdunlock();
+            return bytes;
+        }
         // Returns size of the data table
         int debug_size() {
-            pthread_rwlock_rdlock(&data_tbl_lock);
+            data_tbl_lock.rdlock();
             int sz = _data_table.size();
-            pthread_rwlock_unlock(&data_tbl_lock);
+            data_tbl_lock.rdunlock();
+            return sz;
+        }
+        // Returns number of buckets of the data table
+        size_t debug_bucket_count() {
+            data_tbl_lock.rdlock();
+            size_t buckets = _data_table.bucket_count();
+            data_tbl_lock.rdunlock();
+            return buckets;
+        }
+        // Runs a round of eviction on the calling thread
+        void debug_evict() {
+            _evict();
+        }
+        // Returns number of entries tracked by the expiry queue
+        int debug_expiry_queue_size() {
+            pthread_mutex_lock(&expiry_q_lock);
+            int sz = _expiry_queue.size();
+            pthread_mutex_unlock(&expiry_q_lock);
             return sz;
         }
 }; // ExpireMap
 
+//
+// SharedValueExpireMap
+// ==============================================================================
+//
+// ExpireMap storing values as shared_ptr<const Value>. get copies the pointer
+// under the read lock instead of the value. A miss returns an empty pointer.
+//
+template <class Key, class Value, class ExpiryIndex = OrderedExpiryIndex<Key>,
+          class Lock = PthreadRWLock, class Clock = SteadyClock, class Stats = NoStats>
+using SharedValueExpireMap = ExpireMap<Key, shared_ptr<const Value>, ExpiryIndex, Lock, Clock,
+                                       Stats>;
+
 #include "expire_map.hh"
 
 #endif // EXPIRE_MAP_H
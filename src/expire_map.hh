@@ -1,213 +1,1202 @@
 #ifndef EXPIRE_MAP_HH
 #define EXPIRE_MAP_HH
 
-template <class Key, class Value>
-ExpireMap<Key, Value>::
-ExpireMap() : _data_table(), _expiry_queue(), _shutdown(false) {
-    // In case the platform default for rwlocks does not prefer writes, it will lead to 
-    // starvation of writers. Default attribute can be changed to prefer writers and block
-    // further readers if a writer is waiting using attribute such as
-    // PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP
-    int rwlock_ret = pthread_rwlock_init(&data_tbl_lock, NULL /* attr */);
-    assert(rwlock_ret == 0);
+template <class Key, class Value, class ExpiryIndex, class Lock, class Clock, class Stats>
+ExpireMap<Key, Value, ExpiryIndex, Lock, Clock, Stats>::
+ExpireMap(EvictionService* service, pmr::memory_resource* resource)
+    : _data_table(resource ? resource : pmr::get_default_resource()),
+      _expiry_queue(_now(), resource ? resource : pmr::get_default_resource()),
+      _shutdown(false), _service(service),
+      _armed_expiry(LLONG_MAX), _slice_keys(kDefaultSliceKeys), _slice_us(LLONG_MAX),
+      _max_entries(SIZE_MAX), _max_bytes(SIZE_MAX), _sizer(), _bytes(0), _track_access(false),
+      _rng(0x9E3779B97F4A7C15ULL), _expirations(0), _capacity_evictions(0), _events(NULL),
+      _version(0), _scans(),
+      _refreshes(0), _loader_pool(NULL), _refresh_ahead(0) {
     int mutex_ret = pthread_mutex_init(&expiry_q_lock, NULL /* attr */);
     assert(mutex_ret == 0);
-    // Spawn eviction thread
-    pthread_create(&eviction_thread, NULL /* attr */, eviction, this);
+    mutex_ret = pthread_mutex_init(&_flight_lock, NULL /* attr */);
+    assert(mutex_ret == 0);
+    int cond_ret = pthread_cond_init(&_flight_done, NULL /* attr */);
+    assert(cond_ret == 0);
+    if (_service) {
+        _service->add(this);
+    } else {
+        // Spawn eviction thread
+        pthread_create(&eviction_thread, NULL /* attr */, eviction, this);
+    }
 }
 
-template <class Key, class Value>
-ExpireMap<Key, Value>::
+template <class Key, class Value, class ExpiryIndex, class Lock, class Clock, class Stats>
+ExpireMap<Key, Value, ExpiryIndex, Lock, Clock, Stats>::
 ~ExpireMap() {
+    // Set first so that eviction blocked on a full event ring gives up
     _shutdown = true;
-    // Wait for eviction thread to finish
-    pthread_join(eviction_thread, NULL /* ret */);
+    // Wait for reloads on the loader pool, which call back into the map
+    pthread_mutex_lock(&_flight_lock);
+    while (_refreshes > 0) {
+        pthread_cond_wait(&_flight_done, &_flight_lock);
+    }
+    pthread_mutex_unlock(&_flight_lock);
+    if (_service) {
+        // Waits for the service to finish evicting the map
+        _service->remove(this);
+    }
+    if (!_service) {
+        // Wait for eviction thread to finish
+        pthread_join(eviction_thread, NULL /* ret */);
+    }
     // Clear data structures
     _data_table.clear();
     _expiry_queue.clear();
-    int rwlock_ret = pthread_rwlock_destroy(&data_tbl_lock);
-    assert(rwlock_ret == 0);
     int mutex_ret = pthread_mutex_destroy(&expiry_q_lock);
     assert(mutex_ret == 0);
+    pthread_cond_destroy(&_flight_done);
+    mutex_ret = pthread_mutex_destroy(&_flight_lock);
+    assert(mutex_ret == 0);
 }
 
-template <class Key, class Value>
+template <class Key, class Value, class ExpiryIndex, class Lock, class Clock, class Stats>
 void
-ExpireMap<Key, Value>::
+ExpireMap<Key, Value, ExpiryIndex, Lock, Clock, Stats>::
 put(Key key, Value value, long timeoutMs) {
     // Do not insert values for which validity is less than or equal to zero
     if (_shutdown || timeoutMs <= 0) return;
     // Get current time in microseconds
-    long long expiry =
-        duration_cast<microseconds>(high_resolution_clock::now().time_since_epoch()).count();
+    long long curtime = _now();
     // Calculate expiry time
-    expiry += (timeoutMs * 1000);
+    long long expiry = curtime + (timeoutMs * 1000);
 
-    bool overwrite = false;
-    long long ow_expiry = 0;
     // Write lock data table
-    pthread_rwlock_wrlock(&data_tbl_lock);
-    // Record old value to update the expiry queue if this is an overwrite
-    typename KVStore::iterator tbl_iter = _data_table.find(key);
-    if (tbl_iter != _data_table.end()) {
-        overwrite = true;
-        ow_expiry = tbl_iter->second.expiry;
-    }
-    // Insert into data table
-    _data_table[key] = TimedValue(value, expiry);
-    // Unlock data table
-    pthread_rwlock_unlock(&data_tbl_lock);
-
+    _wrlock_table();
     // Lock expiry queue
-    pthread_mutex_lock(&expiry_q_lock);
-    // If this is an overwrite, remove older entry from the expiry queue
-    if (overwrite) {
-        _byol_erase_from_expiry_queue(key, ow_expiry);
-    }
-    ExpiryIterator insert_iter = _expiry_queue.find(expiry);
-    // Insert a key set into expiry queue if this is the first KV expiring at 'expiry'
-    if (insert_iter == _expiry_queue.end()) {
-        // Function returns iterator to the newly inserted pair of (expiry:keyset)
-        insert_iter = _expiry_queue.insert(make_pair(expiry, set<Key>())).first;
-    }
-    insert_iter->second.insert(key);
+    _lock_queue();
+    typename KVStore::iterator iter = _put_locked(move(key), move(value), expiry, curtime);
+    _enforce_capacity_locked(&iter->first, curtime);
+    bool wake = _arm_locked(expiry);
     // Unlock expiry queue
     pthread_mutex_unlock(&expiry_q_lock);
+    // Unlock data table
+    _wrunlock_table();
+    if (wake) {
+        _service->schedule(this, timeoutMs * 1000 + 1);
+    }
 }
 
-template <class Key, class Value>
+template <class Key, class Value, class ExpiryIndex, class Lock, class Clock, class Stats>
 Value
-ExpireMap<Key, Value>::
-get(Key key) {
+ExpireMap<Key, Value, ExpiryIndex, Lock, Clock, Stats>::
+get(KeyView key) {
     if  (_shutdown) {
-        return (Value)NULL;
+        return Value();
     }
     // Get current time in microseconds
-    long long curtime =
-        duration_cast<microseconds>(high_resolution_clock::now().time_since_epoch()).count();
+    long long curtime = _now();
     // Read lock data table
-    pthread_rwlock_rdlock(&data_tbl_lock);
-    typename KVStore::iterator iter = _data_table.find(key);
-    // If value was not found or the value has expired and waiting to be evicted, return NULL
-    if (iter == _data_table.end() || iter->second.expiry < curtime) {
-        pthread_rwlock_unlock(&data_tbl_lock);
-        return (Value) NULL;
+    _rdlock_table();
+    typename KVStore::iterator iter = _find_live(key, curtime);
+    // If value was not found or the value has expired and waiting to be evicted, return
+    // Value()
+    if (iter == _data_table.end()) {
+        data_tbl_lock.rdunlock();
+        return Value();
     }
     // Key has a valid value, return the value
     Value value = iter->second.value;
-    pthread_rwlock_unlock(&data_tbl_lock);
+    data_tbl_lock.rdunlock();
     // Unlock data table
     return value;
 }
 
-template <class Key, class Value>
+template <class Key, class Value, class ExpiryIndex, class Lock, class Clock, class Stats>
+optional<Value>
+ExpireMap<Key, Value, ExpiryIndex, Lock, Clock, Stats>::
+try_get(KeyView key) {
+    optional<Value> value;
+    with_value(key, [&value](const Value& found) { value = found; });
+    return value;
+}
+
+template <class Key, class Value, class ExpiryIndex, class Lock, class Clock, class Stats>
+template <class Visitor>
+bool
+ExpireMap<Key, Value, ExpiryIndex, Lock, Clock, Stats>::
+with_value(KeyView key, Visitor visitor) {
+    if (_shutdown) {
+        return false;
+    }
+    long long curtime = _now();
+    _rdlock_table();
+    typename KVStore::iterator iter = _find_live(key, curtime);
+    bool found = (iter != _data_table.end());
+    if (found) {
+        const Value& value = iter->second.value;
+        visitor(value);
+    }
+    data_tbl_lock.rdunlock();
+    return found;
+}
+
+template <class Key, class Value, class ExpiryIndex, class Lock, class Clock, class Stats>
 void
-ExpireMap<Key, Value>::
-remove(Key key) {
-    bool exists = false;
-    long long expiry = 0;
+ExpireMap<Key, Value, ExpiryIndex, Lock, Clock, Stats>::
+remove(KeyView key) {
     // Write lock data table
-    pthread_rwlock_wrlock(&data_tbl_lock);
+    _wrlock_table();
+    _lock_queue();
+    _remove_locked(key);
+    pthread_mutex_unlock(&expiry_q_lock);
+    // Unlock data table
+    _wrunlock_table();
+}
+
+template <class Key, class Value, class ExpiryIndex, class Lock, class Clock, class Stats>
+template <class Loader>
+Value
+ExpireMap<Key, Value, ExpiryIndex, Lock, Clock, Stats>::
+get_or_load(const Key& key, Loader loader, long timeoutMs) {
+    if (_shutdown) {
+        return Value();
+    }
+    long long curtime = _now();
+    Value value;
+    long long expiry;
+    if (_get_live(key, curtime, value, expiry)) {
+        if (_loader_pool && expiry - curtime < _refresh_ahead * timeoutMs * 1000) {
+            _refresh(key, loader, timeoutMs);
+        }
+        return value;
+    }
+    pthread_mutex_lock(&_flight_lock);
+    typename Flights::iterator iter = _flights.find(key);
+    if (iter != _flights.end()) {
+        // Another caller is loading the key. Share its result.
+        shared_ptr<Flight> flight = iter->second;
+        while (!flight->done) {
+            pthread_cond_wait(&_flight_done, &_flight_lock);
+        }
+        pthread_mutex_unlock(&_flight_lock);
+        if (flight->error) {
+            rethrow_exception(flight->error);
+        }
+        return flight->value;
+    }
+    // A flight may have put the key and finished since the miss
+    if (_get_live(key, _now(), value, expiry)) {
+        pthread_mutex_unlock(&_flight_lock);
+        return value;
+    }
+    shared_ptr<Flight> flight = make_shared<Flight>();
+    _flights.emplace(key, flight);
+    pthread_mutex_unlock(&_flight_lock);
+    _load(key, loader, timeoutMs, flight);
+    if (flight->error) {
+        rethrow_exception(flight->error);
+    }
+    return flight->value;
+}
+
+template <class Key, class Value, class ExpiryIndex, class Lock, class Clock, class Stats>
+bool
+ExpireMap<Key, Value, ExpiryIndex, Lock, Clock, Stats>::
+_touch(KeyView key, long timeoutMs, Value* value) {
+    if (_shutdown || timeoutMs <= 0) return false;
+    long long curtime = _now();
+    long long expiry = curtime + timeoutMs * 1000;
+    _rdlock_table();
+    typename KVStore::iterator iter = _find_live(key, curtime);
+    if (iter == _data_table.end()) {
+        data_tbl_lock.rdunlock();
+        return false;
+    }
+    if (value) {
+        *value = iter->second.value;
+    }
+    // Raise the expiry. Concurrent touches keep the latest expiry.
+    atomic<long long>& entry_expiry = iter->second.expiry;
+    long long current = entry_expiry.load(memory_order_relaxed);
+    while (current < expiry &&
+           !entry_expiry.compare_exchange_weak(current, expiry, memory_order_relaxed)) {
+    }
+    data_tbl_lock.rdunlock();
+    if (current <= expiry) {
+        return true;
+    }
+    // The expiry moves closer. The expiry queue must not keep the later expiry.
+    _wrlock_table();
+    _lock_queue();
+    iter = _data_table.find(key);
+    bool found = (iter != _data_table.end() &&
+                  iter->second.expiry.load(memory_order_relaxed) >= curtime);
+    bool wake = false;
+    if (found) {
+        iter->second.handle = _expiry_queue.reschedule(iter->second.handle, expiry);
+        iter->second.expiry.store(expiry, memory_order_relaxed);
+        wake = _arm_locked(expiry);
+    }
+    pthread_mutex_unlock(&expiry_q_lock);
+    _wrunlock_table();
+    if (wake) {
+        _service->schedule(this, timeoutMs * 1000 + 1);
+    }
+    return found;
+}
+
+template <class Key, class Value, class ExpiryIndex, class Lock, class Clock, class Stats>
+void
+ExpireMap<Key, Value, ExpiryIndex, Lock, Clock, Stats>::
+set_refresh_ahead(LoaderPool* pool, double fraction) {
+    assert(pool == NULL || (fraction > 0 && fraction < 1));
+    _loader_pool = pool;
+    _refresh_ahead = pool ? fraction : 0;
+}
+
+template <class Key, class Value, class ExpiryIndex, class Lock, class Clock, class Stats>
+bool
+ExpireMap<Key, Value, ExpiryIndex, Lock, Clock, Stats>::
+_get_live(KeyView key, long long curtime, Value& value, long long& expiry) {
+    _rdlock_table();
+    typename KVStore::iterator iter = _find_live(key, curtime);
+    bool found = (iter != _data_table.end());
+    if (found) {
+        value = iter->second.value;
+        expiry = iter->second.expiry.load(memory_order_relaxed);
+    }
+    data_tbl_lock.rdunlock();
+    return found;
+}
+
+template <class Key, class Value, class ExpiryIndex, class Lock, class Clock, class Stats>
+template <class Loader>
+void
+ExpireMap<Key, Value, ExpiryIndex, Lock, Clock, Stats>::
+_load(const Key& key, Loader& loader, long timeoutMs, shared_ptr<Flight> flight) {
+    try {
+        flight->value = loader(key);
+        put(key, flight->value, timeoutMs);
+    } catch (...) {
+        flight->error = current_exception();
+    }
+    // The key is in the map before the flight goes away, so later misses do not load
+    // it again
+    pthread_mutex_lock(&_flight_lock);
+    flight->done = true;
+    _flights.erase(key);
+    pthread_cond_broadcast(&_flight_done);
+    pthread_mutex_unlock(&_flight_lock);
+}
+
+template <class Key, class Value, class ExpiryIndex, class Lock, class Clock, class Stats>
+template <class Loader>
+void
+ExpireMap<Key, Value, ExpiryIndex, Lock, Clock, Stats>::
+_refresh(const Key& key, Loader& loader, long timeoutMs) {
+    pthread_mutex_lock(&_flight_lock);
+    if (_shutdown || _flights.find(key) != _flights.end()) {
+        pthread_mutex_unlock(&_flight_lock);
+        return;
+    }
+    shared_ptr<Flight> flight = make_shared<Flight>();
+    _flights.emplace(key, flight);
+    ++_refreshes;
+    pthread_mutex_unlock(&_flight_lock);
+    _loader_pool->submit([this, key, loader, timeoutMs, flight]() mutable {
+        _load(key, loader, timeoutMs, flight);
+        pthread_mutex_lock(&_flight_lock);
+        --_refreshes;
+        pthread_cond_broadcast(&_flight_done);
+        pthread_mutex_unlock(&_flight_lock);
+    });
+}
+
+template <class Key, class Value, class ExpiryIndex, class Lock, class Clock, class Stats>
+template <class KeyIter, class ValueIter>
+void
+ExpireMap<Key, Value, ExpiryIndex, Lock, Clock, Stats>::
+multi_put(KeyIter first, KeyIter last, ValueIter values, long timeoutMs) {
+    if (_shutdown || timeoutMs <= 0 || first == last) return;
+    // One expiry for the whole batch
+    long long curtime = _now();
+    long long expiry = curtime + timeoutMs * 1000;
+    _wrlock_table();
+    _lock_queue();
+    for (; first != last; ++first, ++values) {
+        typename KVStore::iterator iter = _put_locked(Key(*first), Value(*values), expiry,
+                                                      curtime);
+        _enforce_capacity_locked(&iter->first, curtime);
+    }
+    bool wake = _arm_locked(expiry);
+    pthread_mutex_unlock(&expiry_q_lock);
+    _wrunlock_table();
+    if (wake) {
+        _service->schedule(this, timeoutMs * 1000 + 1);
+    }
+}
+
+template <class Key, class Value, class ExpiryIndex, class Lock, class Clock, class Stats>
+template <class KeyIter, class ValueIter>
+size_t
+ExpireMap<Key, Value, ExpiryIndex, Lock, Clock, Stats>::
+multi_get(KeyIter first, KeyIter last, ValueIter values, vector<bool>& hits) {
+    hits.clear();
+    size_t found = 0;
+    if (_shutdown) {
+        for (; first != last; ++first, ++values) {
+            *values = Value();
+            hits.push_back(false);
+        }
+        return found;
+    }
+    long long curtime = _now();
+    _rdlock_table();
+    for (; first != last; ++first, ++values) {
+        typename KVStore::iterator iter = _find_live(*first, curtime);
+        bool hit = (iter != _data_table.end());
+        *values = hit ? iter->second.value : Value();
+        hits.push_back(hit);
+        found += hit;
+    }
+    data_tbl_lock.rdunlock();
+    return found;
+}
+
+template <class Key, class Value, class ExpiryIndex, class Lock, class Clock, class Stats>
+template <class KeyIter>
+size_t
+ExpireMap<Key, Value, ExpiryIndex, Lock, Clock, Stats>::
+multi_remove(KeyIter first, KeyIter last) {
+    size_t removed = 0;
+    _wrlock_table();
+    _lock_queue();
+    for (; first != last; ++first) {
+        removed += _remove_locked(*first);
+    }
+    pthread_mutex_unlock(&expiry_q_lock);
+    _wrunlock_table();
+    return removed;
+}
+
+template <class Key, class Value, class ExpiryIndex, class Lock, class Clock, class Stats>
+typename ExpireMap<Key, Value, ExpiryIndex, Lock, Clock, Stats>::KVStore::iterator
+ExpireMap<Key, Value, ExpiryIndex, Lock, Clock, Stats>::
+_put_locked(Key&& key, Value&& value, long long expiry, long long curtime, bool in_order) {
+    typename KVStore::iterator tbl_iter = _data_table.find(key);
+    bool overwrite = (tbl_iter != _data_table.end());
+    if (overwrite) {
+        _save_for_scan(tbl_iter);
+        if (_sizer) {
+            _bytes -= _sizer(tbl_iter->first, tbl_iter->second.value);
+        }
+        // Move the older entry in the expiry queue to the new expiry
+        tbl_iter->second.handle = _expiry_queue.reschedule(tbl_iter->second.handle, expiry);
+    } else {
+        // The data table takes the key. The expiry queue refers to the key in the table
+        // unless it is small enough to copy.
+        _save_before_rehash(1);
+        tbl_iter = _data_table.emplace(piecewise_construct, forward_as_tuple(move(key)),
+                                       forward_as_tuple()).first;
+        IndexKey index_key = KeyTrait::index_key(tbl_iter->first);
+        tbl_iter->second.handle = in_order ? _expiry_queue.schedule_last(expiry, index_key)
+                                           : _expiry_queue.schedule(expiry, index_key);
+    }
+    // Insert into data table
+    tbl_iter->second.value = move(value);
+    tbl_iter->second.expiry.store(expiry, memory_order_relaxed);
+    tbl_iter->second.last_access.store(curtime, memory_order_relaxed);
+    tbl_iter->second.version = ++_version;
+    if (_sizer) {
+        _bytes += _sizer(tbl_iter->first, tbl_iter->second.value);
+    }
+    _stats.count(kStatPuts);
+    return tbl_iter;
+}
+
+template <class Key, class Value, class ExpiryIndex, class Lock, class Clock, class Stats>
+void
+ExpireMap<Key, Value, ExpiryIndex, Lock, Clock, Stats>::
+set_event_ring(EventStream* ring) {
+    _wrlock_table();
+    _events = ring;
+    _wrunlock_table();
+}
+
+template <class Key, class Value, class ExpiryIndex, class Lock, class Clock, class Stats>
+bool
+ExpireMap<Key, Value, ExpiryIndex, Lock, Clock, Stats>::
+save_snapshot(const string& path) {
+    static_assert(is_trivially_copyable<Key>::value && is_trivially_copyable<Value>::value,
+                  "Snapshots of keys or values that are not trivially copyable need a codec");
+    vector<SnapshotEntry> entries;
+    long long wall_offset = 0;
+    _collect(entries, wall_offset);
+    SnapshotWriter writer(path);
+    for (size_t i = 0; i < entries.size(); ++i) {
+        int64_t deadline = entries[i].expiry + wall_offset;
+        writer.append(&deadline, sizeof(deadline));
+        writer.append(&entries[i].key, sizeof(Key));
+        writer.pad();
+        writer.append(&entries[i].value, sizeof(Value));
+        writer.pad();
+    }
+    SnapshotHeader header = { };
+    memcpy(header.magic, kSnapshotMagic, sizeof(kSnapshotMagic));
+    header.version = kSnapshotVersion;
+    header.flags = 0;
+    header.key_size = sizeof(Key);
+    header.value_size = sizeof(Value);
+    header.count = entries.size();
+    header.saved_at = wall_clock_us();
+    return writer.finish(header);
+}
+
+template <class Key, class Value, class ExpiryIndex, class Lock, class Clock, class Stats>
+template <class Codec>
+bool
+ExpireMap<Key, Value, ExpiryIndex, Lock, Clock, Stats>::
+save_snapshot(const string& path, Codec codec) {
+    vector<SnapshotEntry> entries;
+    long long wall_offset = 0;
+    _collect(entries, wall_offset);
+    SnapshotWriter writer(path);
+    string key_bytes;
+    string value_bytes;
+    for (size_t i = 0; i < entries.size(); ++i) {
+        key_bytes.clear();
+        value_bytes.clear();
+        codec.encode_key(entries[i].key, key_bytes);
+        codec.encode_value(entries[i].value, value_bytes);
+        if (key_bytes.size() > UINT32_MAX || value_bytes.size() > UINT32_MAX) {
+            // Does not fit the size fields of a record. The writer removes the file.
+            return false;
+        }
+        int64_t deadline = entries[i].expiry + wall_offset;
+        uint32_t sizes[2] = { (uint32_t)key_bytes.size(), (uint32_t)value_bytes.size() };
+        writer.append(&deadline, sizeof(deadline));
+        writer.append(sizes, sizeof(sizes));
+        writer.append(key_bytes.data(), key_bytes.size());
+        writer.append(value_bytes.data(), value_bytes.size());
+        writer.pad();
+    }
+    SnapshotHeader header = { };
+    memcpy(header.magic, kSnapshotMagic, sizeof(kSnapshotMagic));
+    header.version = kSnapshotVersion;
+    header.flags = kSnapshotVariable;
+    header.count = entries.size();
+    header.saved_at = wall_clock_us();
+    return writer.finish(header);
+}
+
+template <class Key, class Value, class ExpiryIndex, class Lock, class Clock, class Stats>
+bool
+ExpireMap<Key, Value, ExpiryIndex, Lock, Clock, Stats>::
+load_snapshot(const string& path) {
+    static_assert(is_trivially_copyable<Key>::value && is_trivially_copyable<Value>::value,
+                  "Snapshots of keys or values that are not trivially copyable need a codec");
+    SnapshotReader reader(path);
+    if (!reader.ok()) return false;
+    const SnapshotHeader* header = reader.header();
+    if (header->flags != 0 || header->key_size != sizeof(Key) ||
+        header->value_size != sizeof(Value)) {
+        return false;
+    }
+    const size_t key_offset = sizeof(int64_t);
+    const size_t value_offset = key_offset + snapshot_align(sizeof(Key));
+    const size_t stride = value_offset + snapshot_align(sizeof(Value));
+    size_t bytes = reader.end() - reader.records();
+    if (bytes % stride != 0 || bytes / stride != header->count) return false;
+    if (_shutdown) return false;
+    // Records are in order of deadline. Skip the ones that have expired.
+    const char* records = reader.records();
+    long long wall = wall_clock_us();
+    size_t first = 0;
+    size_t last = header->count;
+    while (first < last) {
+        size_t mid = first + (last - first) / 2;
+        int64_t deadline;
+        memcpy(&deadline, records + mid * stride, sizeof(deadline));
+        if (deadline < wall) {
+            first = mid + 1;
+        } else {
+            last = mid;
+        }
+    }
+    const char* record = records + first * stride;
+    _bulk_load(header->count - first, [&](long long& deadline, Key& key, Value& value) {
+        int64_t saved;
+        memcpy(&saved, record, sizeof(saved));
+        memcpy((void*)&key, record + key_offset, sizeof(Key));
+        memcpy((void*)&value, record + value_offset, sizeof(Value));
+        deadline = saved;
+        record += stride;
+        return true;
+    });
+    return true;
+}
+
+template <class Key, class Value, class ExpiryIndex, class Lock, class Clock, class Stats>
+template <class Codec>
+bool
+ExpireMap<Key, Value, ExpiryIndex, Lock, Clock, Stats>::
+load_snapshot(const string& path, Codec codec) {
+    SnapshotReader reader(path);
+    if (!reader.ok()) return false;
+    const SnapshotHeader* header = reader.header();
+    if (header->flags != kSnapshotVariable) return false;
+    // Decode all records before touching the map, so that a malformed snapshot does
+    // not leave a partial load behind
+    vector<SnapshotEntry> entries;
+    long long wall = wall_clock_us();
+    const char* record = reader.records();
+    const char* end = reader.end();
+    for (uint64_t i = 0; i < header->count; ++i) {
+        const size_t fixed = sizeof(int64_t) + 2 * sizeof(uint32_t);
+        if ((size_t)(end - record) < fixed) return false;
+        int64_t deadline;
+        uint32_t sizes[2];
+        memcpy(&deadline, record, sizeof(deadline));
+        memcpy(sizes, record + sizeof(deadline), sizeof(sizes));
+        size_t size = snapshot_align(fixed + (size_t)sizes[0] + sizes[1]);
+        if ((size_t)(end - record) < size) return false;
+        if (deadline >= wall) {
+            entries.push_back(SnapshotEntry());
+            SnapshotEntry& entry = entries.back();
+            entry.expiry = deadline;
+            const char* key_bytes = record + fixed;
+            if (!codec.decode_key(key_bytes, sizes[0], entry.key) ||
+                !codec.decode_value(key_bytes + sizes[0], sizes[1], entry.value)) {
+                return false;
+            }
+        }
+        record += size;
+    }
+    if (record != end) return false;
+    if (_shutdown) return false;
+    size_t next = 0;
+    _bulk_load(entries.size(), [&](long long& deadline, Key& key, Value& value) {
+        SnapshotEntry& entry = entries[next++];
+        deadline = entry.expiry;
+        key = move(entry.key);
+        value = move(entry.value);
+        return true;
+    });
+    return true;
+}
+
+template <class Key, class Value, class ExpiryIndex, class Lock, class Clock, class Stats>
+void
+ExpireMap<Key, Value, ExpiryIndex, Lock, Clock, Stats>::
+_collect(vector<SnapshotEntry>& entries, long long& wall_offset) {
+    wall_offset = wall_clock_us() - _now();
+    snapshot(entries);
+    // Loading relies on the order
+    sort(entries.begin(), entries.end(),
+         [](const SnapshotEntry& a, const SnapshotEntry& b) { return a.expiry < b.expiry; });
+}
+
+template <class Key, class Value, class ExpiryIndex, class Lock, class Clock, class Stats>
+template <class Visitor>
+size_t
+ExpireMap<Key, Value, ExpiryIndex, Lock, Clock, Stats>::
+parallel_for_each_live(int num_threads, Visitor visitor) {
+    auto visit = [&visitor](const Key& key, const Value& value, long long expiry) {
+        visitor(key, value);
+    };
+    return _scan(num_threads, visit);
+}
+
+template <class Key, class Value, class ExpiryIndex, class Lock, class Clock, class Stats>
+void
+ExpireMap<Key, Value, ExpiryIndex, Lock, Clock, Stats>::
+snapshot(vector<SnapshotEntry>& entries) {
+    entries.clear();
+    auto collect = [&entries](const Key& key, const Value& value, long long expiry) {
+        SnapshotEntry entry = { expiry, key, value };
+        entries.push_back(move(entry));
+    };
+    _scan(1, collect);
+}
+
+template <class Key, class Value, class ExpiryIndex, class Lock, class Clock, class Stats>
+template <class Visitor>
+size_t
+ExpireMap<Key, Value, ExpiryIndex, Lock, Clock, Stats>::
+_scan(int num_threads, Visitor& visitor) {
+    assert(num_threads > 0);
+    // Start the scan. Entries written from here on are left to scan.saved.
+    Scan scan;
+    _wrlock_table();
+    scan.version = _version;
+    scan.time = _now();
+    scan.walked = false;
+    size_t buckets = _data_table.bucket_count();
+    scan.range_size = (buckets + num_threads - 1) / num_threads;
+    scan.progress.assign(num_threads, 0);
+    for (int i = 0; i < num_threads; ++i) {
+        scan.progress[i] = min(buckets, i * scan.range_size);
+    }
+    _scans.push_back(&scan);
+    _wrunlock_table();
+    size_t visited = 0;
+    if (num_threads == 1) {
+        visited = _scan_range(scan, 0, visitor);
+    } else {
+        vector<pthread_t> threads(num_threads);
+        vector<ScanRange<Visitor> > ranges(num_threads);
+        for (int i = 0; i < num_threads; ++i) {
+            ranges[i].exp_map = this;
+            ranges[i].scan = &scan;
+            ranges[i].visitor = &visitor;
+            ranges[i].range = i;
+            ranges[i].visited = 0;
+            pthread_create(&threads[i], NULL /* attr */, _scan_thread<Visitor>, &ranges[i]);
+        }
+        for (int i = 0; i < num_threads; ++i) {
+            pthread_join(threads[i], NULL /* ret */);
+            visited += ranges[i].visited;
+        }
+    }
+    // End the scan and visit the entries changed before the walk reached them
+    _wrlock_table();
+    _scans.erase(find(_scans.begin(), _scans.end(), &scan));
+    _wrunlock_table();
+    for (size_t i = 0; i < scan.saved.size(); ++i) {
+        visitor(scan.saved[i].key, scan.saved[i].value, scan.saved[i].expiry);
+    }
+    return visited + scan.saved.size();
+}
+
+template <class Key, class Value, class ExpiryIndex, class Lock, class Clock, class Stats>
+template <class Visitor>
+size_t
+ExpireMap<Key, Value, ExpiryIndex, Lock, Clock, Stats>::
+_scan_range(Scan& scan, size_t range, Visitor& visitor) {
+    size_t visited = 0;
+    vector<SnapshotEntry> batch;
+    while (true) {
+        _rdlock_table();
+        size_t bucket = scan.progress[range];
+        size_t end = min(_data_table.bucket_count(), (range + 1) * scan.range_size);
+        if (scan.walked || bucket >= end) {
+            // Walked, or saved before a rehash
+            data_tbl_lock.rdunlock();
+            break;
+        }
+        size_t stop = min(end, bucket + kScanBuckets);
+        for (; bucket < stop; ++bucket) {
+            _scan_bucket(scan, bucket, batch);
+        }
+        // Writers see the buckets walked so far as done
+        scan.progress[range] = stop;
+        data_tbl_lock.rdunlock();
+        // The visitor runs without the lock
+        for (size_t i = 0; i < batch.size(); ++i) {
+            visitor(batch[i].key, batch[i].value, batch[i].expiry);
+        }
+        visited += batch.size();
+        batch.clear();
+    }
+    return visited;
+}
+
+template <class Key, class Value, class ExpiryIndex, class Lock, class Clock, class Stats>
+template <class Visitor>
+void*
+ExpireMap<Key, Value, ExpiryIndex, Lock, Clock, Stats>::
+_scan_thread(void* arg) {
+    ScanRange<Visitor>* range = (ScanRange<Visitor>*)arg;
+    range->visited = range->exp_map->_scan_range(*range->scan, range->range, *range->visitor);
+    return NULL;
+}
+
+template <class Key, class Value, class ExpiryIndex, class Lock, class Clock, class Stats>
+void
+ExpireMap<Key, Value, ExpiryIndex, Lock, Clock, Stats>::
+_scan_bucket(const Scan& scan, size_t bucket, vector<SnapshotEntry>& entries) {
+    for (typename KVStore::local_iterator iter = _data_table.begin(bucket);
+         iter != _data_table.end(bucket); ++iter) {
+        long long expiry = iter->second.expiry.load(memory_order_relaxed);
+        if (iter->second.version <= scan.version && expiry >= scan.time) {
+            SnapshotEntry entry = { expiry, iter->first, iter->second.value };
+            entries.push_back(move(entry));
+        }
+    }
+}
+
+template <class Key, class Value, class ExpiryIndex, class Lock, class Clock, class Stats>
+void
+ExpireMap<Key, Value, ExpiryIndex, Lock, Clock, Stats>::
+_save_for_scan(typename KVStore::iterator iter) {
+    if (_scans.empty()) {
+        return;
+    }
+    long long expiry = iter->second.expiry.load(memory_order_relaxed);
+    size_t bucket = _data_table.bucket(iter->first);
+    for (size_t i = 0; i < _scans.size(); ++i) {
+        Scan& scan = *_scans[i];
+        if (scan.walked || iter->second.version > scan.version || expiry < scan.time) {
+            // Saved already, written after the scan started, or expired when it started
+            continue;
+        }
+        if (bucket < scan.progress[bucket / scan.range_size]) {
+            // Walked already
+            continue;
+        }
+        SnapshotEntry entry = { expiry, iter->first, iter->second.value };
+        scan.saved.push_back(move(entry));
+    }
+}
+
+template <class Key, class Value, class ExpiryIndex, class Lock, class Clock, class Stats>
+void
+ExpireMap<Key, Value, ExpiryIndex, Lock, Clock, Stats>::
+_save_before_rehash(size_t count) {
+    if (_scans.empty() || !_may_rehash(count)) {
+        return;
+    }
+    size_t buckets = _data_table.bucket_count();
+    for (size_t i = 0; i < _scans.size(); ++i) {
+        Scan& scan = *_scans[i];
+        if (scan.walked) continue;
+        for (size_t range = 0; range < scan.progress.size(); ++range) {
+            size_t end = min(buckets, (range + 1) * scan.range_size);
+            for (size_t bucket = scan.progress[range]; bucket < end; ++bucket) {
+                _scan_bucket(scan, bucket, scan.saved);
+            }
+            scan.progress[range] = end;
+        }
+        scan.walked = true;
+    }
+}
+
+template <class Key, class Value, class ExpiryIndex, class Lock, class Clock, class Stats>
+template <class Source>
+void
+ExpireMap<Key, Value, ExpiryIndex, Lock, Clock, Stats>::
+_bulk_load(size_t count, Source source) {
+    long long curtime = _now();
+    long long wall = wall_clock_us();
+    long long first_expiry = LLONG_MAX;
+    Key key = Key();
+    Value value = Value();
+    _wrlock_table();
+    _lock_queue();
+    if (_may_rehash(count)) {
+        // Grow once for the whole load. reserve may also shrink a table that has room.
+        _save_before_rehash(count);
+        _data_table.reserve(_data_table.size() + count);
+    }
+    for (size_t i = 0; i < count; ++i) {
+        long long deadline;
+        if (!source(deadline, key, value) || deadline < wall) {
+            continue;
+        }
+        // The entry keeps its remaining time to live
+        long long expiry = curtime + (deadline - wall);
+        _put_locked(move(key), move(value), expiry, curtime, true /* in order */);
+        if (expiry < first_expiry) {
+            first_expiry = expiry;
+        }
+    }
+    _enforce_capacity_locked(NULL /* keep */, curtime);
+    bool wake = (first_expiry != LLONG_MAX) && _arm_locked(first_expiry);
+    pthread_mutex_unlock(&expiry_q_lock);
+    _wrunlock_table();
+    if (wake) {
+        _service->schedule(this, first_expiry - curtime + 1);
+    }
+}
+
+template <class Key, class Value, class ExpiryIndex, class Lock, class Clock, class Stats>
+typename ExpireMap<Key, Value, ExpiryIndex, Lock, Clock, Stats>::KVStore::iterator
+ExpireMap<Key, Value, ExpiryIndex, Lock, Clock, Stats>::
+_find_live(KeyView key, long long curtime) {
+    typename KVStore::iterator iter = _data_table.find(key);
+    if (iter == _data_table.end()) {
+        _stats.count(kStatMisses);
+        return _data_table.end();
+    }
+    if (iter->second.expiry.load(memory_order_relaxed) < curtime) {
+        // Expired and waiting to be evicted
+        _stats.count(kStatExpiredHits);
+        return _data_table.end();
+    }
+    _stats.count(kStatHits);
+    // Record the access for capacity eviction. The time is coarse, so that repeated
+    // hits on a hot key do not dirty its cache line on every get.
+    if (_track_access && curtime - iter->second.last_access.load(memory_order_relaxed) >=
+                         kAccessResolutionUs) {
+        iter->second.last_access.store(curtime, memory_order_relaxed);
+    }
+    return iter;
+}
+
+template <class Key, class Value, class ExpiryIndex, class Lock, class Clock, class Stats>
+bool
+ExpireMap<Key, Value, ExpiryIndex, Lock, Clock, Stats>::
+_remove_locked(KeyView key) {
     typename KVStore::iterator tbl_iter = _data_table.find(key);
     // Remove the entry irrespective of the expiry time
-    if (tbl_iter != _data_table.end()) {
-        exists = true;
-        expiry = tbl_iter->second.expiry;
-        _data_table.erase(key);
+    if (tbl_iter == _data_table.end()) {
+        return false;
     }
-    // Unlock data table
-    pthread_rwlock_unlock(&data_tbl_lock);
+    // Remove entry from expiry queue
+    _expiry_queue.cancel(tbl_iter->second.handle);
+    _erase_locked(tbl_iter, kRemoved);
+    _stats.count(kStatRemoves);
+    return true;
+}
 
-    // Remove entry from expiry queue.
-    // Skip this step to make removal constant time. The down side is that the entry in expiry
-    // queue will linger till the actual expiry of the removed entry.
-    if (exists) {
-        // Lock expiry queue
-        pthread_mutex_lock(&expiry_q_lock);
-        _byol_erase_from_expiry_queue(key, expiry);
-        // Unlock expiry queue
-        pthread_mutex_unlock(&expiry_q_lock);
+template <class Key, class Value, class ExpiryIndex, class Lock, class Clock, class Stats>
+void
+ExpireMap<Key, Value, ExpiryIndex, Lock, Clock, Stats>::
+_erase_locked(typename KVStore::iterator iter, ExpireReason reason) {
+    _save_for_scan(iter);
+    if (_sizer) {
+        _bytes -= _sizer(iter->first, iter->second.value);
     }
+    if (_events) {
+        // Extract the node to move the key out of it
+        typename KVStore::node_type node = _data_table.extract(iter);
+        _pending_events.emplace_back(move(node.key()), move(node.mapped().value), reason);
+        return;
+    }
+    _data_table.erase(iter);
 }
 
-template <class Key, class Value>
+template <class Key, class Value, class ExpiryIndex, class Lock, class Clock, class Stats>
+void
+ExpireMap<Key, Value, ExpiryIndex, Lock, Clock, Stats>::
+set_capacity(size_t max_entries, size_t max_bytes, Sizer sizer) {
+    assert(max_entries > 0);
+    long long curtime = _now();
+    _wrlock_table();
+    _lock_queue();
+    _max_entries = max_entries;
+    _max_bytes = max_bytes;
+    _track_access = (max_entries != SIZE_MAX || max_bytes != SIZE_MAX);
+    _sizer = sizer;
+    // Account the entries already in the map
+    _bytes = 0;
+    if (_sizer) {
+        for (typename KVStore::iterator iter = _data_table.begin(); iter != _data_table.end();
+             ++iter) {
+            _bytes += _sizer(iter->first, iter->second.value);
+        }
+    }
+    // Nothing to keep. Every entry may be evicted.
+    _enforce_capacity_locked(NULL /* keep */, curtime);
+    pthread_mutex_unlock(&expiry_q_lock);
+    _wrunlock_table();
+}
+
+template <class Key, class Value, class ExpiryIndex, class Lock, class Clock, class Stats>
+void
+ExpireMap<Key, Value, ExpiryIndex, Lock, Clock, Stats>::
+_enforce_capacity_locked(const Key* keep, long long curtime) {
+    while (_data_table.size() > _max_entries || _bytes > _max_bytes) {
+        typename KVStore::iterator victim = _sample_victim(keep, curtime);
+        if (victim == _data_table.end()) {
+            // Only keep is left
+            break;
+        }
+        _expiry_queue.cancel(victim->second.handle);
+        _erase_locked(victim, kEvicted);
+        _capacity_evictions.fetch_add(1, memory_order_relaxed);
+    }
+}
+
+template <class Key, class Value, class ExpiryIndex, class Lock, class Clock, class Stats>
+typename ExpireMap<Key, Value, ExpiryIndex, Lock, Clock, Stats>::KVStore::iterator
+ExpireMap<Key, Value, ExpiryIndex, Lock, Clock, Stats>::
+_sample_victim(const Key* keep, long long curtime) {
+    const Key* victim = NULL;
+    long long victim_access = LLONG_MAX;
+    // Pick random buckets (xorshift) till kCapacitySamples entries have been seen. Most
+    // buckets hold at most one entry at the default load factor.
+    size_t buckets = _data_table.bucket_count();
+    int sampled = 0;
+    for (int tries = 0; sampled < kCapacitySamples && tries < kCapacitySamples * 16; ++tries) {
+        _rng ^= _rng << 13;
+        _rng ^= _rng >> 7;
+        _rng ^= _rng << 17;
+        size_t bucket = _rng % buckets;
+        for (typename KVStore::local_iterator iter = _data_table.begin(bucket);
+             iter != _data_table.end(bucket); ++iter) {
+            if (keep && iter->first == *keep) continue;
+            ++sampled;
+            // Expired entries go first
+            long long access = (iter->second.expiry.load(memory_order_relaxed) < curtime)
+                ? LLONG_MIN : iter->second.last_access.load(memory_order_relaxed);
+            if (access < victim_access) {
+                victim_access = access;
+                victim = &iter->first;
+            }
+        }
+    }
+    if (victim) {
+        return _data_table.find(*victim);
+    }
+    // Sampling only hit empty buckets. Fall back to the first entry.
+    typename KVStore::iterator iter = _data_table.begin();
+    for (; iter != _data_table.end(); ++iter) {
+        if (!keep || !(iter->first == *keep)) break;
+    }
+    return iter;
+}
+
+template <class Key, class Value, class ExpiryIndex, class Lock, class Clock, class Stats>
+void
+ExpireMap<Key, Value, ExpiryIndex, Lock, Clock, Stats>::
+set_eviction_slice(size_t max_keys, long long max_hold_us) {
+    assert(max_keys > 0 && max_hold_us > 0);
+    _slice_keys.store(max_keys, memory_order_relaxed);
+    _slice_us.store(max_hold_us, memory_order_relaxed);
+}
+
+template <class Key, class Value, class ExpiryIndex, class Lock, class Clock, class Stats>
+bool
+ExpireMap<Key, Value, ExpiryIndex, Lock, Clock, Stats>::
+_arm_locked(long long expiry) {
+    // Entries expiring after the armed expiry are evicted when the service wakes up
+    // for the armed one
+    if (_service == NULL || expiry >= _armed_expiry) {
+        return false;
+    }
+    _armed_expiry = expiry;
+    return true;
+}
+
+template <class Key, class Value, class ExpiryIndex, class Lock, class Clock, class Stats>
 long long
-ExpireMap<Key, Value>::
+ExpireMap<Key, Value, ExpiryIndex, Lock, Clock, Stats>::
 _evict() {
-    long long curtime =
-        duration_cast<microseconds>(high_resolution_clock::now().time_since_epoch()).count();
+    long long curtime = _now();
+    ExpiredEntries remove_entries;
+    vector<typename KVStore::iterator> touched;   // Popped entries touched since
     // Lock expiry queue
-    pthread_mutex_lock(&expiry_q_lock);
-    while (!_shutdown && !_expiry_queue.empty() && _expiry_queue.begin()->first < curtime) {
-        long long remove_expiry = _expiry_queue.begin()->first;
-        set<Key> remove_keys = _expiry_queue.begin()->second;
-        _expiry_queue.erase(_expiry_queue.begin());
+    _lock_queue();
+    // The data table is only locked once entries are due. Work internal to the expiry
+    // queue, such as cascades of the timing wheel or skipping idle time, is done
+    // here under the expiry queue lock alone.
+    while (!_shutdown && _expiry_queue.advance(curtime)) {
         // Unlock expiry queue
         pthread_mutex_unlock(&expiry_q_lock);
-        // Write lock data table
-        pthread_rwlock_wrlock(&data_tbl_lock);
-        for (KeyIterator it = remove_keys.begin(); it != remove_keys.end(); ++it) {
-            Key remove_key = *it;
-            typename KVStore::iterator iter = _data_table.find(remove_key);
-            if (iter != _data_table.end()) {
-                // Expiry may not match if the removal of an entry is racing with an insertion of a
-                // KV with the same key. Ignore removal in this case, overwrite would have removed
-                // the value. Removal of the newly inserted value will be taken care of by the new
-                // entry being added into the expiry queue.
-                if (iter->second.expiry == remove_expiry) {
-                    _data_table.erase(remove_key);
+        size_t max_keys = _slice_keys.load(memory_order_relaxed);
+        long long max_hold_us = _slice_us.load(memory_order_relaxed);
+        // Entries are popped with the data table write locked. Popping invalidates the
+        // handles of the entries.
+        _wrlock_table();
+        long long start = SteadyClock::now();
+        // Pop and erase expired entries till the slice runs out of keys or time. With a
+        // time limit, entries are popped in chunks so that the time can be checked.
+        size_t evicted = 0;
+        while (evicted < max_keys) {
+            size_t chunk = max_keys - evicted;
+            if (max_hold_us != LLONG_MAX && chunk > kEvictChunk) {
+                chunk = kEvictChunk;
+            }
+            _lock_queue();
+            bool popped = _expiry_queue.pop_expired(curtime, remove_entries, chunk);
+            pthread_mutex_unlock(&expiry_q_lock);
+            if (!popped) {
+                break;
+            }
+            // Expired entries are compacted to the front of remove_entries with their
+            // expiry
+            size_t expired = 0;
+            for (size_t i = 0; i < remove_entries.size(); ++i) {
+                // Every popped key is in the data table. The expiry queue holds the expiry
+                // of the last write, and touch may have moved the expiry past it since.
+                typename KVStore::iterator iter =
+                    _data_table.find(KeyTrait::key_of(remove_entries[i].second));
+                assert(iter != _data_table.end());
+                long long expiry = iter->second.expiry.load(memory_order_relaxed);
+                assert(expiry >= remove_entries[i].first);
+                if (expiry >= curtime) {
+                    touched.push_back(iter);
+                    continue;
                 }
+                _erase_locked(iter, kExpired);
+                remove_entries[expired++].first = expiry;
+            }
+            if (!touched.empty()) {
+                // Back into the expiry queue at the expiry they were touched to
+                _lock_queue();
+                for (size_t i = 0; i < touched.size(); ++i) {
+                    touched[i]->second.handle = _expiry_queue.schedule(
+                        touched[i]->second.expiry.load(memory_order_relaxed),
+                        KeyTrait::index_key(touched[i]->first));
+                }
+                pthread_mutex_unlock(&expiry_q_lock);
+                touched.clear();
+            }
+            long long removed = _now();
+            for (size_t i = 0; i < expired; ++i) {
+                _eviction_lags.record(removed - remove_entries[i].first);
+            }
+            // Rescheduled entries count against the slice too
+            evicted += remove_entries.size();
+            _expirations.fetch_add(expired, memory_order_relaxed);
+            remove_entries.clear();
+            if (max_hold_us != LLONG_MAX && SteadyClock::now() - start >= max_hold_us) {
+                break;
             }
         }
-        // unlock data table
-        pthread_rwlock_unlock(&data_tbl_lock);
+        long long pause = SteadyClock::now() - start;
+        // unlock data table. Eviction is the one writer that waits for a full ring.
+        _wrunlock_table(true /* block */);
+        // The due entries may have been removed or overwritten before the data table was
+        // locked. A slice that popped nothing is not a pause of eviction.
+        if (evicted > 0) {
+            _eviction_pauses.record(pause);
+            _stats.record_batch(evicted);
+        }
+        // Let threads waiting for the data table in before the next slice
+        sched_yield();
         // Lock expiry queue
-        pthread_mutex_lock(&expiry_q_lock);
-        curtime =
-            duration_cast<microseconds>(high_resolution_clock::now().time_since_epoch()).count();
-    }
-    // Sleep for the minimum of either
-    //  - 4 milliseconds or
-    //  - if the queue has more elements, time to next element's expiry.
-    // Sleeping is capped at 10 microseconds to evict entries that might be inserted in
-    // the future and set to expire in the next 4 milliseconds.
-    // Do not sleep if shutdown has been triggered.
-    long long sleeptime = _shutdown ? 0 : 4000;
+        _lock_queue();
+        curtime = _now();
+    }
+    // Time till the next element's expiry, if the queue has more elements.
+    // Do not wait if shutdown has been triggered.
+    long long next = _shutdown ? 0 : -1;
+    _armed_expiry = LLONG_MAX;
     if (!_shutdown && !_expiry_queue.empty()) {
-        // Sleeptime is guaranteed to be positive here because of the condition in while loop
-        // above.
-        sleeptime = min(sleeptime, _expiry_queue.begin()->first - curtime + 1);
-        assert(sleeptime > 0);
+        // Time to next expiry is guaranteed to be positive here because of the condition
+        // in while loop above.
+        next = _expiry_queue.next_expiry() - curtime + 1;
+        assert(next > 0);
+        _armed_expiry = _expiry_queue.next_expiry();
     }
     // Unlock expiry queue
     pthread_mutex_unlock(&expiry_q_lock);
-    return sleeptime;
+    return next;
 }
 
-template <class Key, class Value>
+template <class Key, class Value, class ExpiryIndex, class Lock, class Clock, class Stats>
 void
-ExpireMap<Key, Value>::
-_byol_erase_from_expiry_queue(long long expiry, Key key) {
-    // Verify that the expiry queue is locked
-    assert(pthread_mutex_trylock(&expiry_q_lock) == EBUSY);
-    ExpiryIterator iter = _expiry_queue.find(expiry);
-    // Remove entry from expiry queue if it exists
-    if (iter != _expiry_queue.end()) {
-        iter->second.erase(key);
-        if (iter->second.empty()) {
-            // If the keyset is empty, remove from expiry queue
-            _expiry_queue.erase(expiry);
+ExpireMap<Key, Value, ExpiryIndex, Lock, Clock, Stats>::
+stats(ExpireMapStats& stats) {
+    _stats.snapshot(stats);
+    stats.expirations += expirations();
+    stats.capacity_evictions += capacity_evictions();
+    stats.eviction_lags.merge(_eviction_lags);
+    stats.eviction_pauses.merge(_eviction_pauses);
+    data_tbl_lock.rdlock();
+    stats.size += _data_table.size();
+    pthread_mutex_lock(&expiry_q_lock);
+    stats.expiry_queue_size += _expiry_queue.size();
+    pthread_mutex_unlock(&expiry_q_lock);
+    data_tbl_lock.rdunlock();
+}
+
+template <class Key, class Value, class ExpiryIndex, class Lock, class Clock, class Stats>
+void
+ExpireMap<Key, Value, ExpiryIndex, Lock, Clock, Stats>::
+_rdlock_table() {
+    if (!Stats::kEnabled) {
+        data_tbl_lock.rdlock();
+        return;
+    }
+    _stats.count(kStatTableReadLocks);
+    if (!data_tbl_lock.tryrdlock()) {
+        long long start = SteadyClock::now();
+        data_tbl_lock.rdlock();
+        _stats.record_wait(kWaitTableRead, SteadyClock::now() - start);
+    }
+}
+
+template <class Key, class Value, class ExpiryIndex, class Lock, class Clock, class Stats>
+void
+ExpireMap<Key, Value, ExpiryIndex, Lock, Clock, Stats>::
+_wrlock_table() {
+    if (!Stats::kEnabled) {
+        data_tbl_lock.wrlock();
+        return;
+    }
+    _stats.count(kStatTableWriteLocks);
+    if (!data_tbl_lock.trywrlock()) {
+        long long start = SteadyClock::now();
+        data_tbl_lock.wrlock();
+        _stats.record_wait(kWaitTableWrite, SteadyClock::now() - start);
+    }
+}
+
+template <class Key, class Value, class ExpiryIndex, class Lock, class Clock, class Stats>
+void
+ExpireMap<Key, Value, ExpiryIndex, Lock, Clock, Stats>::
+_lock_queue() {
+    if (!Stats::kEnabled) {
+        pthread_mutex_lock(&expiry_q_lock);
+        return;
+    }
+    _stats.count(kStatQueueLocks);
+    if (pthread_mutex_trylock(&expiry_q_lock) != 0) {
+        long long start = SteadyClock::now();
+        pthread_mutex_lock(&expiry_q_lock);
+        _stats.record_wait(kWaitQueue, SteadyClock::now() - start);
+    }
+}
+
+template <class Key, class Value, class ExpiryIndex, class Lock, class Clock, class Stats>
+void
+ExpireMap<Key, Value, ExpiryIndex, Lock, Clock, Stats>::
+_wrunlock_table(bool block) {
+    if (_pending_events.empty()) {
+        data_tbl_lock.wrunlock();
+        return;
+    }
+    vector<Event> events;
+    events.swap(_pending_events);
+    EventStream* ring = _events;
+    data_tbl_lock.wrunlock();
+    _publish(events, ring, block);
+}
+
+template <class Key, class Value, class ExpiryIndex, class Lock, class Clock, class Stats>
+void
+ExpireMap<Key, Value, ExpiryIndex, Lock, Clock, Stats>::
+_publish(vector<Event>& events, EventStream* ring, bool block) {
+    for (size_t i = 0; i < events.size(); ++i) {
+        if (ring->try_push(move(events[i]))) {
+            continue;
+        }
+        if (!block || ring->policy() == kDropOnOverflow) {
+            ring->count_dropped(events.size() - i);
+            return;
+        }
+        // Backpressure. No lock is held, so the map keeps serving while this waits.
+        while (!ring->try_push(move(events[i]))) {
+            if (_shutdown) {
+                ring->count_dropped(events.size() - i);
+                return;
+            }
+            sched_yield();
         }
     }
 }
 
-template <class Key, class Value>
+template <class Key, class Value, class ExpiryIndex, class Lock, class Clock, class Stats>
+long long
+ExpireMap<Key, Value, ExpiryIndex, Lock, Clock, Stats>::
+_now() {
+    return Clock::now();
+}
+
+template <class Key, class Value, class ExpiryIndex, class Lock, class Clock, class Stats>
 void*
-ExpireMap<Key, Value>::
+ExpireMap<Key, Value, ExpiryIndex, Lock, Clock, Stats>::
 eviction(void* arg) {
-    ExpireMap<Key, Value>* exp_map = (ExpireMap<Key, Value>*)arg;
+    ExpireMap<Key, Value, ExpiryIndex, Lock, Clock, Stats>* exp_map = (ExpireMap<Key, Value, ExpiryIndex, Lock, Clock, Stats>*)arg;
     while(!exp_map->_shutdown) {
+        // Sleep for the minimum of either
+        //  - 4 milliseconds or
+        //  - if the queue has more elements, time to next element's expiry.
+        // Sleeping is capped at 4 milliseconds to evict entries that might be inserted in
+        // the future and set to expire before the next element.
         long long sleeptime = exp_map->_evict();
+        if (sleeptime < 0 || sleeptime > 4000) {
+            sleeptime = 4000;
+        }
         usleep(sleeptime);
     }
     pthread_exit(NULL /* ret */);
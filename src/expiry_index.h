@@ -0,0 +1,279 @@
+#ifndef EXPIRY_INDEX_H
+#define EXPIRY_INDEX_H
+
+#include <map>
+#include <set>
+#include <vector>
+#include <memory_resource>
+#include <cassert>
+#include <cstdint>
+using namespace std;
+
+//
+// Expiry index policies
+// ==============================================================================
+//
+// An expiry index tracks the keys of an ExpireMap in order of expiry so that the
+// eviction thread can find expired entries without walking the data table. It is
+// selected with the ExpiryIndex template parameter of ExpireMap. All policies are
+// protected by the expiry queue lock of the owning map and are not thread safe by
+// themselves.
+//
+// Every policy provides the following interface. Times are in microseconds.
+//
+// ExpiryIndex(long long start_time, pmr::memory_resource* resource)
+// - start_time is the current time of the owning map at construction.
+// - Entries are allocated from resource (see pool_resource.h).
+//
+// Rebind<K>
+// - The same policy for keys of type K. ExpireMap rebinds its index to what it
+//   stores in the index for a key, which is the key or its address in the data
+//   table (see key_traits.h).
+//
+// Handle
+// - Refers to a scheduled entry. Stored by the owning map next to the value so
+//   that the entry can be unlinked without looking it up again. A handle is valid
+//   till the entry is cancelled or popped.
+//
+// Handle schedule(long long expiry, const Key& key)
+// - Tracks key to expire at expiry.
+//
+// Handle schedule_last(long long expiry, const Key& key)
+// - Same as schedule. Faster when entries are scheduled in order of expiry, such
+//   as when a map is loaded from a snapshot.
+//
+// Handle reschedule(Handle handle, long long expiry)
+// - Moves a scheduled entry to a new expiry. Returns the new handle of the entry.
+//
+// void cancel(Handle handle)
+// - Stops tracking a scheduled entry.
+//
+// bool pop_expired(long long curtime, vector<pair<long long, Key> >& expired,
+//                  size_t max_entries)
+// - Removes the next bucket of entries that expired before curtime and appends
+//   them as (expiry, key) to expired. Pops at most max_entries entries. The rest
+//   of the bucket is popped by the next call. Returns false if no entry has
+//   expired. Handles of popped entries are no longer valid.
+//
+// bool advance(long long curtime)
+// - Returns true if pop_expired would return entries at curtime. Pops nothing, so
+//   all handles stay valid, but may move entries within the index (the timing
+//   wheel cascades up to curtime). Lets the owning map find out whether there is
+//   anything to evict without locking its data table.
+//
+// long long next_expiry()
+// - Time after which pop_expired will next return entries, or after which the
+//   index has internal work to do (the timing wheel cascades). Index must not be
+//   empty.
+//
+// size_t size(), bool empty(), void clear()
+//
+
+//
+// OrderedExpiryIndex
+// ------------------------------------------------------------------------------
+// Ordered multimap keyed by expiry times in order from earliest to latest. The
+// handle is the iterator of the entry. schedule is O(log n). cancel is amortized
+// O(1). Entries are popped exactly at their expiry, one expiry time per bucket.
+//
+template <class Key>
+class OrderedExpiryIndex {
+    public: // Types
+        typedef pmr::multimap<long long, Key> ExpiryQueue;
+        typedef typename ExpiryQueue::iterator Handle;
+        template <class K>
+        using Rebind = OrderedExpiryIndex<K>;
+
+    private: // Data
+        ExpiryQueue _queue;
+
+    public: // Constructor
+        explicit OrderedExpiryIndex(long long start_time = 0,
+                                    pmr::memory_resource* resource = pmr::get_default_resource())
+            : _queue(resource) { }
+
+    public: // Accessors
+        Handle schedule(long long expiry, const Key& key) {
+            return _queue.insert(make_pair(expiry, key));
+        }
+        Handle schedule_last(long long expiry, const Key& key) {
+            // Amortized O(1) when expiry is no earlier than the last entry
+            return _queue.emplace_hint(_queue.end(), expiry, key);
+        }
+        Handle reschedule(Handle handle, long long expiry);
+        void cancel(Handle handle) { _queue.erase(handle); }
+        bool pop_expired(long long curtime, vector<pair<long long, Key> >& expired,
+                         size_t max_entries = SIZE_MAX);
+        bool advance(long long curtime) const {
+            return !_queue.empty() && _queue.begin()->first < curtime;
+        }
+        long long next_expiry() const { return _queue.begin()->first; }
+        size_t size() const { return _queue.size(); }
+        bool empty() const { return _queue.empty(); }
+        void clear() { _queue.clear(); }
+}; // OrderedExpiryIndex
+
+//
+// TimingWheelExpiryIndex
+// ------------------------------------------------------------------------------
+// Hierarchical timing wheel. Time is divided into ticks of TickUs microseconds.
+// There are kLevels wheels of kSlots slots each. Level 0 has a slot per tick,
+// level 1 a slot per kSlots ticks and so on. An entry is linked into the slot of
+// the lowest level that can represent the distance to its expiry and moves down
+// a level (cascades) when the wheel reaches the start of its slot. Entries
+// further than the range of the top level are parked in the last slot of the
+// top level and re-placed when it cascades.
+//
+// The handle is the node of the entry. schedule, reschedule and cancel are O(1).
+// Expired entries are popped a level 0 slot (one tick) at a time. An entry expires
+// no later than expiry + TickUs. The rest of a partially popped slot is kept on a
+// list of due entries, which is popped before moving on.
+//
+// The range covered by the wheels is kSlots^kLevels ticks (~12 days with the
+// default 1 ms tick).
+//
+template <class Key, long long TickUs = 1000>
+class TimingWheelExpiryIndex {
+    private: // Types
+        // Link in a circular doubly linked list. Each slot is the sentinel of a list.
+        struct Link {
+            Link* prev;
+            Link* next;
+            Link() : prev(this), next(this) { }
+        };
+        struct Node : public Link {
+            long long expiry;
+            Key key;
+            Node(long long p_expiry, const Key& p_key) : Link(), expiry(p_expiry), key(p_key) { }
+        };
+
+    public: // Types
+        typedef Node* Handle;
+        template <class K>
+        using Rebind = TimingWheelExpiryIndex<K, TickUs>;
+
+    public: // Constants
+        static const int kBits = 6;
+        static const int kSlots = 1 << kBits;
+        static const int kLevels = 5;
+
+    private: // Data
+        pmr::polymorphic_allocator<Node> _alloc;    // Allocates nodes
+        Link _slots[kLevels][kSlots];
+        Link _due;                  // Expired entries of a partially popped slot
+        long long _current_tick;    // All ticks before this have been processed
+        size_t _size;               // Number of nodes in the wheel
+
+    public: // Constructor/Desctructor
+        explicit TimingWheelExpiryIndex(long long start_time = 0,
+                                        pmr::memory_resource* resource = pmr::get_default_resource());
+        ~TimingWheelExpiryIndex() { clear(); }
+
+    public: // Accessors
+        Handle schedule(long long expiry, const Key& key);
+        Handle schedule_last(long long expiry, const Key& key) { return schedule(expiry, key); }
+        Handle reschedule(Handle handle, long long expiry);
+        void cancel(Handle handle);
+        bool pop_expired(long long curtime, vector<pair<long long, Key> >& expired,
+                         size_t max_entries = SIZE_MAX);
+        bool advance(long long curtime);
+        long long next_expiry() const;
+        size_t size() const { return _size; }
+        bool empty() const { return _size == 0; }
+        void clear();
+
+    private: // Helpers
+        // Link the node into the slot matching its expiry relative to the current tick
+        void _place(Node* node);
+        // Move entries of higher level slots starting at tick to lower levels
+        void _cascade(long long tick);
+        // Move all the nodes of the slot to the list
+        static void _splice(Link* slot, Link* list);
+        // Pops up to max_entries nodes of the due list. Returns the number popped.
+        size_t _pop_due(vector<pair<long long, Key> >& expired, size_t max_entries);
+        Node* _new_node(long long expiry, const Key& key);
+        void _delete_node(Node* node);
+        static void _unlink(Link* link);
+        static void _link_tail(Link* slot, Link* link);
+
+    private: // Not copyable. Slots are self referencing.
+        TimingWheelExpiryIndex(const TimingWheelExpiryIndex&);
+        TimingWheelExpiryIndex& operator=(const TimingWheelExpiryIndex&);
+}; // TimingWheelExpiryIndex
+
+//
+// FifoExpiryIndex
+// ------------------------------------------------------------------------------
+// Ring buffer of (expiry, key) slots for maps where every put uses the same
+// timeout, so entries are scheduled in order of expiry. schedule appends at the
+// tail and pop_expired pops from the head, both O(1) amortized with no allocation
+// per entry. The ring doubles when full.
+//
+// The handle is the sequence number of the slot, which is never reused. cancel
+// does not erase, it only marks the slot dead and the slot is skipped when it
+// reaches the head. reschedule cancels and appends anew, so an overwrite is a
+// mark and an append. Dead slots take room in the ring till they reach the head.
+//
+// Entries are popped in the order they were scheduled. An entry scheduled with an
+// earlier expiry than the entries ahead of it, such as after a touch that shortens
+// the timeout, is popped after them: late, never early.
+//
+template <class Key>
+class FifoExpiryIndex {
+    private: // Types
+        struct Slot {
+            long long expiry;
+            Key key;
+            bool live;              // Cleared when cancelled or popped
+            Slot() : expiry(0), key(), live(false) { }
+        };
+
+    public: // Types
+        typedef uint64_t Handle;
+        template <class K>
+        using Rebind = FifoExpiryIndex<K>;
+
+    public: // Constants
+        static const size_t kMinSlots = 64;
+
+    private: // Data
+        pmr::vector<Slot> _slots;   // Ring. Size is a power of two.
+        uint64_t _head;             // Sequence of the oldest slot. Live unless empty.
+        uint64_t _tail;             // Sequence of the next slot appended
+        size_t _size;               // Number of live slots
+
+    public: // Constructor
+        explicit FifoExpiryIndex(long long start_time = 0,
+                                 pmr::memory_resource* resource = pmr::get_default_resource())
+            : _slots(kMinSlots, resource), _head(0), _tail(0), _size(0) { }
+
+    public: // Accessors
+        Handle schedule(long long expiry, const Key& key) { return _append(expiry, Key(key)); }
+        Handle schedule_last(long long expiry, const Key& key) { return schedule(expiry, key); }
+        Handle reschedule(Handle handle, long long expiry);
+        void cancel(Handle handle);
+        bool pop_expired(long long curtime, vector<pair<long long, Key> >& expired,
+                         size_t max_entries = SIZE_MAX);
+        bool advance(long long curtime) const {
+            return _size > 0 && _slot(_head).expiry < curtime;
+        }
+        long long next_expiry() const { return _slot(_head).expiry; }
+        size_t size() const { return _size; }
+        bool empty() const { return _size == 0; }
+        void clear();
+        // Number of slots in the ring, live or dead
+        size_t capacity() const { return _slots.size(); }
+
+    private: // Helpers
+        Slot& _slot(uint64_t seq) { return _slots[seq & (_slots.size() - 1)]; }
+        const Slot& _slot(uint64_t seq) const { return _slots[seq & (_slots.size() - 1)]; }
+        Handle _append(long long expiry, Key&& key);
+        // Advances the head past dead slots
+        void _drop_dead();
+        // Doubles the ring
+        void _grow();
+}; // FifoExpiryIndex
+
+#include "expiry_index.hh"
+
+#endif // EXPIRY_INDEX_H
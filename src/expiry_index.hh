@@ -0,0 +1,370 @@
+#ifndef EXPIRY_INDEX_HH
+#define EXPIRY_INDEX_HH
+
+//
+// OrderedExpiryIndex
+//
+
+template <class Key>
+typename OrderedExpiryIndex<Key>::Handle
+OrderedExpiryIndex<Key>::
+reschedule(Handle handle, long long expiry) {
+    // Reuse the tree node of the entry
+    typename ExpiryQueue::node_type node = _queue.extract(handle);
+    node.key() = expiry;
+    return _queue.insert(std::move(node));
+}
+
+template <class Key>
+bool
+OrderedExpiryIndex<Key>::
+pop_expired(long long curtime, vector<pair<long long, Key> >& expired, size_t max_entries) {
+    if (_queue.empty() || _queue.begin()->first >= curtime || max_entries == 0) {
+        return false;
+    }
+    // Pop the keys expiring at the earliest expiry time
+    Handle begin = _queue.begin();
+    Handle end = begin;
+    long long expiry = begin->first;
+    for (size_t popped = 0; end != _queue.end() && end->first == expiry &&
+                            popped < max_entries; ++end, ++popped) {
+        expired.push_back(*end);
+    }
+    _queue.erase(begin, end);
+    return true;
+}
+
+//
+// TimingWheelExpiryIndex
+//
+
+template <class Key, long long TickUs>
+TimingWheelExpiryIndex<Key, TickUs>::
+TimingWheelExpiryIndex(long long start_time, pmr::memory_resource* resource)
+    : _alloc(resource), _current_tick(start_time / TickUs), _size(0) {
+}
+
+template <class Key, long long TickUs>
+typename TimingWheelExpiryIndex<Key, TickUs>::Handle
+TimingWheelExpiryIndex<Key, TickUs>::
+schedule(long long expiry, const Key& key) {
+    Node* node = _new_node(expiry, key);
+    _place(node);
+    ++_size;
+    return node;
+}
+
+template <class Key, long long TickUs>
+typename TimingWheelExpiryIndex<Key, TickUs>::Handle
+TimingWheelExpiryIndex<Key, TickUs>::
+reschedule(Handle handle, long long expiry) {
+    _unlink(handle);
+    handle->expiry = expiry;
+    _place(handle);
+    return handle;
+}
+
+template <class Key, long long TickUs>
+void
+TimingWheelExpiryIndex<Key, TickUs>::
+cancel(Handle handle) {
+    _unlink(handle);
+    _delete_node(handle);
+    --_size;
+}
+
+template <class Key, long long TickUs>
+bool
+TimingWheelExpiryIndex<Key, TickUs>::
+pop_expired(long long curtime, vector<pair<long long, Key> >& expired, size_t max_entries) {
+    // Rest of a partially popped slot, or else the entries of the next expired tick
+    if (!advance(curtime) || max_entries == 0) {
+        return false;
+    }
+    return _pop_due(expired, max_entries) > 0;
+}
+
+template <class Key, long long TickUs>
+bool
+TimingWheelExpiryIndex<Key, TickUs>::
+advance(long long curtime) {
+    // A tick has expired once curtime is past its last microsecond
+    long long now_tick = curtime / TickUs;
+    if (_size == 0) {
+        // Nothing to cascade. Skip the idle ticks.
+        _current_tick = max(_current_tick, now_tick);
+        return false;
+    }
+    // Moves the expired entries of the ticks before now_tick to the due list, one
+    // tick at a time, stopping at the first tick that has some
+    while (_due.next == &_due && _current_tick < now_tick) {
+        long long tick = _current_tick;
+        _cascade(tick);
+        ++_current_tick;
+        Link list;
+        _splice(&_slots[0][tick & (kSlots - 1)], &list);
+        while (list.next != &list) {
+            Node* node = static_cast<Node*>(list.next);
+            _unlink(node);
+            // Entries beyond the range of the wheel are parked early. Re-place them.
+            if (node->expiry / TickUs > tick) {
+                _place(node);
+            } else {
+                _link_tail(&_due, node);
+            }
+        }
+    }
+    return _due.next != &_due;
+}
+
+template <class Key, long long TickUs>
+size_t
+TimingWheelExpiryIndex<Key, TickUs>::
+_pop_due(vector<pair<long long, Key> >& expired, size_t max_entries) {
+    size_t popped = 0;
+    while (_due.next != &_due && popped < max_entries) {
+        Node* node = static_cast<Node*>(_due.next);
+        _unlink(node);
+        expired.push_back(make_pair(node->expiry, node->key));
+        _delete_node(node);
+        --_size;
+        ++popped;
+    }
+    return popped;
+}
+
+template <class Key, long long TickUs>
+long long
+TimingWheelExpiryIndex<Key, TickUs>::
+next_expiry() const {
+    // Entries of a partially popped slot expired in the tick before the current tick
+    if (_due.next != &_due) {
+        return _current_tick * TickUs - 1;
+    }
+    // Earliest non empty level 0 slot. Its last microsecond has to pass for it to expire.
+    for (long long tick = _current_tick; tick < _current_tick + kSlots; ++tick) {
+        const Link* slot = &_slots[0][tick & (kSlots - 1)];
+        if (slot->next != slot) {
+            return tick * TickUs + TickUs - 1;
+        }
+    }
+    // Level 0 is empty. Wake up when the next level 1 slot cascades. The current tick has
+    // not been processed yet, so it cascades itself if it starts a level 1 slot.
+    long long cascade_tick = ((_current_tick + kSlots - 1) >> kBits) << kBits;
+    return cascade_tick * TickUs + TickUs - 1;
+}
+
+template <class Key, long long TickUs>
+void
+TimingWheelExpiryIndex<Key, TickUs>::
+clear() {
+    while (_due.next != &_due) {
+        Node* node = static_cast<Node*>(_due.next);
+        _unlink(node);
+        _delete_node(node);
+    }
+    for (int level = 0; level < kLevels; ++level) {
+        for (int idx = 0; idx < kSlots; ++idx) {
+            Link* slot = &_slots[level][idx];
+            while (slot->next != slot) {
+                Node* node = static_cast<Node*>(slot->next);
+                _unlink(node);
+                _delete_node(node);
+            }
+        }
+    }
+    _size = 0;
+}
+
+template <class Key, long long TickUs>
+void
+TimingWheelExpiryIndex<Key, TickUs>::
+_place(Node* node) {
+    static const long long kMaxDelta = (1LL << (kBits * kLevels)) - 1;
+    long long target = node->expiry / TickUs;
+    // Entries that are already due go into the slot of the current tick
+    if (target < _current_tick) {
+        target = _current_tick;
+    }
+    // Entries beyond the range of the wheel are parked in the farthest slot
+    if (target - _current_tick > kMaxDelta) {
+        target = _current_tick + kMaxDelta;
+    }
+    long long delta = target - _current_tick;
+    int level = 0;
+    while (level < kLevels - 1 && delta >= (1LL << (kBits * (level + 1)))) {
+        ++level;
+    }
+    int idx = (target >> (kBits * level)) & (kSlots - 1);
+    _link_tail(&_slots[level][idx], node);
+}
+
+template <class Key, long long TickUs>
+void
+TimingWheelExpiryIndex<Key, TickUs>::
+_cascade(long long tick) {
+    // Level n cascades when the low n * kBits bits of the tick are all zero
+    for (int level = 1; level < kLevels; ++level) {
+        if ((tick & ((1LL << (kBits * level)) - 1)) != 0) {
+            break;
+        }
+        Link list;
+        _splice(&_slots[level][(tick >> (kBits * level)) & (kSlots - 1)], &list);
+        while (list.next != &list) {
+            Node* node = static_cast<Node*>(list.next);
+            _unlink(node);
+            _place(node);
+        }
+    }
+}
+
+template <class Key, long long TickUs>
+void
+TimingWheelExpiryIndex<Key, TickUs>::
+_splice(Link* slot, Link* list) {
+    if (slot->next == slot) {
+        return;
+    }
+    list->next = slot->next;
+    list->prev = slot->prev;
+    list->next->prev = list;
+    list->prev->next = list;
+    slot->next = slot;
+    slot->prev = slot;
+}
+
+template <class Key, long long TickUs>
+typename TimingWheelExpiryIndex<Key, TickUs>::Node*
+TimingWheelExpiryIndex<Key, TickUs>::
+_new_node(long long expiry, const Key& key) {
+    Node* node = _alloc.allocate(1);
+    new (node) Node(expiry, key);
+    return node;
+}
+
+template <class Key, long long TickUs>
+void
+TimingWheelExpiryIndex<Key, TickUs>::
+_delete_node(Node* node) {
+    node->~Node();
+    _alloc.deallocate(node, 1);
+}
+
+template <class Key, long long TickUs>
+void
+TimingWheelExpiryIndex<Key, TickUs>::
+_unlink(Link* link) {
+    link->prev->next = link->next;
+    link->next->prev = link->prev;
+    link->next = link;
+    link->prev = link;
+}
+
+template <class Key, long long TickUs>
+void
+TimingWheelExpiryIndex<Key, TickUs>::
+_link_tail(Link* slot, Link* link) {
+    link->prev = slot->prev;
+    link->next = slot;
+    slot->prev->next = link;
+    slot->prev = link;
+}
+
+//
+// FifoExpiryIndex
+//
+
+template <class Key>
+typename FifoExpiryIndex<Key>::Handle
+FifoExpiryIndex<Key>::
+reschedule(Handle handle, long long expiry) {
+    Key key = std::move(_slot(handle).key);
+    cancel(handle);
+    return _append(expiry, std::move(key));
+}
+
+template <class Key>
+void
+FifoExpiryIndex<Key>::
+cancel(Handle handle) {
+    assert(handle >= _head && handle < _tail);
+    Slot& slot = _slot(handle);
+    assert(slot.live);
+    slot.live = false;
+    // Release what the key holds now rather than when the slot reaches the head
+    slot.key = Key();
+    --_size;
+    if (handle == _head) {
+        _drop_dead();
+    }
+}
+
+template <class Key>
+bool
+FifoExpiryIndex<Key>::
+pop_expired(long long curtime, vector<pair<long long, Key> >& expired, size_t max_entries) {
+    if (_size == 0 || _slot(_head).expiry >= curtime || max_entries == 0) {
+        return false;
+    }
+    // The head is always live, so each pass pops an entry
+    for (size_t popped = 0; _size > 0 && _slot(_head).expiry < curtime &&
+                            popped < max_entries; ++popped) {
+        Slot& slot = _slot(_head++);
+        expired.push_back(make_pair(slot.expiry, std::move(slot.key)));
+        slot.live = false;
+        --_size;
+        _drop_dead();
+    }
+    return true;
+}
+
+template <class Key>
+void
+FifoExpiryIndex<Key>::
+clear() {
+    for (; _head != _tail; ++_head) {
+        Slot& slot = _slot(_head);
+        slot.live = false;
+        slot.key = Key();
+    }
+    _size = 0;
+}
+
+template <class Key>
+typename FifoExpiryIndex<Key>::Handle
+FifoExpiryIndex<Key>::
+_append(long long expiry, Key&& key) {
+    if (_tail - _head == _slots.size()) {
+        _grow();
+    }
+    Slot& slot = _slot(_tail);
+    slot.expiry = expiry;
+    slot.key = std::move(key);
+    slot.live = true;
+    ++_size;
+    return _tail++;
+}
+
+template <class Key>
+void
+FifoExpiryIndex<Key>::
+_drop_dead() {
+    while (_head != _tail && !_slot(_head).live) {
+        ++_head;
+    }
+}
+
+template <class Key>
+void
+FifoExpiryIndex<Key>::
+_grow() {
+    // Slots keep their sequence numbers, so handles stay valid
+    pmr::vector<Slot> slots(_slots.size() * 2, _slots.get_allocator());
+    uint64_t mask = slots.size() - 1;
+    for (uint64_t seq = _head; seq != _tail; ++seq) {
+        slots[seq & mask] = std::move(_slot(seq));
+    }
+    _slots.swap(slots);
+}
+
+#endif // EXPIRY_INDEX_HH
@@ -0,0 +1,194 @@
+#ifndef FLAT_EXPIRE_MAP_H
+#define FLAT_EXPIRE_MAP_H
+
+#include <functional>
+#include <type_traits>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cassert>
+#include <vector>
+using namespace std;
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "rw_lock.h"
+#include "clock.h"
+
+//
+// FlatExpireMap
+// ==============================================================================
+//
+// ExpireMap for trivially copyable keys and values backed by a flat open addressing
+// table instead of std::unordered_map and an expiry queue.
+//
+// Keys, values, expiries and control bytes live in four separate contiguous arrays.
+// There is no per entry heap node and no pointer chase on lookup. The control byte
+// of a slot is either empty, deleted or holds 7 bits of the hash of the key in the
+// slot. Slots are probed 16 at a time (a group) by comparing the control bytes of
+// the group against the hash bits with SSE2, with a scalar fallback for other
+// targets. Only slots whose control byte matches are compared against the key.
+//
+// Expiry is stored inline as a 32 bit count of milliseconds since a base time of
+// the map. A put moves the base forward once the count passes 2^31, so stored
+// expiries stay below 2^32 - 1. The current time saturates at 2^32 - 1 instead of
+// wrapping, so a map left without puts for more than ~49.7 days sees every entry
+// as expired rather than old entries as live. Validity is tracked at millisecond
+// granularity: an entry is valid till the end of the millisecond in which its
+// timeout elapses. Timeouts are capped at kMaxTimeoutMs = 2^31 - 1 ms (~24.8 days).
+//
+// There is no eviction thread. An expired slot is reused in place by the next put
+// that probes over it, and all expired slots are reclaimed before the table grows.
+// Expired entries are never returned by get.
+//
+// Constructor takes the initial capacity, rounded up to a power of two of at least
+// one group.
+//
+// put/get/remove and the batch operations multi_put/multi_get/multi_remove have the
+// same semantics as in ExpireMap. Batch operations hash all keys up front and
+// prefetch the control bytes and keys of a few keys ahead of the one being probed.
+//
+template <class Key, class Value, class Lock = PthreadRWLock, class Hash = hash<Key>,
+          class Clock = SteadyClock>
+class FlatExpireMap {
+    static_assert(is_trivially_copyable<Key>::value, "FlatExpireMap needs a trivially copyable key");
+    static_assert(is_trivially_copyable<Value>::value, "FlatExpireMap needs a trivially copyable value");
+
+    public: // Constants
+        // Longest timeout. Longer timeouts are capped.
+        static const long kMaxTimeoutMs = (1L << 31) - 1;
+
+    private: // Types
+        // Current time once the millisecond count has run out of 32 bits
+        static const uint32_t kSaturatedMs = UINT32_MAX;
+        // Control byte values. Full slots hold the low 7 bits of the hash (0 to 127).
+        static const int8_t kEmpty = -128;
+        static const int8_t kDeleted = -2;
+        // Control bytes of a group of slots
+        struct Group {
+            static const int kWidth = 16;
+#ifdef __SSE2__
+            __m128i ctrl;
+            explicit Group(const int8_t* p) : ctrl(_mm_load_si128((const __m128i*)p)) { }
+            // Bitmask of slots whose control byte is h
+            unsigned match(int8_t h) const {
+                return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(h), ctrl));
+            }
+            // Bitmask of slots that are empty or deleted (negative control byte)
+            unsigned match_free() const {
+                return _mm_movemask_epi8(_mm_cmpgt_epi8(_mm_setzero_si128(), ctrl));
+            }
+#else
+            const int8_t* ctrl;
+            explicit Group(const int8_t* p) : ctrl(p) { }
+            unsigned match(int8_t h) const {
+                unsigned mask = 0;
+                for (int i = 0; i < kWidth; ++i) {
+                    mask |= (unsigned)(ctrl[i] == h) << i;
+                }
+                return mask;
+            }
+            unsigned match_free() const {
+                unsigned mask = 0;
+                for (int i = 0; i < kWidth; ++i) {
+                    mask |= (unsigned)(ctrl[i] < 0) << i;
+                }
+                return mask;
+            }
+#endif
+            unsigned match_empty() const { return match(kEmpty); }
+        };
+
+    private: // Data
+        int8_t* _ctrl;              // Control byte per slot. 16 byte aligned.
+        Key* _keys;                 // Key per slot
+        Value* _values;             // Value per slot
+        uint32_t* _expiry;          // Expiry per slot in milliseconds since _base_time
+        size_t _capacity;           // Number of slots. Power of two, multiple of group width.
+        size_t _size;               // Number of full slots, including expired ones
+        size_t _deleted;            // Number of deleted slots
+        long long _base_time;       // Time in microseconds that expiries are relative to
+        Hash _hasher;
+        Lock _lock;
+
+    public: // Constructor/Desctructor
+    FlatExpireMap(size_t capacity = 1024);
+    ~FlatExpireMap();
+
+    public: // Accessors
+        // Same as ExpireMap::put. Timeouts above kMaxTimeoutMs are capped.
+        void put(Key key, Value value, long timeoutMs);
+        // Same as ExpireMap::get.
+        Value get(Key key);
+        // Same as ExpireMap::remove.
+        void remove(Key key);
+
+    public: // Batch accessors
+        // Same as ExpireMap::multi_put.
+        template <class KeyIter, class ValueIter>
+        void multi_put(KeyIter first, KeyIter last, ValueIter values, long timeoutMs);
+        // Same as ExpireMap::multi_get.
+        template <class KeyIter, class ValueIter>
+        size_t multi_get(KeyIter first, KeyIter last, ValueIter values, vector<bool>& hits);
+        // Same as ExpireMap::multi_remove.
+        template <class KeyIter>
+        size_t multi_remove(KeyIter first, KeyIter last);
+
+    private: // Helpers
+        // Number of keys ahead of the current one whose first group is prefetched in
+        // batch operations
+        static const size_t kPrefetchDistance = 8;
+        // Hashes the keys of [first, last) into hashes and returns the keys in keys
+        template <class KeyIter>
+        void _hash_batch(KeyIter first, KeyIter last, vector<Key>& keys,
+                         vector<size_t>& hashes) const;
+        // Prefetches the control bytes and keys of the first group probed for hash
+        void _prefetch(size_t hash) const;
+        // Inserts or overwrites key. Called with the table write locked. now is the
+        // current time in milliseconds and is updated if the base time moves.
+        void _put_locked(const Key& key, const Value& value, size_t hash, long timeoutMs,
+                         uint32_t& now);
+        // Mixed hash of the key. Low 7 bits are stored in the control byte, the rest pick
+        // the first group to probe.
+        size_t _hash(const Key& key) const;
+        // Returns the slot holding key or -1
+        long _find(const Key& key, size_t hash) const;
+        // Returns the slot to store key in: the slot already holding it or the first
+        // empty, deleted or expired slot on its probe sequence. Sets found if the key
+        // is in the table.
+        size_t _find_or_prepare(const Key& key, size_t hash, uint32_t now, bool& found);
+        // Marks slot as empty or deleted
+        void _erase_slot(size_t slot);
+        // Drops expired entries and rehashes into a table of the given capacity
+        void _rehash(size_t capacity, uint32_t now);
+        // Makes expiries relative to now and moves the base time to now. Drops all
+        // entries if now is saturated.
+        void _rebase(uint32_t now);
+        // Current time in milliseconds since _base_time, saturated at kSaturatedMs
+        uint32_t _now_ms() const;
+        static long long _now();
+
+    private: // Not copyable
+        FlatExpireMap(const FlatExpireMap&);
+        FlatExpireMap& operator=(const FlatExpireMap&);
+
+    public: // APIs for test
+        // Returns number of full slots, including expired entries not yet reclaimed
+        int debug_size() {
+            _lock.rdlock();
+            int sz = _size;
+            _lock.rdunlock();
+            return sz;
+        }
+        // Returns number of slots
+        size_t debug_capacity() {
+            _lock.rdlock();
+            size_t cap = _capacity;
+            _lock.rdunlock();
+            return cap;
+        }
+}; // FlatExpireMap
+
+#include "flat_expire_map.hh"
+
+#endif // FLAT_EXPIRE_MAP_H
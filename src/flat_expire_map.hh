@@ -0,0 +1,401 @@
+#ifndef FLAT_EXPIRE_MAP_HH
+#define FLAT_EXPIRE_MAP_HH
+
+template <class Key, class Value, class Lock, class Hash, class Clock>
+FlatExpireMap<Key, Value, Lock, Hash, Clock>::
+FlatExpireMap(size_t capacity)
+    : _ctrl(NULL), _keys(NULL), _values(NULL), _expiry(NULL), _capacity(0), _size(0),
+      _deleted(0), _base_time(_now()), _hasher(), _lock() {
+    size_t cap = Group::kWidth;
+    while (cap < capacity) {
+        cap <<= 1;
+    }
+    _rehash(cap, 0 /* now */);
+}
+
+template <class Key, class Value, class Lock, class Hash, class Clock>
+FlatExpireMap<Key, Value, Lock, Hash, Clock>::
+~FlatExpireMap() {
+    free(_ctrl);
+    free(_keys);
+    free(_values);
+    free(_expiry);
+}
+
+template <class Key, class Value, class Lock, class Hash, class Clock>
+void
+FlatExpireMap<Key, Value, Lock, Hash, Clock>::
+put(Key key, Value value, long timeoutMs) {
+    // Do not insert values for which validity is less than or equal to zero
+    if (timeoutMs <= 0) return;
+    if (timeoutMs > kMaxTimeoutMs) {
+        timeoutMs = kMaxTimeoutMs;
+    }
+    size_t hash = _hash(key);
+    // Write lock table
+    _lock.wrlock();
+    uint32_t now = _now_ms();
+    _put_locked(key, value, hash, timeoutMs, now);
+    // Unlock table
+    _lock.wrunlock();
+}
+
+template <class Key, class Value, class Lock, class Hash, class Clock>
+Value
+FlatExpireMap<Key, Value, Lock, Hash, Clock>::
+get(Key key) {
+    size_t hash = _hash(key);
+    // Read lock table
+    _lock.rdlock();
+    long slot = _find(key, hash);
+    // If value was not found or the value has expired, return Value()
+    if (slot < 0 || _expiry[slot] < _now_ms()) {
+        _lock.rdunlock();
+        return Value();
+    }
+    Value value = _values[slot];
+    // Unlock table
+    _lock.rdunlock();
+    return value;
+}
+
+template <class Key, class Value, class Lock, class Hash, class Clock>
+void
+FlatExpireMap<Key, Value, Lock, Hash, Clock>::
+remove(Key key) {
+    size_t hash = _hash(key);
+    // Write lock table
+    _lock.wrlock();
+    long slot = _find(key, hash);
+    // Remove the entry irrespective of the expiry time
+    if (slot >= 0) {
+        _erase_slot(slot);
+    }
+    // Unlock table
+    _lock.wrunlock();
+}
+
+template <class Key, class Value, class Lock, class Hash, class Clock>
+template <class KeyIter, class ValueIter>
+void
+FlatExpireMap<Key, Value, Lock, Hash, Clock>::
+multi_put(KeyIter first, KeyIter last, ValueIter values, long timeoutMs) {
+    if (timeoutMs <= 0) return;
+    if (timeoutMs > kMaxTimeoutMs) {
+        timeoutMs = kMaxTimeoutMs;
+    }
+    vector<Key> keys;
+    vector<size_t> hashes;
+    _hash_batch(first, last, keys, hashes);
+    _lock.wrlock();
+    uint32_t now = _now_ms();
+    for (size_t i = 0; i < keys.size(); ++i, ++values) {
+        if (i + kPrefetchDistance < keys.size()) {
+            _prefetch(hashes[i + kPrefetchDistance]);
+        }
+        _put_locked(keys[i], *values, hashes[i], timeoutMs, now);
+    }
+    _lock.wrunlock();
+}
+
+template <class Key, class Value, class Lock, class Hash, class Clock>
+template <class KeyIter, class ValueIter>
+size_t
+FlatExpireMap<Key, Value, Lock, Hash, Clock>::
+multi_get(KeyIter first, KeyIter last, ValueIter values, vector<bool>& hits) {
+    vector<Key> keys;
+    vector<size_t> hashes;
+    _hash_batch(first, last, keys, hashes);
+    hits.assign(keys.size(), false);
+    size_t found = 0;
+    _lock.rdlock();
+    uint32_t now = _now_ms();
+    for (size_t i = 0; i < keys.size(); ++i, ++values) {
+        if (i + kPrefetchDistance < keys.size()) {
+            _prefetch(hashes[i + kPrefetchDistance]);
+        }
+        long slot = _find(keys[i], hashes[i]);
+        if (slot < 0 || _expiry[slot] < now) {
+            *values = Value();
+            continue;
+        }
+        *values = _values[slot];
+        hits[i] = true;
+        ++found;
+    }
+    _lock.rdunlock();
+    return found;
+}
+
+template <class Key, class Value, class Lock, class Hash, class Clock>
+template <class KeyIter>
+size_t
+FlatExpireMap<Key, Value, Lock, Hash, Clock>::
+multi_remove(KeyIter first, KeyIter last) {
+    vector<Key> keys;
+    vector<size_t> hashes;
+    _hash_batch(first, last, keys, hashes);
+    size_t removed = 0;
+    _lock.wrlock();
+    for (size_t i = 0; i < keys.size(); ++i) {
+        if (i + kPrefetchDistance < keys.size()) {
+            _prefetch(hashes[i + kPrefetchDistance]);
+        }
+        long slot = _find(keys[i], hashes[i]);
+        if (slot >= 0) {
+            _erase_slot(slot);
+            ++removed;
+        }
+    }
+    _lock.wrunlock();
+    return removed;
+}
+
+template <class Key, class Value, class Lock, class Hash, class Clock>
+void
+FlatExpireMap<Key, Value, Lock, Hash, Clock>::
+_put_locked(const Key& key, const Value& value, size_t hash, long timeoutMs, uint32_t& now) {
+    // Keep now + timeout within 32 bits
+    if (now >= (1U << 31)) {
+        _rebase(now);
+        now = 0;
+    }
+    bool found = false;
+    size_t slot = _find_or_prepare(key, hash, now, found);
+    // A new entry that does not reuse an expired slot takes up an empty or deleted slot
+    if (!found && _ctrl[slot] < 0) {
+        // Keep at least 1/8th of the slots empty so that probing terminates quickly
+        if (_size + _deleted + 1 > _capacity - _capacity / 8) {
+            // Reclaim expired and deleted slots. Grow only if live entries would still
+            // take up more than 7/16th of the table.
+            size_t live = 0;
+            for (size_t i = 0; i < _capacity; ++i) {
+                live += (_ctrl[i] >= 0 && _expiry[i] >= now);
+            }
+            size_t capacity = _capacity;
+            if (live + 1 > (_capacity - _capacity / 8) / 2) {
+                capacity *= 2;
+            }
+            _rehash(capacity, now);
+            slot = _find_or_prepare(key, hash, now, found);
+        }
+        if (_ctrl[slot] == kDeleted) {
+            --_deleted;
+        }
+        ++_size;
+    }
+    _ctrl[slot] = hash & 0x7F;
+    _keys[slot] = key;
+    _values[slot] = value;
+    _expiry[slot] = now + (uint32_t)timeoutMs;
+}
+
+template <class Key, class Value, class Lock, class Hash, class Clock>
+template <class KeyIter>
+void
+FlatExpireMap<Key, Value, Lock, Hash, Clock>::
+_hash_batch(KeyIter first, KeyIter last, vector<Key>& keys, vector<size_t>& hashes) const {
+    for (; first != last; ++first) {
+        keys.push_back(*first);
+        hashes.push_back(_hash(*first));
+    }
+}
+
+template <class Key, class Value, class Lock, class Hash, class Clock>
+void
+FlatExpireMap<Key, Value, Lock, Hash, Clock>::
+_prefetch(size_t hash) const {
+    size_t group = (hash >> 7) & (_capacity / Group::kWidth - 1);
+    __builtin_prefetch(_ctrl + group * Group::kWidth);
+    __builtin_prefetch(_keys + group * Group::kWidth);
+}
+
+template <class Key, class Value, class Lock, class Hash, class Clock>
+size_t
+FlatExpireMap<Key, Value, Lock, Hash, Clock>::
+_hash(const Key& key) const {
+    // std::hash is the identity for integral types on common implementations. Mix the
+    // bits (Fibonacci hashing) so that both the control bits and the group bits vary.
+    unsigned long long h = (unsigned long long)_hasher(key) * 0x9E3779B97F4A7C15ULL;
+    return (size_t)(h ^ (h >> 32));
+}
+
+template <class Key, class Value, class Lock, class Hash, class Clock>
+long
+FlatExpireMap<Key, Value, Lock, Hash, Clock>::
+_find(const Key& key, size_t hash) const {
+    size_t group_mask = _capacity / Group::kWidth - 1;
+    size_t group = (hash >> 7) & group_mask;
+    // Triangular probing visits every group since the number of groups is a power of two
+    for (size_t probe = 1; ; ++probe) {
+        size_t base = group * Group::kWidth;
+        Group ctrl(_ctrl + base);
+        for (unsigned match = ctrl.match(hash & 0x7F); match; match &= match - 1) {
+            size_t slot = base + __builtin_ctz(match);
+            if (_keys[slot] == key) {
+                return slot;
+            }
+        }
+        // Key would have been stored in this group if it was in the table
+        if (ctrl.match_empty()) {
+            return -1;
+        }
+        group = (group + probe) & group_mask;
+    }
+}
+
+template <class Key, class Value, class Lock, class Hash, class Clock>
+size_t
+FlatExpireMap<Key, Value, Lock, Hash, Clock>::
+_find_or_prepare(const Key& key, size_t hash, uint32_t now, bool& found) {
+    size_t group_mask = _capacity / Group::kWidth - 1;
+    size_t group = (hash >> 7) & group_mask;
+    long candidate = -1;
+    for (size_t probe = 1; ; ++probe) {
+        size_t base = group * Group::kWidth;
+        Group ctrl(_ctrl + base);
+        for (unsigned match = ctrl.match(hash & 0x7F); match; match &= match - 1) {
+            size_t slot = base + __builtin_ctz(match);
+            if (_keys[slot] == key) {
+                found = true;
+                return slot;
+            }
+        }
+        if (candidate < 0) {
+            unsigned free_slots = ctrl.match_free();
+            if (free_slots) {
+                candidate = base + __builtin_ctz(free_slots);
+            } else {
+                // Group is full. Reuse an expired entry in place.
+                for (size_t slot = base; slot < base + Group::kWidth; ++slot) {
+                    if (_expiry[slot] < now) {
+                        candidate = slot;
+                        break;
+                    }
+                }
+            }
+        }
+        // Keep probing till a group with an empty slot to make sure the key is not stored
+        // further along. There is always at least one empty slot in the table.
+        if (ctrl.match_empty()) {
+            found = false;
+            return candidate;
+        }
+        group = (group + probe) & group_mask;
+    }
+}
+
+template <class Key, class Value, class Lock, class Hash, class Clock>
+void
+FlatExpireMap<Key, Value, Lock, Hash, Clock>::
+_erase_slot(size_t slot) {
+    // Probing stops at the first group with an empty slot. If the group already has one,
+    // no probe sequence continues past it and the slot can be made empty.
+    size_t base = slot - slot % Group::kWidth;
+    if (Group(_ctrl + base).match_empty()) {
+        _ctrl[slot] = kEmpty;
+    } else {
+        _ctrl[slot] = kDeleted;
+        ++_deleted;
+    }
+    --_size;
+}
+
+template <class Key, class Value, class Lock, class Hash, class Clock>
+void
+FlatExpireMap<Key, Value, Lock, Hash, Clock>::
+_rehash(size_t capacity, uint32_t now) {
+    int8_t* old_ctrl = _ctrl;
+    Key* old_keys = _keys;
+    Value* old_values = _values;
+    uint32_t* old_expiry = _expiry;
+    size_t old_capacity = _capacity;
+
+    void* ctrl = NULL;
+    int ret = posix_memalign(&ctrl, Group::kWidth, capacity);
+    assert(ret == 0);
+    _ctrl = (int8_t*)ctrl;
+    memset(_ctrl, kEmpty, capacity);
+    _keys = (Key*)malloc(capacity * sizeof(Key));
+    _values = (Value*)malloc(capacity * sizeof(Value));
+    _expiry = (uint32_t*)malloc(capacity * sizeof(uint32_t));
+    assert(_keys != NULL && _values != NULL && _expiry != NULL);
+    _capacity = capacity;
+    _size = 0;
+    _deleted = 0;
+
+    // Move live entries. Keys are unique, so each goes to the first free slot on its
+    // probe sequence.
+    size_t group_mask = _capacity / Group::kWidth - 1;
+    for (size_t i = 0; i < old_capacity; ++i) {
+        if (old_ctrl[i] < 0 || old_expiry[i] < now) {
+            continue;
+        }
+        size_t hash = _hash(old_keys[i]);
+        size_t group = (hash >> 7) & group_mask;
+        for (size_t probe = 1; ; ++probe) {
+            size_t base = group * Group::kWidth;
+            unsigned free_slots = Group(_ctrl + base).match_free();
+            if (free_slots) {
+                size_t slot = base + __builtin_ctz(free_slots);
+                _ctrl[slot] = old_ctrl[i];
+                _keys[slot] = old_keys[i];
+                _values[slot] = old_values[i];
+                _expiry[slot] = old_expiry[i];
+                ++_size;
+                break;
+            }
+            group = (group + probe) & group_mask;
+        }
+    }
+    free(old_ctrl);
+    free(old_keys);
+    free(old_values);
+    free(old_expiry);
+}
+
+template <class Key, class Value, class Lock, class Hash, class Clock>
+void
+FlatExpireMap<Key, Value, Lock, Hash, Clock>::
+_rebase(uint32_t now) {
+    for (size_t i = 0; i < _capacity; ++i) {
+        if (_ctrl[i] < 0) {
+            continue;
+        }
+        if (_expiry[i] < now) {
+            // Expired entries would become valid again relative to the new base
+            _erase_slot(i);
+        } else {
+            _expiry[i] -= now;
+        }
+    }
+    if (now == kSaturatedMs) {
+        // Idle past the range of the count. Every entry has expired and been dropped, so
+        // the base restarts at the current time.
+        _base_time = _now();
+    } else {
+        _base_time += (long long)now * 1000;
+    }
+}
+
+template <class Key, class Value, class Lock, class Hash, class Clock>
+uint32_t
+FlatExpireMap<Key, Value, Lock, Hash, Clock>::
+_now_ms() const {
+    long long elapsed = _now() - _base_time;
+    if (elapsed <= 0) {
+        return 0;
+    }
+    // Saturate rather than wrap. Stored expiries are below kSaturatedMs, so all entries
+    // read as expired.
+    return elapsed / 1000 >= kSaturatedMs ? kSaturatedMs : (uint32_t)(elapsed / 1000);
+}
+
+template <class Key, class Value, class Lock, class Hash, class Clock>
+long long
+FlatExpireMap<Key, Value, Lock, Hash, Clock>::
+_now() {
+    return Clock::now();
+}
+
+#endif // FLAT_EXPIRE_MAP_HH
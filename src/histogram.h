@@ -0,0 +1,118 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <atomic>
+#include <cstdint>
+using namespace std;
+
+//
+// LatencyHistogram
+// ==============================================================================
+//
+// Histogram of durations in microseconds with log linear buckets: every power of
+// two range is split into kSubBuckets equal buckets, so a recorded value is known
+// to within 1/kSubBuckets (12.5%) of itself. Values below kSubBuckets are exact.
+// Covers the whole range of long long.
+//
+// Recording is a relaxed atomic increment, so any number of threads can record
+// and read concurrently. Reads are not a point in time snapshot.
+//
+// void record(long long us)
+// - Counts a duration. Negative durations count as 0.
+//
+// void merge(const LatencyHistogram& other)
+// - Adds the counts of other.
+//
+// long long percentile(double p)
+// - Upper bound of the bucket holding the p-th percentile (0 < p <= 100). 0 if
+//   nothing has been recorded.
+//
+// uint64_t count(), long long max()
+//
+class LatencyHistogram {
+    public: // Constants
+        static const int kSubBits = 3;
+        static const int kSubBuckets = 1 << kSubBits;
+        static const int kBuckets = (64 - kSubBits) * kSubBuckets;
+
+    private: // Data
+        atomic<uint64_t> _counts[kBuckets];
+        atomic<long long> _max;
+
+    public: // Constructor
+        LatencyHistogram() : _max(0) {
+            for (int i = 0; i < kBuckets; ++i) {
+                _counts[i].store(0, memory_order_relaxed);
+            }
+        }
+
+    public: // Accessors
+        void record(long long us) {
+            if (us < 0) us = 0;
+            _counts[_bucket(us)].fetch_add(1, memory_order_relaxed);
+            long long cur = _max.load(memory_order_relaxed);
+            while (us > cur && !_max.compare_exchange_weak(cur, us, memory_order_relaxed)) { }
+        }
+        void merge(const LatencyHistogram& other) {
+            for (int i = 0; i < kBuckets; ++i) {
+                uint64_t count = other._counts[i].load(memory_order_relaxed);
+                if (count) {
+                    _counts[i].fetch_add(count, memory_order_relaxed);
+                }
+            }
+            long long other_max = other.max();
+            long long cur = _max.load(memory_order_relaxed);
+            while (other_max > cur &&
+                   !_max.compare_exchange_weak(cur, other_max, memory_order_relaxed)) { }
+        }
+        uint64_t count() const {
+            uint64_t total = 0;
+            for (int i = 0; i < kBuckets; ++i) {
+                total += _counts[i].load(memory_order_relaxed);
+            }
+            return total;
+        }
+        long long max() const { return _max.load(memory_order_relaxed); }
+        long long percentile(double p) const {
+            uint64_t total = count();
+            if (total == 0) return 0;
+            // Rank of the percentile, rounded up
+            uint64_t rank = (uint64_t)(p / 100 * total);
+            if (rank < p / 100 * total || rank == 0) ++rank;
+            uint64_t seen = 0;
+            for (int i = 0; i < kBuckets; ++i) {
+                seen += _counts[i].load(memory_order_relaxed);
+                if (seen >= rank) {
+                    // The bucket bound may exceed the largest value recorded
+                    long long bound = _upper_bound(i);
+                    return bound < max() ? bound : max();
+                }
+            }
+            return max();
+        }
+
+    private: // Helpers
+        // Values below kSubBuckets have a bucket each. Above, the top kSubBits + 1 bits
+        // of the value select the bucket within its power of two range.
+        static int _bucket(long long us) {
+            if (us < kSubBuckets) return (int)us;
+            int msb = 63 - __builtin_clzll((unsigned long long)us);
+            int shift = msb - kSubBits;
+            int sub = (int)((us >> shift) & (kSubBuckets - 1));
+            return (shift + 1) * kSubBuckets + sub;
+        }
+        // Largest value counted in bucket
+        static long long _upper_bound(int bucket) {
+            if (bucket < kSubBuckets) return bucket;
+            int shift = bucket / kSubBuckets - 1;
+            long long sub = bucket % kSubBuckets;
+            unsigned long long base = (unsigned long long)(kSubBuckets + sub) << shift;
+            return (long long)(base + ((1ULL << shift) - 1));
+        }
+
+    private: // Not copyable
+        LatencyHistogram(const LatencyHistogram&);
+        LatencyHistogram& operator=(const LatencyHistogram&);
+}; // LatencyHistogram
+
+#endif // HISTOGRAM_H
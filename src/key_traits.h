@@ -0,0 +1,111 @@
+#ifndef KEY_TRAITS_H
+#define KEY_TRAITS_H
+
+#include <string>
+#include <string_view>
+#include <functional>
+#include <type_traits>
+#include <cstddef>
+using namespace std;
+
+//
+// Key traits
+// ==============================================================================
+//
+// How ExpireMap stores, hashes and looks up keys of a given type. Picked by the key
+// type. Specialize KeyTraits to change the lookup of a key type of your own.
+//
+// IndexKey, index_key(const Key& key), key_of(const IndexKey& index_key)
+// - What the expiry index holds for an entry (see KeyStorage).
+//
+// Hash, Equal
+// - Hash function and equality of the data table.
+//
+// View
+// - Type of the key taken by get, try_get, with_value, remove, touch and
+//   get_and_touch. const Key& by default.
+//
+// string keys are looked up through a StringKeyView, so that a lookup from a
+// string_view or a C string builds no string and allocates nothing.
+//
+
+//
+// KeyStorage
+// ------------------------------------------------------------------------------
+// Keys that are trivially copyable and no larger than a pointer are copied into the
+// expiry index. Other keys are stored once, in the node of the data table, and the
+// expiry index holds the address of that key. Nodes of the data table do not move
+// while their entry is in the map, and the map takes an entry out of the expiry
+// index before erasing it, so the address is valid as long as the index holds it.
+//
+template <class Key>
+struct KeyStorage {
+    static const bool kByAddress =
+        !(is_trivially_copyable<Key>::value && sizeof(Key) <= sizeof(void*));
+    typedef typename conditional<kByAddress, const Key*, Key>::type IndexKey;
+    // What the expiry index holds for key, which lives in the data table
+    static IndexKey index_key(const Key& key) {
+        if constexpr (kByAddress) {
+            return &key;
+        } else {
+            return key;
+        }
+    }
+    // Key referred to by what the expiry index holds
+    static const Key& key_of(const IndexKey& index_key) {
+        if constexpr (kByAddress) {
+            return *index_key;
+        } else {
+            return index_key;
+        }
+    }
+};
+
+template <class Key>
+struct KeyTraits : public KeyStorage<Key> {
+    typedef hash<Key> Hash;
+    typedef equal_to<Key> Equal;
+    typedef const Key& View;
+};
+
+//
+// StringKeyView
+// ------------------------------------------------------------------------------
+// string key to look up, with its hash. Built implicitly from a string, a
+// string_view or a C string, hashing the key once for the whole lookup. A caller
+// that has the hash already passes it with StringKeyView(key, hash), hash being
+// StringKeyView::hash_of(key).
+//
+struct StringKeyView {
+    string_view key;
+    size_t hash;
+    StringKeyView(const string& p_key) : key(p_key), hash(hash_of(key)) { }
+    StringKeyView(string_view p_key) : key(p_key), hash(hash_of(key)) { }
+    StringKeyView(const char* p_key) : key(p_key), hash(hash_of(key)) { }
+    StringKeyView(string_view p_key, size_t p_hash) : key(p_key), hash(p_hash) { }
+    static size_t hash_of(string_view key) { return std::hash<string_view>()(key); }
+};
+
+// Transparent hash and equality, so that the data table finds a StringKeyView
+// without building a string
+struct StringKeyHash {
+    typedef void is_transparent;
+    size_t operator()(const string& key) const { return StringKeyView::hash_of(key); }
+    size_t operator()(const StringKeyView& view) const { return view.hash; }
+};
+
+struct StringKeyEqual {
+    typedef void is_transparent;
+    bool operator()(const string& a, const string& b) const { return a == b; }
+    bool operator()(const StringKeyView& a, const string& b) const { return a.key == b; }
+    bool operator()(const string& a, const StringKeyView& b) const { return a == b.key; }
+};
+
+template <>
+struct KeyTraits<string> : public KeyStorage<string> {
+    typedef StringKeyHash Hash;
+    typedef StringKeyEqual Equal;
+    typedef StringKeyView View;
+};
+
+#endif // KEY_TRAITS_H
@@ -0,0 +1,96 @@
+#ifndef LOADER_POOL_H
+#define LOADER_POOL_H
+
+#include <deque>
+#include <vector>
+#include <functional>
+#include <cassert>
+using namespace std;
+#include <pthread.h>
+
+//
+// LoaderPool
+// ==============================================================================
+//
+// A small pool of worker threads that run refresh-ahead reloads for
+// ExpireMap::get_or_load. Tasks are run in order of submission by the first free
+// worker. Loads block on the backend, so the pool is kept separate from the
+// eviction threads.
+//
+// Like EvictionService the pool may be shared by many maps and must outlive them.
+// A map waits for its own outstanding reloads when it is destroyed. Destroying the
+// pool runs the tasks still queued and joins the workers.
+//
+class LoaderPool {
+    public: // Types
+        typedef function<void()> Task;
+
+    private: // Data
+        deque<Task> _tasks;         // Tasks not started yet, oldest first
+        bool _shutdown;
+        pthread_mutex_t _lock;      // Protects all of the above
+        pthread_cond_t _wake;       // Signalled when a task is queued or on shutdown
+        vector<pthread_t> _threads;
+
+    public: // Constructor/Desctructor
+        explicit LoaderPool(int num_threads = 2) : _shutdown(false) {
+            assert(num_threads > 0);
+            int ret = pthread_mutex_init(&_lock, NULL /* attr */);
+            assert(ret == 0);
+            ret = pthread_cond_init(&_wake, NULL /* attr */);
+            assert(ret == 0);
+            _threads.resize(num_threads);
+            for (int i = 0; i < num_threads; ++i) {
+                pthread_create(&_threads[i], NULL /* attr */, run, this);
+            }
+        }
+        ~LoaderPool() {
+            pthread_mutex_lock(&_lock);
+            _shutdown = true;
+            pthread_cond_broadcast(&_wake);
+            pthread_mutex_unlock(&_lock);
+            for (size_t i = 0; i < _threads.size(); ++i) {
+                pthread_join(_threads[i], NULL /* ret */);
+            }
+            pthread_cond_destroy(&_wake);
+            pthread_mutex_destroy(&_lock);
+        }
+
+    public: // Accessors
+        // Queues task to run on a worker
+        void submit(Task task) {
+            pthread_mutex_lock(&_lock);
+            _tasks.push_back(move(task));
+            pthread_cond_signal(&_wake);
+            pthread_mutex_unlock(&_lock);
+        }
+        // Number of worker threads
+        int num_threads() const { return _threads.size(); }
+
+    private: // Helpers
+        // Worker thread. Exits once shutdown is set and the queue is empty.
+        static void* run(void* arg) {
+            LoaderPool* pool = (LoaderPool*)arg;
+            pthread_mutex_lock(&pool->_lock);
+            while (true) {
+                if (pool->_tasks.empty()) {
+                    if (pool->_shutdown) break;
+                    pthread_cond_wait(&pool->_wake, &pool->_lock);
+                    continue;
+                }
+                Task task = move(pool->_tasks.front());
+                pool->_tasks.pop_front();
+                pthread_mutex_unlock(&pool->_lock);
+                task();
+                pthread_mutex_lock(&pool->_lock);
+            }
+            pthread_mutex_unlock(&pool->_lock);
+            return NULL;
+        }
+
+    private: // Not copyable
+        LoaderPool(const LoaderPool&);
+        LoaderPool& operator=(const LoaderPool&);
+}; // LoaderPool
+
+#endif // LOADER_POOL_H
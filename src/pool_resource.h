@@ -0,0 +1,201 @@
+#ifndef POOL_RESOURCE_H
+#define POOL_RESOURCE_H
+
+#include <memory_resource>
+#include <vector>
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+using namespace std;
+#include <pthread.h>
+
+//
+// NodePoolResource
+// ==============================================================================
+//
+// Memory resource that pools the small fixed size blocks of node based containers:
+// the nodes of the data table of an ExpireMap and the nodes of its expiry index.
+// Pass it to the constructor of a map (or of several maps) so that steady state
+// churn of puts and expiries recycles nodes instead of going to the global heap.
+//
+// Blocks are rounded up to kAlign bytes and grouped in size classes up to kMaxBlock
+// bytes. Larger blocks, and blocks with a stricter alignment, go straight to the
+// upstream resource. Pooled blocks are carved from slabs of kSlabBytes bytes taken
+// from the upstream resource and kept till the pool is destroyed.
+//
+// The pool is split into kStripes stripes, each with its own lock, free lists and
+// slabs. Threads are assigned stripes round robin on first use and allocate from
+// their own stripe, so threads putting to different maps sharing a pool do not
+// contend. A freed block goes back to the stripe it was carved from (found from
+// the header of its slab), so that blocks allocated by a putting thread and freed
+// by an eviction thread are reused by the putting thread.
+//
+// size_t high_water_mark()
+// - Bytes of slabs taken from the upstream resource. Slabs are never returned
+//   before destruction, so this is the most memory the pool has held. It stops
+//   growing once churn is in a steady state.
+//
+// size_t bytes_in_use()
+// - Bytes of pooled blocks currently allocated.
+//
+// The pool must outlive every container allocating from it.
+//
+class NodePoolResource : public pmr::memory_resource {
+    public: // Constants
+        static const size_t kAlign = 16;
+        static const size_t kMaxBlock = 512;
+        static const int kClasses = kMaxBlock / kAlign;
+        static const size_t kSlabBytes = 64 * 1024;
+        static const int kStripes = 8;
+
+    private: // Types
+        static const int kCacheLine = 64;
+        struct FreeBlock {
+            FreeBlock* next;
+        };
+        // Start of every slab. Slabs are aligned to their size, so the header of the
+        // slab of a block is found by masking its address.
+        struct SlabHeader {
+            int stripe;
+        };
+        struct alignas(kCacheLine) Stripe {
+            pthread_mutex_t lock;
+            FreeBlock* free[kClasses];  // Free blocks of each size class
+            char* cursor;               // Uncarved rest of the current slab
+            char* limit;
+            long long in_use;           // Bytes of blocks of the stripe allocated
+        };
+
+    private: // Data
+        pmr::memory_resource* _upstream;
+        Stripe _stripes[kStripes];
+        vector<void*> _slabs;       // Slabs taken from upstream. Protected by _slab_lock.
+        atomic<size_t> _reserved;   // Bytes of _slabs
+        pthread_mutex_t _slab_lock;
+
+    public: // Constructor/Desctructor
+        explicit NodePoolResource(pmr::memory_resource* upstream = pmr::new_delete_resource())
+            : _upstream(upstream), _slabs(), _reserved(0) {
+            for (int i = 0; i < kStripes; ++i) {
+                Stripe& stripe = _stripes[i];
+                int mutex_ret = pthread_mutex_init(&stripe.lock, NULL /* attr */);
+                assert(mutex_ret == 0);
+                for (int c = 0; c < kClasses; ++c) {
+                    stripe.free[c] = NULL;
+                }
+                stripe.cursor = stripe.limit = NULL;
+                stripe.in_use = 0;
+            }
+            int mutex_ret = pthread_mutex_init(&_slab_lock, NULL /* attr */);
+            assert(mutex_ret == 0);
+        }
+        ~NodePoolResource() {
+            for (size_t i = 0; i < _slabs.size(); ++i) {
+                _upstream->deallocate(_slabs[i], kSlabBytes, kSlabBytes);
+            }
+            for (int i = 0; i < kStripes; ++i) {
+                pthread_mutex_destroy(&_stripes[i].lock);
+            }
+            pthread_mutex_destroy(&_slab_lock);
+        }
+
+    public: // Accessors
+        size_t high_water_mark() const { return _reserved.load(memory_order_relaxed); }
+        size_t bytes_in_use() {
+            long long in_use = 0;
+            for (int i = 0; i < kStripes; ++i) {
+                pthread_mutex_lock(&_stripes[i].lock);
+                in_use += _stripes[i].in_use;
+                pthread_mutex_unlock(&_stripes[i].lock);
+            }
+            return in_use;
+        }
+
+    private: // memory_resource
+        void* do_allocate(size_t bytes, size_t alignment) override {
+            if (bytes > kMaxBlock || alignment > kAlign) {
+                return _upstream->allocate(bytes, alignment);
+            }
+            int size_class = _class(bytes);
+            Stripe& stripe = _stripes[_stripe()];
+            pthread_mutex_lock(&stripe.lock);
+            FreeBlock* block = stripe.free[size_class];
+            if (block) {
+                stripe.free[size_class] = block->next;
+            } else {
+                block = (FreeBlock*)_carve(stripe, _size(size_class));
+            }
+            stripe.in_use += _size(size_class);
+            pthread_mutex_unlock(&stripe.lock);
+            return block;
+        }
+        void do_deallocate(void* p, size_t bytes, size_t alignment) override {
+            if (bytes > kMaxBlock || alignment > kAlign) {
+                _upstream->deallocate(p, bytes, alignment);
+                return;
+            }
+            int size_class = _class(bytes);
+            SlabHeader* slab = (SlabHeader*)((uintptr_t)p & ~(uintptr_t)(kSlabBytes - 1));
+            Stripe& stripe = _stripes[slab->stripe];
+            FreeBlock* block = (FreeBlock*)p;
+            pthread_mutex_lock(&stripe.lock);
+            block->next = stripe.free[size_class];
+            stripe.free[size_class] = block;
+            stripe.in_use -= _size(size_class);
+            pthread_mutex_unlock(&stripe.lock);
+        }
+        bool do_is_equal(const pmr::memory_resource& other) const noexcept override {
+            return this == &other;
+        }
+
+    private: // Helpers
+        static int _class(size_t bytes) {
+            return bytes == 0 ? 0 : (int)((bytes - 1) / kAlign);
+        }
+        static size_t _size(int size_class) {
+            return (size_class + 1) * kAlign;
+        }
+        // Stripe of the calling thread. Threads are assigned stripes round robin on
+        // first use.
+        static int _stripe() {
+            static atomic<unsigned> next_stripe(0);
+            static thread_local int stripe = next_stripe.fetch_add(1, memory_order_relaxed) % kStripes;
+            return stripe;
+        }
+        // Carves a block of size bytes from the current slab of the stripe, starting
+        // a new slab if it is used up. The rest of a used up slab is kept as a free
+        // block of the matching size class. Called with the stripe locked.
+        void* _carve(Stripe& stripe, size_t size) {
+            if ((size_t)(stripe.limit - stripe.cursor) < size) {
+                size_t rest = stripe.limit - stripe.cursor;
+                if (rest >= kAlign) {
+                    FreeBlock* block = (FreeBlock*)stripe.cursor;
+                    int size_class = _class(rest);
+                    block->next = stripe.free[size_class];
+                    stripe.free[size_class] = block;
+                }
+                char* slab = (char*)_new_slab(&stripe - _stripes);
+                stripe.cursor = slab + kAlign;
+                stripe.limit = slab + kSlabBytes;
+            }
+            void* block = stripe.cursor;
+            stripe.cursor += size;
+            return block;
+        }
+        void* _new_slab(int stripe) {
+            void* slab = _upstream->allocate(kSlabBytes, kSlabBytes);
+            ((SlabHeader*)slab)->stripe = stripe;
+            pthread_mutex_lock(&_slab_lock);
+            _slabs.push_back(slab);
+            pthread_mutex_unlock(&_slab_lock);
+            _reserved.fetch_add(kSlabBytes, memory_order_relaxed);
+            return slab;
+        }
+
+    private: // Not copyable
+        NodePoolResource(const NodePoolResource&);
+        NodePoolResource& operator=(const NodePoolResource&);
+}; // NodePoolResource
+
+#endif // POOL_RESOURCE_H
@@ -0,0 +1,176 @@
+#ifndef RW_LOCK_H
+#define RW_LOCK_H
+
+#include <atomic>
+#include <cassert>
+using namespace std;
+#include <pthread.h>
+#include <sched.h>
+
+//
+// Read write lock policies
+// ==============================================================================
+//
+// The data table of an ExpireMap is protected by a read write lock selected with
+// the Lock template parameter. Every policy provides
+//
+// void rdlock(), void rdunlock()
+// - Shared lock taken by get.
+//
+// void wrlock(), void wrunlock()
+// - Exclusive lock taken by put, remove and eviction.
+//
+// bool tryrdlock(), bool trywrlock()
+// - Take the lock only if that does not need to wait. Return true if taken. Used
+//   to tell contended acquisitions apart when collecting stats.
+//
+
+//
+// PthreadRWLock
+// ------------------------------------------------------------------------------
+// pthread_rwlock_t. Every reader increments and decrements a counter in the lock,
+// so the cache line of the lock moves between all cores taking read locks.
+//
+class PthreadRWLock {
+    private: // Data
+        pthread_rwlock_t _lock;
+
+    public: // Constructor/Desctructor
+        PthreadRWLock() {
+            // In case the platform default for rwlocks does not prefer writes, it will lead to
+            // starvation of writers. Default attribute can be changed to prefer writers and block
+            // further readers if a writer is waiting using attribute such as
+            // PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP
+            int rwlock_ret = pthread_rwlock_init(&_lock, NULL /* attr */);
+            assert(rwlock_ret == 0);
+        }
+        ~PthreadRWLock() {
+            int rwlock_ret = pthread_rwlock_destroy(&_lock);
+            assert(rwlock_ret == 0);
+        }
+
+    public: // Accessors
+        void rdlock() { pthread_rwlock_rdlock(&_lock); }
+        void rdunlock() { pthread_rwlock_unlock(&_lock); }
+        void wrlock() { pthread_rwlock_wrlock(&_lock); }
+        void wrunlock() { pthread_rwlock_unlock(&_lock); }
+        bool tryrdlock() { return pthread_rwlock_tryrdlock(&_lock) == 0; }
+        bool trywrlock() { return pthread_rwlock_trywrlock(&_lock) == 0; }
+
+    private: // Not copyable
+        PthreadRWLock(const PthreadRWLock&);
+        PthreadRWLock& operator=(const PthreadRWLock&);
+}; // PthreadRWLock
+
+//
+// DistributedRWLock
+// ------------------------------------------------------------------------------
+// Read write lock with per thread reader indicators. Each thread is assigned one
+// of Slots reader counters, each on its own cache line. A reader only writes to
+// its own counter and reads the writer flag, which stays shared in all caches
+// while there is no writer. Readers therefore do not contend with each other as
+// long as there are no more reader threads than slots.
+//
+// A writer serializes with other writers on a mutex, raises the writer flag and
+// waits for all reader counters to drain. Readers that see the flag back off till
+// it is cleared, so writers are preferred.
+//
+// Costs Slots cache lines per lock and makes wrlock O(Slots).
+//
+template <int Slots = 64>
+class DistributedRWLock {
+    private: // Types
+        static const int kCacheLine = 64;
+        struct alignas(kCacheLine) ReaderSlot {
+            atomic<long> readers;
+            ReaderSlot() : readers(0) { }
+        };
+
+    private: // Data
+        ReaderSlot _slots[Slots];
+        alignas(kCacheLine) atomic<bool> _writer;  // Set while a writer holds or waits for the lock
+        pthread_mutex_t _writer_lock;              // Serializes writers
+
+    public: // Constructor/Desctructor
+        DistributedRWLock() : _writer(false) {
+            int mutex_ret = pthread_mutex_init(&_writer_lock, NULL /* attr */);
+            assert(mutex_ret == 0);
+        }
+        ~DistributedRWLock() {
+            int mutex_ret = pthread_mutex_destroy(&_writer_lock);
+            assert(mutex_ret == 0);
+        }
+
+    public: // Accessors
+        void rdlock() {
+            atomic<long>& readers = _slots[_slot()].readers;
+            while (true) {
+                // Announce the reader before checking for a writer. Pairs with the writer
+                // raising the flag before checking for readers.
+                readers.fetch_add(1, memory_order_seq_cst);
+                if (!_writer.load(memory_order_seq_cst)) {
+                    return;
+                }
+                // Back off till the writer is done
+                readers.fetch_sub(1, memory_order_release);
+                while (_writer.load(memory_order_relaxed)) {
+                    sched_yield();
+                }
+            }
+        }
+        void rdunlock() {
+            _slots[_slot()].readers.fetch_sub(1, memory_order_release);
+        }
+        void wrlock() {
+            pthread_mutex_lock(&_writer_lock);
+            _writer.store(true, memory_order_seq_cst);
+            for (int i = 0; i < Slots; ++i) {
+                while (_slots[i].readers.load(memory_order_seq_cst) != 0) {
+                    sched_yield();
+                }
+            }
+        }
+        void wrunlock() {
+            _writer.store(false, memory_order_release);
+            pthread_mutex_unlock(&_writer_lock);
+        }
+        bool tryrdlock() {
+            atomic<long>& readers = _slots[_slot()].readers;
+            readers.fetch_add(1, memory_order_seq_cst);
+            if (!_writer.load(memory_order_seq_cst)) {
+                return true;
+            }
+            readers.fetch_sub(1, memory_order_release);
+            return false;
+        }
+        bool trywrlock() {
+            if (pthread_mutex_trylock(&_writer_lock) != 0) {
+                return false;
+            }
+            _writer.store(true, memory_order_seq_cst);
+            for (int i = 0; i < Slots; ++i) {
+                if (_slots[i].readers.load(memory_order_seq_cst) != 0) {
+                    // Back off instead of waiting for the readers
+                    wrunlock();
+                    return false;
+                }
+            }
+            return true;
+        }
+
+    private: // Helpers
+        // Reader slot of the calling thread. Threads are assigned slots round robin on
+        // first use. The slot of a thread never changes, so rdunlock finds the counter
+        // incremented by rdlock.
+        static int _slot() {
+            static atomic<unsigned> next_slot(0);
+            static thread_local int slot = next_slot.fetch_add(1, memory_order_relaxed) % Slots;
+            return slot;
+        }
+
+    private: // Not copyable
+        DistributedRWLock(const DistributedRWLock&);
+        DistributedRWLock& operator=(const DistributedRWLock&);
+}; // DistributedRWLock
+
+#endif // RW_LOCK_H
@@ -0,0 +1,109 @@
+#ifndef SAMPLED_EXPIRE_MAP_H
+#define SAMPLED_EXPIRE_MAP_H
+
+#include <unordered_map>
+#include <vector>
+#include <algorithm>
+#include <cassert>
+#include <climits>
+using namespace std;
+#include "rw_lock.h"
+#include "clock.h"
+
+//
+// SampledExpireMap
+// ==============================================================================
+//
+// ExpireMap without an eviction thread and without an expiry index. Each entry
+// only carries its expiry time next to its value in the hash table.
+//
+// Expired entries are removed in two ways:
+// - Lazily: a get that finds an expired entry erases it.
+// - Actively: every put, and every call to tick(), runs an expire cycle that
+//   samples entries of the table and erases the expired ones, in the style of the
+//   active expire cycle of Redis. A cycle samples kSampleSize entries at a time from
+//   distinct random buckets. While more than a quarter of the last sample was
+//   expired, more expired entries are probably waiting, so the cycle samples
+//   again, and it stops on the first sample with fewer. The
+//   number of rounds is bounded, so the effort of a cycle adapts to the ratio of
+//   expired entries seen without ever scanning the whole table at once.
+//
+// Expired entries that are never accessed and never sampled take up memory till
+// a cycle reaches them. Users without puts should call tick() periodically.
+//
+// Constructor does not take any arguments.
+//
+// put/get/remove have the same semantics as ExpireMap.
+//
+// size_t tick(long long budgetUs)
+// - Runs an expire cycle of up to budgetUs microseconds. Returns the number of
+//   entries erased.
+//
+template <class Key, class Value, class Lock = PthreadRWLock, class Clock = SteadyClock>
+class SampledExpireMap {
+    public: // Types
+        typedef struct TimedValue {
+            Value value;
+            long long expiry;
+            TimedValue() : value(), expiry(0) { }
+        } TimedValue;
+        typedef unordered_map<Key, TimedValue> KVStore;
+
+    public: // Tuning
+        // Entries sampled per round of an expire cycle
+        static const size_t kSampleSize = 20;
+        // Rounds of the expire cycle run by a put
+        static const int kPutCycleRounds = 4;
+        // Empty or already picked buckets picked per round at most, so that a sparse
+        // table does not make a round long
+        static const size_t kMaxEmptyBuckets = kSampleSize * 10;
+
+    private: // Data
+        KVStore _data_table;        // Hash table to store and lookup KVs
+        unsigned long long _rng;    // State of the generator of buckets to sample from
+        // Buffers of _sample, kept across rounds so that sampling does not allocate.
+        // Protected by _lock.
+        vector<size_t> _picked;     // Non empty buckets sampled in the round
+        vector<Key> _expired;       // Expired keys found in the round
+        Lock _lock;
+
+    public: // Constructor/Desctructor
+    SampledExpireMap();
+
+    public: // Accessors
+        // Same as ExpireMap::put. Also runs a short expire cycle.
+        void put(Key key, Value value, long timeoutMs);
+        // Same as ExpireMap::get. Erases the entry if it has expired.
+        Value get(Key key);
+        // Same as ExpireMap::remove.
+        void remove(Key key);
+        // Runs an expire cycle of up to budgetUs microseconds. Returns the number of
+        // entries erased.
+        size_t tick(long long budgetUs = 1000);
+
+    private: // Helpers
+        // Samples up to kSampleSize entries from distinct random buckets and erases the
+        // expired ones. Sets sampled to the number of entries sampled, each counted
+        // once. Returns the number erased.
+        // Called with the table write locked.
+        size_t _sample(long long curtime, size_t& sampled);
+        // Runs rounds of sampling while more than a quarter of the entries of the last
+        // round were expired, for at most max_rounds rounds or till deadline.
+        // Returns the number of entries erased. Called with the table write locked.
+        size_t _expire_cycle(long long curtime, long max_rounds, long long deadline);
+        // Returns current time in microseconds
+        static long long _now();
+
+    public: // APIs for test
+        // Returns size of the data table, including expired entries not erased yet
+        int debug_size() {
+            _lock.rdlock();
+            int sz = _data_table.size();
+            _lock.rdunlock();
+            return sz;
+        }
+}; // SampledExpireMap
+
+#include "sampled_expire_map.hh"
+
+#endif // SAMPLED_EXPIRE_MAP_H
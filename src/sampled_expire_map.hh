@@ -0,0 +1,147 @@
+#ifndef SAMPLED_EXPIRE_MAP_HH
+#define SAMPLED_EXPIRE_MAP_HH
+
+template <class Key, class Value, class Lock, class Clock>
+SampledExpireMap<Key, Value, Lock, Clock>::
+SampledExpireMap() : _data_table(), _rng(0x9E3779B97F4A7C15ULL), _picked(), _expired(), _lock() {
+    _picked.reserve(kSampleSize);
+    _expired.reserve(kSampleSize);
+}
+
+template <class Key, class Value, class Lock, class Clock>
+void
+SampledExpireMap<Key, Value, Lock, Clock>::
+put(Key key, Value value, long timeoutMs) {
+    // Do not insert values for which validity is less than or equal to zero
+    if (timeoutMs <= 0) return;
+    long long curtime = _now();
+    // Write lock data table
+    _lock.wrlock();
+    TimedValue& timed_value = _data_table[key];
+    timed_value.value = value;
+    timed_value.expiry = curtime + timeoutMs * 1000;
+    // Expire a few entries so that tables with puts need no tick
+    _expire_cycle(curtime, kPutCycleRounds, LLONG_MAX);
+    // Unlock data table
+    _lock.wrunlock();
+}
+
+template <class Key, class Value, class Lock, class Clock>
+Value
+SampledExpireMap<Key, Value, Lock, Clock>::
+get(Key key) {
+    long long curtime = _now();
+    // Read lock data table
+    _lock.rdlock();
+    typename KVStore::iterator iter = _data_table.find(key);
+    if (iter == _data_table.end()) {
+        _lock.rdunlock();
+        return Value();
+    }
+    if (iter->second.expiry >= curtime) {
+        // Key has a valid value, return the value
+        Value value = iter->second.value;
+        _lock.rdunlock();
+        return value;
+    }
+    _lock.rdunlock();
+    // Erase the expired entry. It may have been overwritten or erased after the read
+    // lock was released.
+    _lock.wrlock();
+    iter = _data_table.find(key);
+    if (iter != _data_table.end() && iter->second.expiry < curtime) {
+        _data_table.erase(iter);
+    }
+    _lock.wrunlock();
+    return Value();
+}
+
+template <class Key, class Value, class Lock, class Clock>
+void
+SampledExpireMap<Key, Value, Lock, Clock>::
+remove(Key key) {
+    _lock.wrlock();
+    _data_table.erase(key);
+    _lock.wrunlock();
+}
+
+template <class Key, class Value, class Lock, class Clock>
+size_t
+SampledExpireMap<Key, Value, Lock, Clock>::
+tick(long long budgetUs) {
+    long long curtime = _now();
+    _lock.wrlock();
+    // Without progress of the clock the cycle stops after about one pass over the table
+    long max_rounds = _data_table.size() / kSampleSize + 1;
+    size_t erased = _expire_cycle(curtime, max_rounds, curtime + budgetUs);
+    _lock.wrunlock();
+    return erased;
+}
+
+template <class Key, class Value, class Lock, class Clock>
+size_t
+SampledExpireMap<Key, Value, Lock, Clock>::
+_sample(long long curtime, size_t& sampled) {
+    _picked.clear();
+    _expired.clear();
+    size_t buckets = _data_table.bucket_count();
+    size_t size = _data_table.size();
+    size_t empty = 0;
+    sampled = 0;
+    // Keys inserted together often hash to neighbouring buckets, so every bucket is
+    // picked at random (xorshift) to keep the sample representative of the table. A
+    // bucket picked twice is skipped, so that no entry weighs twice in the ratio of
+    // expired entries.
+    while (sampled < kSampleSize && sampled < size && empty < kMaxEmptyBuckets) {
+        _rng ^= _rng << 13;
+        _rng ^= _rng >> 7;
+        _rng ^= _rng << 17;
+        size_t bucket = _rng % buckets;
+        if (_data_table.bucket_size(bucket) == 0 ||
+            find(_picked.begin(), _picked.end(), bucket) != _picked.end()) {
+            ++empty;
+            continue;
+        }
+        _picked.push_back(bucket);
+        for (typename KVStore::local_iterator iter = _data_table.begin(bucket);
+             iter != _data_table.end(bucket); ++iter) {
+            ++sampled;
+            if (iter->second.expiry < curtime) {
+                _expired.push_back(iter->first);
+            }
+        }
+    }
+    // Local iterators are invalidated by erase, so expired keys are erased afterwards
+    for (size_t i = 0; i < _expired.size(); ++i) {
+        _data_table.erase(_expired[i]);
+    }
+    return _expired.size();
+}
+
+template <class Key, class Value, class Lock, class Clock>
+size_t
+SampledExpireMap<Key, Value, Lock, Clock>::
+_expire_cycle(long long curtime, long max_rounds, long long deadline) {
+    size_t erased = 0;
+    for (long round = 0; round < max_rounds && !_data_table.empty(); ++round) {
+        size_t sampled = 0;
+        size_t expired = _sample(curtime, sampled);
+        erased += expired;
+        // Only empty buckets were visited. Counts as a round to bound the cycle.
+        if (sampled == 0) continue;
+        // Stop once a quarter or less of the sample was expired, as about as much of
+        // the table is
+        if ((double)expired / sampled <= 0.25) break;
+        if (deadline != LLONG_MAX && _now() >= deadline) break;
+    }
+    return erased;
+}
+
+template <class Key, class Value, class Lock, class Clock>
+long long
+SampledExpireMap<Key, Value, Lock, Clock>::
+_now() {
+    return Clock::now();
+}
+
+#endif // SAMPLED_EXPIRE_MAP_HH
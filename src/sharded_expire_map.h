@@ -0,0 +1,227 @@
+#ifndef SHARDED_EXPIRE_MAP_H
+#define SHARDED_EXPIRE_MAP_H
+
+#include <vector>
+#include <functional>
+#include <iterator>
+#include <type_traits>
+using namespace std;
+#include "expire_map.h"
+
+//
+// ShardedExpireMap
+// ==============================================================================
+//
+// Lock striped variant of ExpireMap. Keys are routed by hash to one of a fixed
+// number of shards. Each shard is a complete ExpireMap with its own data table,
+// expiry queue, locks and eviction thread, so writers to different shards never
+// contend with each other.
+//
+// Constructor takes the number of shards. Defaults to 16. It optionally takes an
+// EvictionService that evicts all shards, instead of a thread per shard, and a
+// memory resource (see pool_resource.h) that all shards allocate nodes from.
+//
+// put/get/remove have exactly the same semantics as ExpireMap. A key always maps
+// to the same shard, so ordering of operations on a single key is preserved.
+// Lookups take the KeyView of the shards, and route keys with the hash of the
+// shards, so a string key is hashed once to pick the shard and find the entry.
+//
+// multi_put/multi_get/multi_remove split the batch by shard and run one batch
+// operation per shard, so each shard is locked once per batch. multi_get and
+// multi_remove pass the shards views of the caller's keys, so they copy no key.
+//
+// The shard type can be overridden to stripe an ExpireMap instantiated with
+// non default parameters.
+//
+template <class Key, class Value, class Shard = ExpireMap<Key, Value> >
+class ShardedExpireMap {
+    public: // Types
+        typedef typename Shard::KeyView KeyView;
+
+    private: // Types
+        // Key of a batch get or remove as passed to the shards: the KeyView, or a
+        // reference to the caller's key where the view is const Key&
+        typedef typename conditional<is_reference<KeyView>::value,
+                                     reference_wrapper<const Key>, KeyView>::type KeyRef;
+
+    private: // Data
+        vector<Shard*> _shards;     // Shards. Fixed for the lifetime of the object.
+        typename Shard::KeyHash _hasher;    // Hash used to route keys to shards
+
+    public: // Constructor/Desctructor
+    ShardedExpireMap(int num_shards = 16);
+    ShardedExpireMap(int num_shards, EvictionService* service);
+    ShardedExpireMap(int num_shards, EvictionService* service, pmr::memory_resource* resource);
+    ~ShardedExpireMap();
+
+    public: // Accessors
+        // Same as ExpireMap::put on the shard owning the key.
+        void put(Key key, Value value, long timeoutMs);
+        // Same as ExpireMap::emplace on the shard owning the key.
+        template <class... Args>
+        void emplace(Key key, long timeoutMs, Args&&... args) {
+            Shard* shard = _shard(key);
+            shard->emplace(move(key), timeoutMs, forward<Args>(args)...);
+        }
+        // Same as ExpireMap::get on the shard owning the key.
+        Value get(KeyView key);
+        // Same as ExpireMap::try_get on the shard owning the key.
+        optional<Value> try_get(KeyView key) { return _shard(key)->try_get(key); }
+        // Same as ExpireMap::with_value on the shard owning the key.
+        template <class Visitor>
+        bool with_value(KeyView key, Visitor visitor) {
+            return _shard(key)->with_value(key, visitor);
+        }
+        // Same as ExpireMap::remove on the shard owning the key.
+        void remove(KeyView key);
+        // Same as ExpireMap::touch on the shard owning the key.
+        bool touch(KeyView key, long timeoutMs) { return _shard(key)->touch(key, timeoutMs); }
+        // Same as ExpireMap::get_and_touch on the shard owning the key.
+        Value get_and_touch(KeyView key, long timeoutMs) {
+            return _shard(key)->get_and_touch(key, timeoutMs);
+        }
+        // Same as ExpireMap::get_or_load on the shard owning the key.
+        template <class Loader>
+        Value get_or_load(const Key& key, Loader loader, long timeoutMs) {
+            return _shard(key)->get_or_load(key, loader, timeoutMs);
+        }
+        // Same as ExpireMap::set_refresh_ahead on every shard. Shards share the pool.
+        void set_refresh_ahead(LoaderPool* pool, double fraction) {
+            for (size_t i = 0; i < _shards.size(); ++i) {
+                _shards[i]->set_refresh_ahead(pool, fraction);
+            }
+        }
+        // Number of shards
+        int num_shards() const { return _shards.size(); }
+
+    public: // Eviction
+        // Same as ExpireMap::set_eviction_slice on every shard
+        void set_eviction_slice(size_t max_keys, long long max_hold_us = LLONG_MAX) {
+            for (size_t i = 0; i < _shards.size(); ++i) {
+                _shards[i]->set_eviction_slice(max_keys, max_hold_us);
+            }
+        }
+        // Adds the eviction slice lengths of all shards to pauses
+        void eviction_pauses(LatencyHistogram& pauses) const {
+            for (size_t i = 0; i < _shards.size(); ++i) {
+                _shards[i]->eviction_pauses(pauses);
+            }
+        }
+        // Adds the statistics of all shards to stats
+        void stats(ExpireMapStats& stats) {
+            for (size_t i = 0; i < _shards.size(); ++i) {
+                _shards[i]->stats(stats);
+            }
+        }
+        // Adds the eviction lags of all shards to lags
+        void eviction_lags(LatencyHistogram& lags) const {
+            for (size_t i = 0; i < _shards.size(); ++i) {
+                _shards[i]->eviction_lags(lags);
+            }
+        }
+
+    public: // Capacity
+        // Splits the limits of ExpireMap::set_capacity evenly between the shards. Keys
+        // are not spread perfectly evenly, so shards may start evicting a bit before the
+        // map as a whole reaches the limit.
+        void set_capacity(size_t max_entries, size_t max_bytes = SIZE_MAX,
+                          typename Shard::Sizer sizer = typename Shard::Sizer()) {
+            size_t n = _shards.size();
+            for (size_t i = 0; i < n; ++i) {
+                _shards[i]->set_capacity(
+                    max_entries == SIZE_MAX ? SIZE_MAX : (max_entries + n - 1) / n,
+                    max_bytes == SIZE_MAX ? SIZE_MAX : (max_bytes + n - 1) / n, sizer);
+            }
+        }
+        // Sum of ExpireMap::expirations of all shards
+        uint64_t expirations() const {
+            uint64_t total = 0;
+            for (size_t i = 0; i < _shards.size(); ++i) {
+                total += _shards[i]->expirations();
+            }
+            return total;
+        }
+        // Sum of ExpireMap::capacity_evictions of all shards
+        uint64_t capacity_evictions() const {
+            uint64_t total = 0;
+            for (size_t i = 0; i < _shards.size(); ++i) {
+                total += _shards[i]->capacity_evictions();
+            }
+            return total;
+        }
+
+    public: // Scans
+        // Same as ExpireMap::for_each_live on each shard in turn. Each shard is a point
+        // in time view of its own.
+        template <class Visitor>
+        size_t for_each_live(Visitor visitor) { return parallel_for_each_live(1, visitor); }
+        // Same as ExpireMap::parallel_for_each_live on each shard in turn
+        template <class Visitor>
+        size_t parallel_for_each_live(int num_threads, Visitor visitor) {
+            size_t visited = 0;
+            for (size_t i = 0; i < _shards.size(); ++i) {
+                visited += _shards[i]->parallel_for_each_live(num_threads, visitor);
+            }
+            return visited;
+        }
+
+    public: // Events
+        // Publishes entries leaving any shard to ring, which all shards share
+        void set_event_ring(typename Shard::EventStream* ring) {
+            for (size_t i = 0; i < _shards.size(); ++i) {
+                _shards[i]->set_event_ring(ring);
+            }
+        }
+
+    public: // Batch accessors
+        // Same as ExpireMap::multi_put, batched per shard.
+        template <class KeyIter, class ValueIter>
+        void multi_put(KeyIter first, KeyIter last, ValueIter values, long timeoutMs);
+        // Same as ExpireMap::multi_get, batched per shard.
+        template <class KeyIter, class ValueIter>
+        size_t multi_get(KeyIter first, KeyIter last, ValueIter values, vector<bool>& hits);
+        // Same as ExpireMap::multi_remove, batched per shard.
+        template <class KeyIter>
+        size_t multi_remove(KeyIter first, KeyIter last);
+
+    private: // Helpers
+        // Returns the shard that owns the key
+        Shard* _shard(KeyView key) { return _shards[_shard_index(key)]; }
+        // Returns the index of the shard that owns the key
+        size_t _shard_index(KeyView key) const;
+        // Splits [first, last) by shard. Fills keys with the keys of the batch, as Keys
+        // or KeyRefs, grouped by shard and pos with the position of each of those keys
+        // in the batch. The keys of shard i are [offsets[i], offsets[i + 1]).
+        template <class KeyIter, class SplitKey>
+        void _split(KeyIter first, KeyIter last, vector<SplitKey>& keys, vector<size_t>& pos,
+                    vector<size_t>& offsets) const;
+
+    public: // APIs for test
+        // Returns the sum of the data table sizes of all shards.
+        // Shards are locked one at a time, so the total is not a point in time value.
+        int debug_size() {
+            int sz = 0;
+            for (size_t i = 0; i < _shards.size(); ++i) {
+                sz += _shards[i]->debug_size();
+            }
+            return sz;
+        }
+        // Returns the sum of the accounted bytes of all shards
+        size_t debug_bytes() {
+            size_t bytes = 0;
+            for (size_t i = 0; i < _shards.size(); ++i) {
+                bytes += _shards[i]->debug_bytes();
+            }
+            return bytes;
+        }
+        // Runs a round of eviction of every shard on the calling thread
+        void debug_evict() {
+            for (size_t i = 0; i < _shards.size(); ++i) {
+                _shards[i]->debug_evict();
+            }
+        }
+}; // ShardedExpireMap
+
+#include "sharded_expire_map.hh"
+
+#endif // SHARDED_EXPIRE_MAP_H
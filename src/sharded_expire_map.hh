@@ -0,0 +1,186 @@
+#ifndef SHARDED_EXPIRE_MAP_HH
+#define SHARDED_EXPIRE_MAP_HH
+
+template <class Key, class Value, class Shard>
+ShardedExpireMap<Key, Value, Shard>::
+ShardedExpireMap(int num_shards) : _shards(), _hasher() {
+    assert(num_shards > 0);
+    _shards.reserve(num_shards);
+    for (int i = 0; i < num_shards; ++i) {
+        _shards.push_back(new Shard());
+    }
+}
+
+template <class Key, class Value, class Shard>
+ShardedExpireMap<Key, Value, Shard>::
+ShardedExpireMap(int num_shards, EvictionService* service) : _shards(), _hasher() {
+    assert(num_shards > 0);
+    _shards.reserve(num_shards);
+    for (int i = 0; i < num_shards; ++i) {
+        _shards.push_back(new Shard(service));
+    }
+}
+
+template <class Key, class Value, class Shard>
+ShardedExpireMap<Key, Value, Shard>::
+ShardedExpireMap(int num_shards, EvictionService* service, pmr::memory_resource* resource)
+    : _shards(), _hasher() {
+    assert(num_shards > 0);
+    _shards.reserve(num_shards);
+    for (int i = 0; i < num_shards; ++i) {
+        _shards.push_back(new Shard(service, resource));
+    }
+}
+
+template <class Key, class Value, class Shard>
+ShardedExpireMap<Key, Value, Shard>::
+~ShardedExpireMap() {
+    // Each shard blocks till its eviction thread exits
+    for (size_t i = 0; i < _shards.size(); ++i) {
+        delete _shards[i];
+    }
+    _shards.clear();
+}
+
+template <class Key, class Value, class Shard>
+void
+ShardedExpireMap<Key, Value, Shard>::
+put(Key key, Value value, long timeoutMs) {
+    Shard* shard = _shard(key);
+    shard->put(move(key), move(value), timeoutMs);
+}
+
+template <class Key, class Value, class Shard>
+Value
+ShardedExpireMap<Key, Value, Shard>::
+get(KeyView key) {
+    return _shard(key)->get(key);
+}
+
+template <class Key, class Value, class Shard>
+void
+ShardedExpireMap<Key, Value, Shard>::
+remove(KeyView key) {
+    _shard(key)->remove(key);
+}
+
+template <class Key, class Value, class Shard>
+template <class KeyIter, class ValueIter>
+void
+ShardedExpireMap<Key, Value, Shard>::
+multi_put(KeyIter first, KeyIter last, ValueIter values, long timeoutMs) {
+    vector<Key> keys;
+    vector<size_t> pos;
+    vector<size_t> offsets;
+    _split(first, last, keys, pos, offsets);
+    // Copy each value once, straight to the position of its key grouped by shard
+    vector<size_t> slot_of(keys.size());
+    for (size_t i = 0; i < keys.size(); ++i) {
+        slot_of[pos[i]] = i;
+    }
+    vector<Value> shard_values(keys.size());
+    for (size_t i = 0; i < keys.size(); ++i, ++values) {
+        shard_values[slot_of[i]] = *values;
+    }
+    // The shards move the keys and values into their tables
+    for (size_t i = 0; i < _shards.size(); ++i) {
+        if (offsets[i] == offsets[i + 1]) continue;
+        _shards[i]->multi_put(make_move_iterator(keys.begin() + offsets[i]),
+                              make_move_iterator(keys.begin() + offsets[i + 1]),
+                              make_move_iterator(shard_values.begin() + offsets[i]), timeoutMs);
+    }
+}
+
+template <class Key, class Value, class Shard>
+template <class KeyIter, class ValueIter>
+size_t
+ShardedExpireMap<Key, Value, Shard>::
+multi_get(KeyIter first, KeyIter last, ValueIter values, vector<bool>& hits) {
+    vector<KeyRef> keys;
+    vector<size_t> pos;
+    vector<size_t> offsets;
+    _split(first, last, keys, pos, offsets);
+    vector<Value> shard_values(keys.size());
+    vector<bool> shard_hits;
+    hits.assign(keys.size(), false);
+    size_t found = 0;
+    for (size_t i = 0; i < _shards.size(); ++i) {
+        if (offsets[i] == offsets[i + 1]) continue;
+        found += _shards[i]->multi_get(keys.begin() + offsets[i], keys.begin() + offsets[i + 1],
+                                       shard_values.begin() + offsets[i], shard_hits);
+        for (size_t j = offsets[i]; j < offsets[i + 1]; ++j) {
+            hits[pos[j]] = shard_hits[j - offsets[i]];
+        }
+    }
+    // Move each value once, from the position of its key grouped by shard to its
+    // position in the batch
+    vector<size_t> slot_of(keys.size());
+    for (size_t i = 0; i < keys.size(); ++i) {
+        slot_of[pos[i]] = i;
+    }
+    for (size_t i = 0; i < keys.size(); ++i, ++values) {
+        *values = move(shard_values[slot_of[i]]);
+    }
+    return found;
+}
+
+template <class Key, class Value, class Shard>
+template <class KeyIter>
+size_t
+ShardedExpireMap<Key, Value, Shard>::
+multi_remove(KeyIter first, KeyIter last) {
+    vector<KeyRef> keys;
+    vector<size_t> pos;
+    vector<size_t> offsets;
+    _split(first, last, keys, pos, offsets);
+    size_t removed = 0;
+    for (size_t i = 0; i < _shards.size(); ++i) {
+        if (offsets[i] == offsets[i + 1]) continue;
+        removed += _shards[i]->multi_remove(keys.begin() + offsets[i],
+                                            keys.begin() + offsets[i + 1]);
+    }
+    return removed;
+}
+
+template <class Key, class Value, class Shard>
+size_t
+ShardedExpireMap<Key, Value, Shard>::
+_shard_index(KeyView key) const {
+    // std::hash is the identity for integral types on common implementations. Mix the
+    // bits (Fibonacci hashing) so that sequential keys and keys sharing low bits spread
+    // evenly across shards.
+    unsigned long long h = (unsigned long long)_hasher(key) * 0x9E3779B97F4A7C15ULL;
+    return (h >> 32) % _shards.size();
+}
+
+template <class Key, class Value, class Shard>
+template <class KeyIter, class SplitKey>
+void
+ShardedExpireMap<Key, Value, Shard>::
+_split(KeyIter first, KeyIter last, vector<SplitKey>& keys, vector<size_t>& pos,
+       vector<size_t>& offsets) const {
+    // Counting sort of the batch by shard. A string view carries the hash of its key,
+    // so the key is hashed once to pick the shard and find the entry.
+    vector<SplitKey> batch(first, last);
+    vector<size_t> shard_of(batch.size());
+    offsets.assign(_shards.size() + 1, 0);
+    for (size_t i = 0; i < batch.size(); ++i) {
+        shard_of[i] = _shard_index(batch[i]);
+        ++offsets[shard_of[i] + 1];
+    }
+    for (size_t i = 0; i < _shards.size(); ++i) {
+        offsets[i + 1] += offsets[i];
+    }
+    vector<size_t> next(offsets.begin(), offsets.end() - 1);
+    pos.resize(batch.size());
+    for (size_t i = 0; i < batch.size(); ++i) {
+        pos[next[shard_of[i]]++] = i;
+    }
+    keys.clear();
+    keys.reserve(batch.size());
+    for (size_t slot = 0; slot < batch.size(); ++slot) {
+        keys.push_back(move(batch[pos[slot]]));
+    }
+}
+
+#endif // SHARDED_EXPIRE_MAP_HH
@@ -0,0 +1,227 @@
+#ifndef SHARED_MEMORY_EXPIRE_MAP_H
+#define SHARED_MEMORY_EXPIRE_MAP_H
+
+#include <string>
+#include <new>
+#include <functional>
+#include <type_traits>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <cassert>
+using namespace std;
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "clock.h"
+
+//
+// SharedMemoryExpireMap
+// ==============================================================================
+//
+// ExpireMap for trivially copyable keys and values that lives in a segment shared
+// by several processes, such as pre-forked workers, so that a key loaded by one
+// process is a hit in all of them.
+//
+// The segment is a POSIX shared memory object (shm_open) or, with mapped_file set,
+// a file mapped with mmap. The first process to open a name creates and
+// initializes the segment. Others attach to it as is: nothing is rebuilt and the
+// segment may be mapped at a different address in each process, as it holds no
+// pointers, only offsets from its start. The segment outlives the processes till
+// unlink() removes its name. The creator holds a file lock (flock) on the segment
+// from before it sizes it till it is ready. A process attaching to a segment that
+// is not ready and not locked, or still empty after kAttachTries ms, knows that its
+// creator died, removes the name and creates the segment again.
+//
+// Layout: a header, then kShards shards, each a lock and a fixed size open
+// addressing table of slots. A slot holds the expiry, the hash, the key and the
+// value of an entry inline. Keys are routed to a shard by the high bits of their
+// hash and probed linearly within it from the low bits. Removal shifts the
+// following entries of the probe sequence back (backward shift deletion), so the
+// table has no tombstones and never needs to be rebuilt. Capacity is fixed when the
+// segment is created.
+//
+// Each shard is protected by a robust process shared mutex. If a process dies while
+// holding one (a crash or a kill in the middle of an operation), the next process
+// to lock the shard takes the lock over. Writers mark the shard while they hold
+// it, so if the dead process was writing, slots may be half written and the count
+// of entries off: the shard is cleared before use. Its entries are lost, as on a
+// miss. A reader that dies leaves nothing to repair.
+//
+// Eviction: every attached map with evict set runs a thread that competes for a
+// robust process shared mutex in the segment. The holder is the leader and is the
+// only process that evicts: every 4 ms it sweeps each shard for expired entries, a
+// slice of slots per acquisition of the shard lock. The others wait on the mutex.
+// When the leader exits its map releases the mutex, and if it dies the robust
+// mutex hands it to the next waiter, which becomes the leader. Expired entries are
+// never returned by get, and put reuses an expired slot in place, so eviction only
+// reclaims space.
+//
+// Times are read from Clock in every process, so the clock must be system wide.
+// SteadyClock (CLOCK_MONOTONIC on Linux) is.
+//
+// bool put(K key, V value, long timeoutMs)
+// - Same as ExpireMap::put. Returns false, without putting, if the shard of the key
+//   is full of unexpired entries or the map failed to open.
+//
+// V get(const K& key), bool remove(const K& key)
+// - Same as ExpireMap::get and remove.
+//
+// bool ok()
+// - False if the segment could not be created or attached, or was created for
+//   other key and value types, capacity or hash layout.
+//
+template <class Key, class Value, class Hash = hash<Key>, class Clock = SteadyClock>
+class SharedMemoryExpireMap {
+    static_assert(is_trivially_copyable<Key>::value,
+                  "SharedMemoryExpireMap needs a trivially copyable key");
+    static_assert(is_trivially_copyable<Value>::value,
+                  "SharedMemoryExpireMap needs a trivially copyable value");
+
+    public: // Constants
+        static const int kShardBits = 4;
+        static const int kShards = 1 << kShardBits;
+        // Slots checked per acquisition of a shard lock by eviction
+        static const size_t kSweepSlots = 4096;
+
+    private: // Types
+        static const int kCacheLine = 64;
+        static const uint32_t kVersion = 2;
+        static const uint32_t kReady = 2;
+        // Times the creator is polled for, 1 ms apart, by a process attaching
+        static const int kAttachTries = 5000;
+        // Slot of a shard table. Empty if expiry is 0.
+        typedef struct Slot {
+            int64_t expiry;
+            uint64_t hash;
+            Key key;
+            Value value;
+        } Slot;
+        // Shard header. The slots of the shard follow the shard headers.
+        typedef struct alignas(kCacheLine) Shard {
+            pthread_mutex_t lock;       // Robust
+            uint32_t writing;           // Set while the holder of the lock writes
+            uint64_t size;              // Full slots
+            uint64_t sweep_pos;         // Next slot eviction checks
+            uint64_t slots_offset;      // Offset of the slots from the segment start
+        } Shard;
+        // Segment header, at offset 0
+        typedef struct alignas(kCacheLine) Header {
+            char magic[8];
+            uint32_t version;
+            uint32_t key_size;
+            uint32_t value_size;
+            uint32_t num_shards;
+            uint64_t shard_slots;       // Slots per shard, a power of two
+            uint64_t segment_size;
+            atomic<uint32_t> state;     // kReady once initialized by the creator
+            atomic<int> leader_pid;     // Process running eviction, 0 if none
+            atomic<uint64_t> expirations;
+            pthread_mutex_t leader_lock;    // Robust. Held by the leader.
+        } Header;
+
+    private: // Data
+        string _name;
+        bool _mapped_file;
+        char* _base;                // Start of the mapped segment
+        size_t _size;
+        Header* _header;
+        Shard* _shards;
+        uint64_t _mask;             // Slots per shard - 1
+        bool _ok;
+        Hash _hasher;
+        volatile bool _shutdown;
+        bool _evict;                // Set if this map competes for leadership
+        atomic<bool> _leader;       // Set while this map runs eviction
+        pthread_t _eviction_thread;
+
+    public: // Constructor/Desctructor
+        // Creates the segment name for capacity entries, or attaches to it if it
+        // exists. An attaching map must pass the capacity of the creator, or 0 for any.
+        // With evict set, the map competes to run eviction.
+        SharedMemoryExpireMap(const string& name, size_t capacity, bool evict = true,
+                              bool mapped_file = false);
+        ~SharedMemoryExpireMap();
+
+    public: // Accessors
+        bool put(Key key, Value value, long timeoutMs);
+        Value get(const Key& key);
+        bool remove(const Key& key);
+        bool ok() const { return _ok; }
+        // Number of entries evicted on expiry, by all processes
+        uint64_t expirations() const {
+            return _ok ? _header->expirations.load(memory_order_relaxed) : 0;
+        }
+        // Set while this map is the one running eviction
+        bool is_leader() const { return _leader.load(); }
+        // Process running eviction, 0 if none
+        int leader_pid() const { return _ok ? _header->leader_pid.load() : 0; }
+        // Removes the name of the segment. Attached processes keep their mapping.
+        static bool unlink(const string& name, bool mapped_file = false) {
+            return (mapped_file ? ::unlink(name.c_str()) : shm_unlink(name.c_str())) == 0;
+        }
+
+    private: // Helpers
+        // Lays out and initializes a new segment. Called by the creator only.
+        void _init(uint64_t shard_slots);
+        // Puts into shard if there is room. Called with the shard write locked.
+        bool _put_locked(Shard& shard, const Key& key, const Value& value, uint64_t hash,
+                         long long expiry, long long curtime);
+        // Maps the segment of fd and checks its header. Returns false on mismatch.
+        bool _attach(int fd, size_t capacity);
+        // Returns true if the segment of fd is not ready and not locked by its creator.
+        // Keeps the file lock of the segment if so. Called before it is unlocked.
+        bool _creator_died(int fd);
+        // Removes the name if it still refers to the segment of fd. Called with the
+        // file lock of the segment held.
+        bool _unlink_segment(int fd);
+        int _open(int flags) const;
+        // Locks shard, clearing it if the last holder died while writing to it. write
+        // marks the shard as written till _unlock.
+        void _lock(Shard& shard, bool write);
+        void _unlock(Shard& shard);
+        // Empties all slots of shard. Called with the shard locked.
+        void _clear(Shard& shard);
+        // Slots per shard for capacity entries
+        static uint64_t _shard_slots(size_t capacity);
+        // Size of a segment with shard_slots slots per shard
+        static size_t _segment_size(uint64_t shard_slots);
+        uint64_t _hash(const Key& key) const;
+        Shard& _shard(uint64_t hash) { return _shards[hash >> (64 - kShardBits)]; }
+        Slot* _slots(Shard& shard) { return (Slot*)(_base + shard.slots_offset); }
+        // Returns the slot of key in shard, or -1. Called with the shard locked.
+        long _find(Shard& shard, const Key& key, uint64_t hash);
+        // Empties slot pos, shifting back the entries after it in the probe sequence.
+        // Called with the shard write locked.
+        void _erase(Shard& shard, uint64_t pos);
+        // Evicts expired entries from up to max_slots slots of shard from its sweep
+        // position. Returns the number of entries evicted.
+        size_t _sweep(Shard& shard, size_t max_slots, long long curtime);
+        // Function for eviction thread
+        static void* eviction(void* arg);
+        static long long _now() { return Clock::now(); }
+
+    public: // APIs for test
+        // Returns the number of entries in all shards, expired or not
+        size_t debug_size();
+        // Sweeps all shards once on the calling thread, whether or not it leads
+        void debug_evict();
+        // Locks the shard of key and returns, as a process that crashes in the middle of
+        // a get or, with write, a put or remove
+        void debug_lock_shard(const Key& key, bool write) {
+            _lock(_shard(_hash(key)), write);
+        }
+
+    private: // Not copyable
+        SharedMemoryExpireMap(const SharedMemoryExpireMap&);
+        SharedMemoryExpireMap& operator=(const SharedMemoryExpireMap&);
+}; // SharedMemoryExpireMap
+
+#include "shared_memory_expire_map.hh"
+
+#endif // SHARED_MEMORY_EXPIRE_MAP_H
@@ -0,0 +1,499 @@
+#ifndef SHARED_MEMORY_EXPIRE_MAP_HH
+#define SHARED_MEMORY_EXPIRE_MAP_HH
+
+template <class Key, class Value, class Hash, class Clock>
+SharedMemoryExpireMap<Key, Value, Hash, Clock>::
+SharedMemoryExpireMap(const string& name, size_t capacity, bool evict, bool mapped_file)
+    : _name(name), _mapped_file(mapped_file), _base(NULL), _size(0), _header(NULL),
+      _shards(NULL), _mask(0), _ok(false), _hasher(), _shutdown(false), _evict(evict),
+      _leader(false) {
+    // Exactly one process creates the segment. A segment whose creator died before
+    // making it ready is removed and created again.
+    bool retry = true;
+    for (int tries = 0; tries < 3 && retry; ++tries) {
+        retry = false;
+        int fd = _open(O_RDWR | O_CREAT | O_EXCL);
+        if (fd >= 0) {
+            // Held till the segment is ready, so that attaching processes can tell a
+            // creator that died from one still initializing
+            flock(fd, LOCK_EX);
+            uint64_t shard_slots = _shard_slots(capacity);
+            size_t size = _segment_size(shard_slots);
+            if (ftruncate(fd, size) == 0) {
+                void* base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+                                  0 /* offset */);
+                if (base != MAP_FAILED) {
+                    _base = (char*)base;
+                    _size = size;
+                    _init(shard_slots);
+                    _ok = true;
+                }
+            }
+            if (!_ok) {
+                unlink(name, mapped_file);
+            }
+            flock(fd, LOCK_UN);
+        } else if (errno == EEXIST) {
+            fd = _open(O_RDWR);
+            _ok = (fd >= 0) && _attach(fd, capacity);
+            if (!_ok && fd >= 0 && _creator_died(fd)) {
+                retry = _unlink_segment(fd);
+                flock(fd, LOCK_UN);
+            }
+            if (!_ok && _base) {
+                munmap(_base, _size);
+                _base = NULL;
+                _header = NULL;
+            }
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+    if (_ok && _evict) {
+        pthread_create(&_eviction_thread, NULL /* attr */, eviction, this);
+    }
+}
+
+template <class Key, class Value, class Hash, class Clock>
+SharedMemoryExpireMap<Key, Value, Hash, Clock>::
+~SharedMemoryExpireMap() {
+    _shutdown = true;
+    if (_ok && _evict) {
+        // Wait for eviction thread to give up leadership and finish
+        pthread_join(_eviction_thread, NULL /* ret */);
+    }
+    if (_base) {
+        munmap(_base, _size);
+    }
+}
+
+template <class Key, class Value, class Hash, class Clock>
+void
+SharedMemoryExpireMap<Key, Value, Hash, Clock>::
+_init(uint64_t shard_slots) {
+    // The segment is zero filled by ftruncate
+    _header = new (_base) Header();
+    memcpy(_header->magic, "EXPMAPSH", sizeof(_header->magic));
+    _header->version = kVersion;
+    _header->key_size = sizeof(Key);
+    _header->value_size = sizeof(Value);
+    _header->num_shards = kShards;
+    _header->shard_slots = shard_slots;
+    _header->segment_size = _size;
+    _header->leader_pid.store(0);
+    _header->expirations.store(0);
+    pthread_mutexattr_t mutex_attr;
+    pthread_mutexattr_init(&mutex_attr);
+    pthread_mutexattr_setpshared(&mutex_attr, PTHREAD_PROCESS_SHARED);
+    // Passed on to a waiter if the leader dies
+    pthread_mutexattr_setrobust(&mutex_attr, PTHREAD_MUTEX_ROBUST);
+    int ret = pthread_mutex_init(&_header->leader_lock, &mutex_attr);
+    assert(ret == 0);
+    _shards = (Shard*)(_base + sizeof(Header));
+    size_t slots_offset = sizeof(Header) + kShards * sizeof(Shard);
+    for (int i = 0; i < kShards; ++i) {
+        Shard* shard = new (&_shards[i]) Shard();
+        // Taken over by the next locker if the holder dies
+        ret = pthread_mutex_init(&shard->lock, &mutex_attr);
+        assert(ret == 0);
+        shard->writing = 0;
+        shard->size = 0;
+        shard->sweep_pos = 0;
+        shard->slots_offset = slots_offset + i * shard_slots * sizeof(Slot);
+    }
+    pthread_mutexattr_destroy(&mutex_attr);
+    _mask = shard_slots - 1;
+    // Attaching processes wait for this
+    _header->state.store(kReady, memory_order_release);
+}
+
+template <class Key, class Value, class Hash, class Clock>
+bool
+SharedMemoryExpireMap<Key, Value, Hash, Clock>::
+_attach(int fd, size_t capacity) {
+    // The creator may not have sized the segment yet
+    struct stat st;
+    for (int tries = 0; ; ++tries) {
+        if (fstat(fd, &st) != 0) return false;
+        if ((size_t)st.st_size >= sizeof(Header)) break;
+        if (tries == kAttachTries) return false;
+        usleep(1000);
+    }
+    void* base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 /* offset */);
+    if (base == MAP_FAILED) return false;
+    _base = (char*)base;
+    _size = st.st_size;
+    _header = (Header*)_base;
+    // Or initialized it. It sized the segment with the file lock held, so it died if
+    // the lock is free before the segment is ready.
+    for (int tries = 0; _header->state.load(memory_order_acquire) != kReady; ++tries) {
+        if (tries == kAttachTries) return false;
+        if (_creator_died(fd)) {
+            flock(fd, LOCK_UN);
+            return false;
+        }
+        usleep(1000);
+    }
+    if (memcmp(_header->magic, "EXPMAPSH", sizeof(_header->magic)) != 0 ||
+        _header->version != kVersion || _header->key_size != sizeof(Key) ||
+        _header->value_size != sizeof(Value) || _header->num_shards != (uint32_t)kShards ||
+        _header->segment_size != _size ||
+        _size != _segment_size(_header->shard_slots) ||
+        (capacity != 0 && _header->shard_slots != _shard_slots(capacity))) {
+        return false;
+    }
+    _shards = (Shard*)(_base + sizeof(Header));
+    _mask = _header->shard_slots - 1;
+    return true;
+}
+
+template <class Key, class Value, class Hash, class Clock>
+bool
+SharedMemoryExpireMap<Key, Value, Hash, Clock>::
+_creator_died(int fd) {
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+        // Creator still initializing
+        return false;
+    }
+    // A segment too small for a header is only taken for dead by a caller that waited
+    // for it, as the creator locks it just after creating it
+    struct stat st;
+    bool died = fstat(fd, &st) == 0 &&
+                ((size_t)st.st_size < sizeof(Header) ||
+                 (_header != NULL && _header->state.load(memory_order_acquire) != kReady));
+    if (!died) {
+        flock(fd, LOCK_UN);
+    }
+    return died;
+}
+
+template <class Key, class Value, class Hash, class Clock>
+bool
+SharedMemoryExpireMap<Key, Value, Hash, Clock>::
+_unlink_segment(int fd) {
+    // Another process may have replaced the segment already
+    struct stat st;
+    struct stat name_st;
+    int name_fd = _open(O_RDWR);
+    bool same = name_fd >= 0 && fstat(fd, &st) == 0 && fstat(name_fd, &name_st) == 0 &&
+                st.st_dev == name_st.st_dev && st.st_ino == name_st.st_ino;
+    if (name_fd >= 0) {
+        close(name_fd);
+    }
+    // Retried also if the name went away or was replaced
+    return !same || unlink(_name, _mapped_file) || errno == ENOENT;
+}
+
+template <class Key, class Value, class Hash, class Clock>
+int
+SharedMemoryExpireMap<Key, Value, Hash, Clock>::
+_open(int flags) const {
+    return _mapped_file ? open(_name.c_str(), flags, 0600) : shm_open(_name.c_str(), flags, 0600);
+}
+
+template <class Key, class Value, class Hash, class Clock>
+void
+SharedMemoryExpireMap<Key, Value, Hash, Clock>::
+_lock(Shard& shard, bool write) {
+    int ret = pthread_mutex_lock(&shard.lock);
+    if (ret == EOWNERDEAD) {
+        // The holder died. If it was writing, slots may be half written.
+        if (shard.writing) {
+            _clear(shard);
+        }
+        pthread_mutex_consistent(&shard.lock);
+        ret = 0;
+    }
+    assert(ret == 0);
+    if (write) {
+        shard.writing = 1;
+        // Marked before any slot is written
+        atomic_signal_fence(memory_order_seq_cst);
+    }
+}
+
+template <class Key, class Value, class Hash, class Clock>
+void
+SharedMemoryExpireMap<Key, Value, Hash, Clock>::
+_unlock(Shard& shard) {
+    // Unmarked after every slot is written
+    atomic_signal_fence(memory_order_seq_cst);
+    shard.writing = 0;
+    pthread_mutex_unlock(&shard.lock);
+}
+
+template <class Key, class Value, class Hash, class Clock>
+void
+SharedMemoryExpireMap<Key, Value, Hash, Clock>::
+_clear(Shard& shard) {
+    Slot* slots = _slots(shard);
+    for (uint64_t pos = 0; pos <= _mask; ++pos) {
+        slots[pos].expiry = 0;
+    }
+    shard.size = 0;
+    shard.sweep_pos = 0;
+    shard.writing = 0;
+}
+
+template <class Key, class Value, class Hash, class Clock>
+uint64_t
+SharedMemoryExpireMap<Key, Value, Hash, Clock>::
+_shard_slots(size_t capacity) {
+    // At most 7/8 of the slots are full
+    uint64_t needed = (capacity + kShards - 1) / kShards;
+    needed += needed / 7 + 1;
+    uint64_t slots = 16;
+    while (slots < needed) {
+        slots <<= 1;
+    }
+    return slots;
+}
+
+template <class Key, class Value, class Hash, class Clock>
+size_t
+SharedMemoryExpireMap<Key, Value, Hash, Clock>::
+_segment_size(uint64_t shard_slots) {
+    return sizeof(Header) + kShards * sizeof(Shard) + kShards * shard_slots * sizeof(Slot);
+}
+
+template <class Key, class Value, class Hash, class Clock>
+uint64_t
+SharedMemoryExpireMap<Key, Value, Hash, Clock>::
+_hash(const Key& key) const {
+    // Mix the bits (MurmurHash3 finalizer). Shards are picked by the high bits and
+    // std::hash of an integer is the integer.
+    uint64_t h = _hasher(key);
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+template <class Key, class Value, class Hash, class Clock>
+bool
+SharedMemoryExpireMap<Key, Value, Hash, Clock>::
+put(Key key, Value value, long timeoutMs) {
+    // Do not insert values for which validity is less than or equal to zero
+    if (!_ok || timeoutMs <= 0) return false;
+    uint64_t hash = _hash(key);
+    Shard& shard = _shard(hash);
+    _lock(shard, true /* write */);
+    long long curtime = _now();
+    long long expiry = curtime + timeoutMs * 1000;
+    bool done = _put_locked(shard, key, value, hash, expiry, curtime);
+    if (!done && _sweep(shard, _mask + 1, curtime) > 0) {
+        // Made room by evicting the expired entries of the shard
+        done = _put_locked(shard, key, value, hash, expiry, curtime);
+    }
+    _unlock(shard);
+    return done;
+}
+
+template <class Key, class Value, class Hash, class Clock>
+bool
+SharedMemoryExpireMap<Key, Value, Hash, Clock>::
+_put_locked(Shard& shard, const Key& key, const Value& value, uint64_t hash, long long expiry,
+            long long curtime) {
+    Slot* slots = _slots(shard);
+    long reuse = -1;
+    uint64_t pos = hash & _mask;
+    for (uint64_t probes = 0; probes <= _mask; ++probes, pos = (pos + 1) & _mask) {
+        Slot& slot = slots[pos];
+        if (slot.expiry == 0) {
+            break;
+        }
+        if (slot.hash == hash && slot.key == key) {
+            // Overwrite
+            slot.value = value;
+            slot.expiry = expiry;
+            return true;
+        }
+        if (reuse < 0 && slot.expiry < curtime) {
+            reuse = pos;
+        }
+    }
+    if (reuse >= 0) {
+        // The key is not in the table. An expired slot on its probe sequence takes it.
+        pos = reuse;
+        _header->expirations.fetch_add(1, memory_order_relaxed);
+    } else if (slots[pos].expiry != 0 || shard.size >= (_mask + 1) - (_mask + 1) / 8) {
+        // Full
+        return false;
+    } else {
+        ++shard.size;
+    }
+    Slot& slot = slots[pos];
+    slot.hash = hash;
+    slot.key = key;
+    slot.value = value;
+    slot.expiry = expiry;
+    return true;
+}
+
+template <class Key, class Value, class Hash, class Clock>
+Value
+SharedMemoryExpireMap<Key, Value, Hash, Clock>::
+get(const Key& key) {
+    if (!_ok) return Value();
+    uint64_t hash = _hash(key);
+    Shard& shard = _shard(hash);
+    long long curtime = _now();
+    _lock(shard, false /* write */);
+    long pos = _find(shard, key, hash);
+    Value value = Value();
+    // Expired entries waiting to be evicted are not returned
+    if (pos >= 0 && _slots(shard)[pos].expiry >= curtime) {
+        value = _slots(shard)[pos].value;
+    }
+    _unlock(shard);
+    return value;
+}
+
+template <class Key, class Value, class Hash, class Clock>
+bool
+SharedMemoryExpireMap<Key, Value, Hash, Clock>::
+remove(const Key& key) {
+    if (!_ok) return false;
+    uint64_t hash = _hash(key);
+    Shard& shard = _shard(hash);
+    _lock(shard, true /* write */);
+    long pos = _find(shard, key, hash);
+    if (pos >= 0) {
+        _erase(shard, pos);
+    }
+    _unlock(shard);
+    return pos >= 0;
+}
+
+template <class Key, class Value, class Hash, class Clock>
+long
+SharedMemoryExpireMap<Key, Value, Hash, Clock>::
+_find(Shard& shard, const Key& key, uint64_t hash) {
+    Slot* slots = _slots(shard);
+    uint64_t pos = hash & _mask;
+    for (uint64_t probes = 0; probes <= _mask; ++probes, pos = (pos + 1) & _mask) {
+        const Slot& slot = slots[pos];
+        if (slot.expiry == 0) {
+            return -1;
+        }
+        if (slot.hash == hash && slot.key == key) {
+            return pos;
+        }
+    }
+    return -1;
+}
+
+template <class Key, class Value, class Hash, class Clock>
+void
+SharedMemoryExpireMap<Key, Value, Hash, Clock>::
+_erase(Shard& shard, uint64_t pos) {
+    Slot* slots = _slots(shard);
+    uint64_t hole = pos;
+    for (uint64_t next = (pos + 1) & _mask; slots[next].expiry != 0; next = (next + 1) & _mask) {
+        // The entry at next moves into the hole unless its home slot lies between the
+        // hole and next, where lookups would stop at the hole before reaching it
+        uint64_t home = slots[next].hash & _mask;
+        if (((next - home) & _mask) >= ((next - hole) & _mask)) {
+            slots[hole] = slots[next];
+            hole = next;
+        }
+    }
+    slots[hole].expiry = 0;
+    --shard.size;
+}
+
+template <class Key, class Value, class Hash, class Clock>
+size_t
+SharedMemoryExpireMap<Key, Value, Hash, Clock>::
+_sweep(Shard& shard, size_t max_slots, long long curtime) {
+    Slot* slots = _slots(shard);
+    size_t evicted = 0;
+    uint64_t pos = shard.sweep_pos & _mask;
+    for (size_t i = 0; i < max_slots && shard.size > 0; ++i) {
+        // An erase may shift another expired entry into pos
+        while (slots[pos].expiry != 0 && slots[pos].expiry < curtime) {
+            _erase(shard, pos);
+            ++evicted;
+        }
+        pos = (pos + 1) & _mask;
+    }
+    shard.sweep_pos = pos;
+    _header->expirations.fetch_add(evicted, memory_order_relaxed);
+    return evicted;
+}
+
+template <class Key, class Value, class Hash, class Clock>
+void*
+SharedMemoryExpireMap<Key, Value, Hash, Clock>::
+eviction(void* arg) {
+    SharedMemoryExpireMap<Key, Value, Hash, Clock>* exp_map =
+        (SharedMemoryExpireMap<Key, Value, Hash, Clock>*)arg;
+    Header* header = exp_map->_header;
+    while (!exp_map->_shutdown) {
+        // Wait for leadership in rounds of 100 ms to notice shutdown
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_nsec += 100000000;
+        if (until.tv_nsec >= 1000000000) {
+            until.tv_sec += 1;
+            until.tv_nsec -= 1000000000;
+        }
+        int ret = pthread_mutex_timedlock(&header->leader_lock, &until);
+        if (ret == EOWNERDEAD) {
+            // The leader died. The mutex only guards leadership, so there is nothing to
+            // repair.
+            pthread_mutex_consistent(&header->leader_lock);
+            ret = 0;
+        }
+        if (ret != 0) {
+            continue;
+        }
+        header->leader_pid.store(getpid());
+        exp_map->_leader = true;
+        while (!exp_map->_shutdown) {
+            // Sleep 4 ms between sweeps of a slice of each shard
+            long long curtime = _now();
+            for (int i = 0; i < kShards; ++i) {
+                Shard& shard = exp_map->_shards[i];
+                exp_map->_lock(shard, true /* write */);
+                exp_map->_sweep(shard, kSweepSlots, curtime);
+                exp_map->_unlock(shard);
+            }
+            usleep(4000);
+        }
+        exp_map->_leader = false;
+        header->leader_pid.store(0);
+        pthread_mutex_unlock(&header->leader_lock);
+    }
+    return NULL;
+}
+
+template <class Key, class Value, class Hash, class Clock>
+size_t
+SharedMemoryExpireMap<Key, Value, Hash, Clock>::
+debug_size() {
+    size_t size = 0;
+    for (int i = 0; _ok && i < kShards; ++i) {
+        _lock(_shards[i], false /* write */);
+        size += _shards[i].size;
+        _unlock(_shards[i]);
+    }
+    return size;
+}
+
+template <class Key, class Value, class Hash, class Clock>
+void
+SharedMemoryExpireMap<Key, Value, Hash, Clock>::
+debug_evict() {
+    long long curtime = _now();
+    for (int i = 0; _ok && i < kShards; ++i) {
+        _lock(_shards[i], true /* write */);
+        _sweep(_shards[i], _mask + 1, curtime);
+        _unlock(_shards[i]);
+    }
+}
+
+#endif // SHARED_MEMORY_EXPIRE_MAP_HH
@@ -0,0 +1,212 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <string>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+using namespace std;
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+//
+// Snapshot file format
+// ==============================================================================
+//
+// Entries of an ExpireMap saved by save_snapshot() and read back by
+// load_snapshot(). The file is a 64 byte header followed by one record per entry,
+// in order of deadline, earliest first. All integers are in the byte order of the
+// host. Every record starts at a multiple of 8 bytes, so the file can be used in
+// place through mmap.
+//
+// Deadlines are absolute wall clock times (microseconds since the Unix epoch), so
+// the remaining time to live of an entry survives a restart of the process. Clocks
+// of maps are monotonic with an arbitrary epoch and are converted on save and load.
+//
+// Fixed records (trivially copyable keys and values, no codec):
+//   int64 deadline | Key, padded to 8 | Value, padded to 8
+//
+// Variable records (kSnapshotVariable, written with a codec):
+//   int64 deadline | uint32 key size | uint32 value size | key bytes | value bytes,
+//   padded to 8
+//
+// A codec converts keys and values that are not trivially copyable to bytes:
+//   void encode_key(const Key& key, string& out)       - Appends the bytes of key
+//   void encode_value(const Value& value, string& out)
+//   bool decode_key(const char* data, size_t size, Key& key)   - False if malformed
+//   bool decode_value(const char* data, size_t size, Value& value)
+//
+// Snapshots are written to a temporary file next to path and renamed over path
+// once complete, so a crash during a save leaves the previous snapshot in place.
+//
+
+static const char kSnapshotMagic[8] = { 'E', 'X', 'P', 'M', 'A', 'P', 'S', 'N' };
+static const uint32_t kSnapshotVersion = 1;
+static const uint32_t kSnapshotVariable = 1;    // Records written with a codec
+
+typedef struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;
+    uint32_t key_size;          // Size of a key in fixed records, 0 for variable
+    uint32_t value_size;        // Size of a value in fixed records, 0 for variable
+    uint64_t count;             // Number of records
+    int64_t saved_at;           // Wall clock time of the save, microseconds
+    char reserved[24];
+} SnapshotHeader;
+static_assert(sizeof(SnapshotHeader) == 64, "Snapshot header must be 64 bytes");
+
+// Rounds size up to a multiple of 8
+inline size_t snapshot_align(size_t size) {
+    return (size + 7) & ~(size_t)7;
+}
+
+// Wall clock time in microseconds since the Unix epoch
+inline long long wall_clock_us() {
+    return chrono::duration_cast<chrono::microseconds>(
+        chrono::system_clock::now().time_since_epoch()).count();
+}
+
+//
+// SnapshotWriter
+// ------------------------------------------------------------------------------
+// Buffered writer of a snapshot. Appends go to a temporary file. finish() writes
+// the header and renames the file to its final path. A writer destroyed before
+// finish() removes the temporary file.
+//
+class SnapshotWriter {
+    private: // Constants
+        static const size_t kBufferBytes = 1 << 20;
+
+    private: // Data
+        string _path;
+        string _tmp_path;
+        int _fd;
+        bool _ok;                   // False after a failed write
+        size_t _offset;             // Bytes of the file so far, including the buffer
+        string _buffer;
+
+    public: // Constructor/Desctructor
+        explicit SnapshotWriter(const string& path)
+            : _path(path), _tmp_path(path + ".tmp"), _fd(-1), _ok(true), _offset(0), _buffer() {
+            _fd = open(_tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            _ok = (_fd >= 0);
+            _buffer.reserve(kBufferBytes);
+            // Room for the header, written by finish()
+            _buffer.append(sizeof(SnapshotHeader), '\0');
+            _offset = sizeof(SnapshotHeader);
+        }
+        ~SnapshotWriter() {
+            if (_fd >= 0) {
+                close(_fd);
+                unlink(_tmp_path.c_str());
+            }
+        }
+
+    public: // Accessors
+        // Appends size bytes of data
+        void append(const void* data, size_t size) {
+            _buffer.append((const char*)data, size);
+            _offset += size;
+            if (_buffer.size() >= kBufferBytes) {
+                _flush();
+            }
+        }
+        // Pads the file with zeros to a multiple of 8 bytes
+        void pad() {
+            static const char zeros[8] = { };
+            append(zeros, snapshot_align(_offset) - _offset);
+        }
+        // Writes header and moves the file to its path. Returns false if any write
+        // failed.
+        bool finish(const SnapshotHeader& header) {
+            _flush();
+            if (_ok) {
+                _ok = (pwrite(_fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header));
+            }
+            _ok = _ok && fsync(_fd) == 0;
+            _ok = (close(_fd) == 0) && _ok;
+            _fd = -1;
+            _ok = _ok && rename(_tmp_path.c_str(), _path.c_str()) == 0;
+            if (!_ok) {
+                unlink(_tmp_path.c_str());
+            }
+            return _ok;
+        }
+
+    private: // Helpers
+        void _flush() {
+            const char* data = _buffer.data();
+            size_t left = _buffer.size();
+            while (_ok && left > 0) {
+                ssize_t written = write(_fd, data, left);
+                if (written <= 0) {
+                    _ok = false;
+                    break;
+                }
+                data += written;
+                left -= written;
+            }
+            _buffer.clear();
+        }
+
+    private: // Not copyable
+        SnapshotWriter(const SnapshotWriter&);
+        SnapshotWriter& operator=(const SnapshotWriter&);
+}; // SnapshotWriter
+
+//
+// SnapshotReader
+// ------------------------------------------------------------------------------
+// Maps a snapshot file read only and checks its header. Records are read in place
+// from records() up to end().
+//
+class SnapshotReader {
+    private: // Data
+        const char* _data;
+        size_t _size;
+        bool _ok;
+
+    public: // Constructor/Desctructor
+        explicit SnapshotReader(const string& path) : _data(NULL), _size(0), _ok(false) {
+            int fd = open(path.c_str(), O_RDONLY);
+            if (fd < 0) return;
+            struct stat st;
+            if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(SnapshotHeader)) {
+                void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (data != MAP_FAILED) {
+                    _data = (const char*)data;
+                    _size = st.st_size;
+                    // Records are read once, front to back
+                    madvise(data, _size, MADV_SEQUENTIAL);
+                }
+            }
+            close(fd);
+            if (_data) {
+                const SnapshotHeader* hdr = header();
+                _ok = memcmp(hdr->magic, kSnapshotMagic, sizeof(kSnapshotMagic)) == 0 &&
+                      hdr->version == kSnapshotVersion;
+            }
+        }
+        ~SnapshotReader() {
+            if (_data) {
+                munmap((void*)_data, _size);
+            }
+        }
+
+    public: // Accessors
+        // False if the file could not be mapped or is not a snapshot
+        bool ok() const { return _ok; }
+        const SnapshotHeader* header() const { return (const SnapshotHeader*)_data; }
+        const char* records() const { return _data + sizeof(SnapshotHeader); }
+        const char* end() const { return _data + _size; }
+
+    private: // Not copyable
+        SnapshotReader(const SnapshotReader&);
+        SnapshotReader& operator=(const SnapshotReader&);
+}; // SnapshotReader
+
+#endif // SNAPSHOT_H
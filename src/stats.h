@@ -0,0 +1,178 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+using namespace std;
+#include "histogram.h"
+
+//
+// ExpireMapStats
+// ==============================================================================
+//
+// Snapshot of the statistics of an ExpireMap, filled by ExpireMap::stats(). A
+// snapshot adds to the values already in it, so the stats of several maps (the
+// shards of a ShardedExpireMap) can be aggregated into one.
+//
+// Counters and lock waits are only collected with ThreadStats. The remaining
+// fields are always available.
+//
+// Lock waits are recorded for contended acquisitions only, in microseconds. The
+// ratio of waits to acquisitions is the contention rate of the lock.
+//
+typedef struct ExpireMapStats {
+    // Counters. Zero with NoStats.
+    uint64_t puts;                  // Entries put, including overwrites
+    uint64_t hits;                  // Gets that found an unexpired value
+    uint64_t misses;                // Gets that found no entry
+    uint64_t expired_hits;          // Gets that found an expired entry not evicted yet
+    uint64_t removes;               // Entries removed by remove
+    uint64_t table_read_locks;      // Acquisitions of the data table lock
+    uint64_t table_write_locks;
+    uint64_t queue_locks;           // Acquisitions of the expiry queue lock
+    LatencyHistogram table_read_waits;  // Contended acquisitions, microseconds
+    LatencyHistogram table_write_waits;
+    LatencyHistogram queue_waits;
+    LatencyHistogram eviction_batches;  // Entries evicted per slice of eviction
+    // Always collected
+    uint64_t expirations;           // Entries evicted on expiry
+    uint64_t capacity_evictions;    // Entries evicted over capacity
+    size_t size;                    // Entries in the data table
+    size_t expiry_queue_size;       // Entries in the expiry queue
+    LatencyHistogram eviction_lags;     // Expiry to removal, microseconds
+    LatencyHistogram eviction_pauses;   // Write lock hold per slice, microseconds
+    ExpireMapStats()
+        : puts(0), hits(0), misses(0), expired_hits(0), removes(0), table_read_locks(0),
+          table_write_locks(0), queue_locks(0), expirations(0), capacity_evictions(0),
+          size(0), expiry_queue_size(0) { }
+} ExpireMapStats;
+
+//
+// Stats policies
+// ==============================================================================
+//
+// Selected with the Stats template parameter of ExpireMap. Every policy provides
+//
+// static const bool kEnabled
+// - False if the policy collects nothing. The map then skips all instrumentation,
+//   including the clock reads around contended locks.
+//
+// void count(StatCounter counter, uint64_t n)
+// void record_wait(LockWait lock, long long us)
+// void record_batch(size_t entries)
+// void snapshot(ExpireMapStats& stats) const
+// - Adds the counters and histograms of the policy to stats.
+//
+enum StatCounter {
+    kStatPuts,
+    kStatHits,
+    kStatMisses,
+    kStatExpiredHits,
+    kStatRemoves,
+    kStatTableReadLocks,
+    kStatTableWriteLocks,
+    kStatQueueLocks,
+    kStatCounters
+};
+
+enum LockWait {
+    kWaitTableRead,
+    kWaitTableWrite,
+    kWaitQueue,
+    kLockWaits
+};
+
+//
+// NoStats
+// ------------------------------------------------------------------------------
+// Collects nothing. All calls are empty and inline away. Default.
+//
+class NoStats {
+    public: // Constants
+        static const bool kEnabled = false;
+
+    public: // Accessors
+        void count(StatCounter counter, uint64_t n = 1) { }
+        void record_wait(LockWait lock, long long us) { }
+        void record_batch(size_t entries) { }
+        void snapshot(ExpireMapStats& stats) const { }
+}; // NoStats
+
+//
+// ThreadStats
+// ------------------------------------------------------------------------------
+// Counters are kept in Slots sets, each on its own cache lines. Threads are
+// assigned a set round robin on first use and only increment their own, so
+// counting does not move cache lines between cores as long as there are no more
+// threads than slots. A snapshot sums all sets.
+//
+// Lock waits and eviction batches are recorded in shared histograms. Waits are
+// only recorded for contended acquisitions, which are slow anyway, and batches
+// once per slice of eviction.
+//
+template <int Slots = 16>
+class ThreadStats {
+    public: // Constants
+        static const bool kEnabled = true;
+
+    private: // Types
+        static const int kCacheLine = 64;
+        struct alignas(kCacheLine) CounterSlot {
+            atomic<uint64_t> counters[kStatCounters];
+            CounterSlot() {
+                for (int i = 0; i < kStatCounters; ++i) {
+                    counters[i].store(0, memory_order_relaxed);
+                }
+            }
+        };
+
+    private: // Data
+        CounterSlot _slots[Slots];
+        LatencyHistogram _waits[kLockWaits];
+        LatencyHistogram _batches;
+
+    public: // Constructor
+        ThreadStats() { }
+
+    public: // Accessors
+        void count(StatCounter counter, uint64_t n = 1) {
+            _slots[_slot()].counters[counter].fetch_add(n, memory_order_relaxed);
+        }
+        void record_wait(LockWait lock, long long us) { _waits[lock].record(us); }
+        void record_batch(size_t entries) { _batches.record(entries); }
+        void snapshot(ExpireMapStats& stats) const {
+            uint64_t totals[kStatCounters] = { };
+            for (int i = 0; i < Slots; ++i) {
+                for (int c = 0; c < kStatCounters; ++c) {
+                    totals[c] += _slots[i].counters[c].load(memory_order_relaxed);
+                }
+            }
+            stats.puts += totals[kStatPuts];
+            stats.hits += totals[kStatHits];
+            stats.misses += totals[kStatMisses];
+            stats.expired_hits += totals[kStatExpiredHits];
+            stats.removes += totals[kStatRemoves];
+            stats.table_read_locks += totals[kStatTableReadLocks];
+            stats.table_write_locks += totals[kStatTableWriteLocks];
+            stats.queue_locks += totals[kStatQueueLocks];
+            stats.table_read_waits.merge(_waits[kWaitTableRead]);
+            stats.table_write_waits.merge(_waits[kWaitTableWrite]);
+            stats.queue_waits.merge(_waits[kWaitQueue]);
+            stats.eviction_batches.merge(_batches);
+        }
+
+    private: // Helpers
+        // Counter set of the calling thread
+        static int _slot() {
+            static atomic<unsigned> next_slot(0);
+            static thread_local int slot = next_slot.fetch_add(1, memory_order_relaxed) % Slots;
+            return slot;
+        }
+
+    private: // Not copyable
+        ThreadStats(const ThreadStats&);
+        ThreadStats& operator=(const ThreadStats&);
+}; // ThreadStats
+
+#endif // STATS_H
@@ -1,11 +1,66 @@
 #include <iostream>
 #include <vector>
+#include <stdexcept>
+#include <string_view>
+#include <new>
+#include <cstdlib>
 using namespace std;
 #include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
 #include "expire_map.h"
+#include "sharded_expire_map.h"
+#include "flat_expire_map.h"
+#include "sampled_expire_map.h"
+#include "shared_memory_expire_map.h"
 
 // #define VERBOSE 1
 
+// Time only moves when a test moves it. Tests do not sleep and do not race with the
+// wall clock.
+typedef ManualClock TestClock;
+typedef ExpireMap<int, int, OrderedExpiryIndex<int>, PthreadRWLock, TestClock> TestExpireMap;
+typedef ExpireMap<int, int, TimingWheelExpiryIndex<int>, PthreadRWLock, TestClock> WheelExpireMap;
+typedef ExpireMap<int, int, FifoExpiryIndex<int>, PthreadRWLock, TestClock> FifoExpireMap;
+typedef ExpireMap<int, int, OrderedExpiryIndex<int>, DistributedRWLock<>, TestClock>
+    DistLockExpireMap;
+typedef ExpireMap<int, int, OrderedExpiryIndex<int>, PthreadRWLock, TestClock, ThreadStats<> >
+    StatsExpireMap;
+typedef ShardedExpireMap<int, int, TestExpireMap> TestShardedExpireMap;
+typedef FlatExpireMap<int, int, PthreadRWLock, hash<int>, TestClock> TestFlatExpireMap;
+typedef SampledExpireMap<int, int, PthreadRWLock, TestClock> TestSampledExpireMap;
+typedef SharedMemoryExpireMap<int, int, hash<int>, TestClock> TestSharedMemoryExpireMap;
+
+typedef ExpireMap<string, int, OrderedExpiryIndex<string>, PthreadRWLock, TestClock>
+    StringExpireMap;
+typedef StringExpireMap::Event StringEvent;
+typedef StringExpireMap::EventStream StringRing;
+
+// Allocations from the global heap by the calling thread, to check that lookups do
+// not allocate
+thread_local long heap_allocations = 0;
+
+void* operator new(size_t size) {
+    ++heap_allocations;
+    void* ptr = malloc(size ? size : 1);
+    if (ptr == NULL) {
+        throw bad_alloc();
+    }
+    return ptr;
+}
+
+void operator delete(void* ptr) noexcept {
+    free(ptr);
+}
+
+void operator delete(void* ptr, size_t size) noexcept {
+    free(ptr);
+}
+
+// Held shared by test threads while they operate on a map and exclusive to move time
+// forward, so that time is constant within an operation and its verification.
+pthread_rwlock_t test_time_lock = PTHREAD_RWLOCK_INITIALIZER;
+
 typedef struct ShadowVal {
     int value;
     long expiry;
@@ -15,7 +70,7 @@ typedef struct ShadowVal {
 void single_threaded_test(int num_keys, int num_ops, long max_timeout_ms) {
     cout << "====Test of correctness of ExpireMap with a single threaded user====" << endl;
     vector<ShadowVal> shadowlist(num_keys);
-    ExpireMap<int, int> exp_map;
+    TestExpireMap exp_map;
     int inserted = 0;
     int deleted = 0;
     int expired = 0;
@@ -25,8 +80,7 @@ void single_threaded_test(int num_keys, int num_ops, long max_timeout_ms) {
 #ifdef VERBOSE
         cout << "Iteration : "<< i << " Key : " << idx<< endl;
 #endif
-        long long curtime =
-            duration_cast<microseconds>(high_resolution_clock::now().time_since_epoch()).count();
+        long long curtime = TestClock::now();
         // If expired, mark shadow entry as deleted
         if (shadowlist[idx].expiry != 0 && shadowlist[idx].expiry < curtime) {
             ++expired;
@@ -48,8 +102,7 @@ void single_threaded_test(int num_keys, int num_ops, long max_timeout_ms) {
             // Set a random value
             shadowlist[idx].value = rand();
             // Retake time to calculate expiry
-            curtime =
-                duration_cast<microseconds>(high_resolution_clock::now().time_since_epoch()).count();
+            curtime = TestClock::now();
             exp_map.put(idx, shadowlist[idx].value, timeout_ms);
             shadowlist[idx].expiry = curtime + timeout_ms * 1000;
             // Verify that value is present in the map
@@ -81,8 +134,7 @@ void single_threaded_test(int num_keys, int num_ops, long max_timeout_ms) {
                     // Set a random value
                     shadowlist[idx].value = rand();
                     // Retake time to calculate expiry
-                    curtime =
-                        duration_cast<microseconds>(high_resolution_clock::now().time_since_epoch()).count();
+                    curtime = TestClock::now();
                     exp_map.put(idx, shadowlist[idx].value, timeout_ms);
                     shadowlist[idx].expiry = curtime + timeout_ms * 1000;
                     // Verify that value is present in the map
@@ -90,9 +142,8 @@ void single_threaded_test(int num_keys, int num_ops, long max_timeout_ms) {
                 }
             }
         }
-        // Sleep for 4ms
-        int sleeptime = (rand() % 4000);
-        usleep(sleeptime);
+        // Move time forward by up to 4ms
+        TestClock::advance(rand() % 4000);
     }
     cout << "Entries inserted : " << inserted << ", expired : " << expired;
     cout << ", overwritten : " << overwritten << ", deleted : " << deleted << endl;
@@ -106,17 +157,18 @@ typedef struct ConcurrentShadowVal {
     ConcurrentShadowVal() : value(0), expiry(0) { }
 } ConcurrentShadowVal;
 
-typedef struct ThreadInput {
-    ExpireMap<int, int>* exp_map;
+template <class Map>
+struct ThreadInput {
+    Map* exp_map;
     int num_keys;
     int num_ops_per_thread;
     int max_timeout_ms;
     vector<ConcurrentShadowVal>* shadowlist;
-    ThreadInput(ExpireMap<int, int>* p_m, int p_k, int p_o, int p_t,
+    ThreadInput(Map* p_m, int p_k, int p_o, int p_t,
                 vector<ConcurrentShadowVal>* p_l)
         : exp_map(p_m), num_keys(p_k), num_ops_per_thread(p_o), max_timeout_ms(p_t),
           shadowlist(p_l) { }
-} ThreadInput;
+};
 
 typedef struct ThreadOutput {
     int inserted;
@@ -126,8 +178,9 @@ typedef struct ThreadOutput {
     ThreadOutput() : inserted(0), expired(0), deleted(0), overwritten(0) { }
 } ThreadOutput;
 
+template <class Map>
 void* test_thread(void* arg) {
-    ThreadInput* params = (ThreadInput*) arg;
+    ThreadInput<Map>* params = (ThreadInput<Map>*) arg;
     ThreadOutput* counts = new ThreadOutput();
     for (int i = 0; i < params->num_ops_per_thread; ++i) {
         // Pick an index to work on and lock the index.
@@ -135,8 +188,8 @@ void* test_thread(void* arg) {
         int idx = rand() % params->num_keys;
         ConcurrentShadowVal* sd_val = &((*params->shadowlist)[idx]);
         pthread_mutex_lock(&(sd_val->mutex));
-        long long curtime =
-            duration_cast<microseconds>(high_resolution_clock::now().time_since_epoch()).count();
+        pthread_rwlock_rdlock(&test_time_lock);
+        long long curtime = TestClock::now();
         if (sd_val->expiry != 0 && sd_val->expiry < curtime) {
             ++counts->expired;
             sd_val->expiry = 0;
@@ -151,8 +204,7 @@ void* test_thread(void* arg) {
             // Set a random value
             sd_val->value = rand();
             // Retake time to calculate expiry
-            curtime =
-                duration_cast<microseconds>(high_resolution_clock::now().time_since_epoch()).count();
+            curtime = TestClock::now();
             params->exp_map->put(idx, sd_val->value, timeout_ms);
             sd_val->expiry = curtime + timeout_ms * 1000;
             // Verify that value is present in the map
@@ -175,8 +227,7 @@ void* test_thread(void* arg) {
                     // Set a random value
                     sd_val->value = rand();
                     // Retake time to calculate expiry
-                    curtime =
-                        duration_cast<microseconds>(high_resolution_clock::now().time_since_epoch()).count();
+                    curtime = TestClock::now();
                     params->exp_map->put(idx, sd_val->value, timeout_ms);
                     sd_val->expiry = curtime + timeout_ms * 1000;
                     // Verify that value is present in the map
@@ -184,31 +235,34 @@ void* test_thread(void* arg) {
                 }
             }
         }
+        pthread_rwlock_unlock(&test_time_lock);
         pthread_mutex_unlock(&(sd_val->mutex));
-        // Sleep for 4ms
-        int sleeptime = (rand() % 4000);
-        usleep(sleeptime);
+        // Move time forward by up to 4ms
+        pthread_rwlock_wrlock(&test_time_lock);
+        TestClock::advance(rand() % 4000);
+        pthread_rwlock_unlock(&test_time_lock);
     }
 
     pthread_exit((void*) counts);
 }
 
-void multi_threaded_test(int num_threads, int num_keys, int num_ops_per_thread,
-                         long max_timeout_ms) {
-    cout << "====Test of correctness of ExpireMap with a multi threaded user====" << endl;
+template <class Map>
+void multi_threaded_test(const char* name, int num_threads, int num_keys,
+                         int num_ops_per_thread, long max_timeout_ms) {
+    cout << "====Test of correctness of " << name << " with a multi threaded user====" << endl;
     vector<ConcurrentShadowVal> shadowlist(num_keys);
     for (int i = 0; i < num_keys; ++i) {
         int ret = pthread_mutex_init(&shadowlist[i].mutex, NULL /* attr */);
         assert(ret == 0);
     }
-    ExpireMap<int, int> exp_map;
+    Map exp_map;
     vector<pthread_t> threads(num_threads);
-    ThreadInput thread_input(&exp_map, num_keys, num_ops_per_thread, max_timeout_ms,
+    ThreadInput<Map> thread_input(&exp_map, num_keys, num_ops_per_thread, max_timeout_ms,
                              &shadowlist);
     // Spawn threads to operate on ExpireMap
     for (int i = 0; i < num_threads; ++i) {
         int ret =
-            pthread_create(&threads[i], NULL /* attr */, test_thread, (void*)&thread_input);
+            pthread_create(&threads[i], NULL /* attr */, test_thread<Map>, (void*)&thread_input);
         assert(ret == 0);
     }
     // Wait for threads to complete
@@ -228,26 +282,1854 @@ void multi_threaded_test(int num_threads, int num_keys, int num_ops_per_thread,
     cout << "====Test successful====" << endl;
 }
 
-void expiration_test(int num_keys, int max_timeout_ms) {
-    cout << "====Test of expiration functionality====" << endl;
-    ExpireMap<int, int> exp_map;
+template <class Map>
+void expiration_test(const char* name, int num_keys, int max_timeout_ms) {
+    cout << "====Test of expiration functionality of " << name << "====" << endl;
+    Map exp_map;
     for (int i = 0; i < num_keys; ++i) {
         int val = rand();
         exp_map.put(i, val, (rand() % max_timeout_ms) + 1);
         // Verify that the entry is present in the ExpireMap
         assert(exp_map.get(i) == val);
     }
-    // Sleep for maximum timeout + 4ms to allow for eviction to catch up
-    usleep(max_timeout_ms * 1000 + 4000);
+    // Move time past maximum timeout + 4ms and let eviction catch up
+    TestClock::advance(max_timeout_ms * 1000 + 4000);
+    exp_map.debug_evict();
     assert(exp_map.debug_size() == 0);
     cout << num_keys << " entries added and expired within " << max_timeout_ms << " ms" << endl;
     cout << "====Test successful====" << endl;
 }
 
+template <class Map>
+void overwrite_churn_test(const char* name, int num_keys, int num_ops, int max_timeout_ms) {
+    cout << "====Test of expiry queue size under overwrite churn of " << name << "====" << endl;
+    Map exp_map;
+    for (int i = 0; i < num_ops; ++i) {
+        int idx = rand() % num_keys;
+        if (rand() % 8 == 0) {
+            exp_map.remove(idx);
+        } else {
+            // Long timeouts so that nothing expires while churning
+            exp_map.put(idx, rand(), 60000 + rand() % 60000);
+        }
+        // Expiry queue holds exactly one entry per key in the data table
+        if (i % 1024 == 0) {
+            assert(exp_map.debug_expiry_queue_size() == exp_map.debug_size());
+            assert(exp_map.debug_size() <= num_keys);
+        }
+    }
+    assert(exp_map.debug_expiry_queue_size() == exp_map.debug_size());
+    // Overwrite every key with a short timeout and wait for all of them to expire
+    for (int i = 0; i < num_keys; ++i) {
+        exp_map.put(i, rand(), (rand() % max_timeout_ms) + 1);
+    }
+    assert(exp_map.debug_expiry_queue_size() == num_keys);
+    TestClock::advance(max_timeout_ms * 1000 + 4000);
+    exp_map.debug_evict();
+    assert(exp_map.debug_size() == 0);
+    assert(exp_map.debug_expiry_queue_size() == 0);
+    cout << num_ops << " puts and removes over " << num_keys << " keys" << endl;
+    cout << "====Test successful====" << endl;
+}
+
+void timing_wheel_test(int num_keys, long long max_delay_us) {
+    cout << "====Test of TimingWheelExpiryIndex====" << endl;
+    const long long tick_us = 1000;
+    long long curtime = 1000000;
+    typedef TimingWheelExpiryIndex<int, tick_us> Wheel;
+    Wheel wheel(curtime);
+    vector<long long> expiry(num_keys);
+    vector<Wheel::Handle> handles(num_keys);
+    for (int i = 0; i < num_keys; ++i) {
+        // Spread deadlines so that entries land on every level that the delays can reach
+        expiry[i] = curtime + ((long long)rand() * rand()) % max_delay_us;
+        handles[i] = wheel.schedule(expiry[i], i);
+    }
+    // Cancel every 4th key and move the next one to a new expiry
+    int cancelled = 0;
+    for (int i = 0; i + 1 < num_keys; i += 4) {
+        wheel.cancel(handles[i]);
+        expiry[i] = 0;
+        ++cancelled;
+        expiry[i + 1] = curtime + ((long long)rand() * rand()) % max_delay_us;
+        handles[i + 1] = wheel.reschedule(handles[i + 1], expiry[i + 1]);
+    }
+    assert((int)wheel.size() == num_keys - cancelled);
+    vector<pair<long long, int> > expired;
+    int popped = 0;
+    long long prevtime = curtime;
+    while (!wheel.empty()) {
+        // Advance by a random step or, like the eviction thread, sleep till the next expiry
+        long long next = wheel.next_expiry();
+        bool jumped = rand() % 2 == 0;
+        curtime = jumped ? next + 1 : curtime + (rand() % 5000) + 1;
+        while (wheel.pop_expired(curtime, expired)) {
+            for (size_t j = 0; j < expired.size(); ++j) {
+                int key = expired[j].second;
+                // Entry is popped exactly once, after its expiry and at most a tick late
+                assert(expiry[key] == expired[j].first);
+                assert(expired[j].first < curtime);
+                assert(expired[j].first >= prevtime - tick_us);
+                // Next expiry never skips past a pending entry
+                assert(!jumped || expired[j].first >= next + 1 - tick_us);
+                expiry[key] = 0;
+                ++popped;
+            }
+            expired.clear();
+        }
+        assert(wheel.empty() || wheel.next_expiry() >= curtime);
+        prevtime = curtime;
+    }
+    assert(popped == num_keys - cancelled);
+    cout << popped << " entries expired, " << cancelled << " cancelled" << endl;
+    cout << "====Test successful====" << endl;
+}
+
+void fifo_expiry_index_test(int num_keys, long long ttl_us) {
+    cout << "====Test of FifoExpiryIndex====" << endl;
+    long long curtime = 1000000;
+    typedef FifoExpiryIndex<int> Fifo;
+    Fifo fifo(curtime);
+    vector<long long> expiry(num_keys);
+    vector<Fifo::Handle> handles(num_keys);
+    // Fixed timeout, one put per us, so entries are scheduled in order of expiry
+    for (int i = 0; i < num_keys; ++i) {
+        expiry[i] = ++curtime + ttl_us;
+        handles[i] = fifo.schedule(expiry[i], i);
+    }
+    assert(fifo.capacity() >= (size_t)num_keys);
+    // Overwrite every 3rd key and remove every 5th one
+    int cancelled = 0;
+    for (int i = 0; i < num_keys; ++i) {
+        if (i % 5 == 0) {
+            fifo.cancel(handles[i]);
+            expiry[i] = 0;
+            ++cancelled;
+        } else if (i % 3 == 0) {
+            expiry[i] = ++curtime + ttl_us;
+            handles[i] = fifo.reschedule(handles[i], expiry[i]);
+        }
+    }
+    assert((int)fifo.size() == num_keys - cancelled);
+    // First key is cancelled, so the head has moved past it
+    assert(fifo.next_expiry() == expiry[1]);
+    vector<pair<long long, int> > expired;
+    int popped = 0;
+    long long prev = 0;
+    while (!fifo.empty()) {
+        curtime += rand() % 1000 + 1;
+        while (fifo.pop_expired(curtime, expired, 100 /* max entries */)) {
+            assert(expired.size() > 0 && expired.size() <= 100);
+            for (size_t j = 0; j < expired.size(); ++j) {
+                int key = expired[j].second;
+                // Popped once, in order of expiry and never before it
+                assert(expiry[key] == expired[j].first);
+                assert(expired[j].first < curtime && expired[j].first >= prev);
+                prev = expired[j].first;
+                expiry[key] = 0;
+                ++popped;
+            }
+            expired.clear();
+        }
+        assert(fifo.empty() || fifo.next_expiry() >= curtime);
+    }
+    assert(popped == num_keys - cancelled);
+    // An entry scheduled earlier than the tail waits for the entries ahead of it
+    Fifo::Handle later = fifo.schedule(curtime + 100, 1);
+    fifo.schedule(curtime + 50, 2);
+    assert(!fifo.pop_expired(curtime + 60, expired));
+    assert(fifo.pop_expired(curtime + 101, expired) && expired.size() == 2);
+    assert(expired[0].second == 1 && expired[1].second == 2);
+    // Handles outlive popped sequence numbers and are not reused
+    assert(fifo.schedule(curtime, 3) > later);
+    fifo.clear();
+    assert(fifo.empty());
+    cout << popped << " entries expired, " << cancelled << " cancelled" << endl;
+    cout << "====Test successful====" << endl;
+}
+
+template <class Index>
+void expiry_index_slice_test(const char* name, int num_keys, size_t max_entries) {
+    cout << "====Test of partial pops of " << name << "====" << endl;
+    long long curtime = 1000000;
+    Index index(curtime);
+    vector<typename Index::Handle> handles(num_keys);
+    // Few distinct expiries, so that buckets are much larger than a pop
+    for (int i = 0; i < num_keys; ++i) {
+        handles[i] = index.schedule(curtime + 1000 * (i % 4) + 10, i);
+    }
+    // Cancel a key of the first bucket after it has been partially popped
+    vector<pair<long long, int> > expired;
+    curtime += 10000;
+    assert(index.pop_expired(curtime, expired, max_entries));
+    assert(expired.size() == max_entries);
+    vector<bool> popped(num_keys, false);
+    for (size_t j = 0; j < expired.size(); ++j) {
+        popped[expired[j].second] = true;
+    }
+    int cancelled = -1;
+    for (int i = 0; i < num_keys && cancelled < 0; i += 4) {
+        if (!popped[i]) {
+            cancelled = i;
+            index.cancel(handles[i]);
+        }
+    }
+    assert(cancelled >= 0);
+    int total = expired.size();
+    long long prev = expired.back().first;
+    expired.clear();
+    while (!index.empty()) {
+        assert(index.next_expiry() < curtime);
+        assert(index.pop_expired(curtime, expired, max_entries));
+        assert(expired.size() > 0 && expired.size() <= max_entries);
+        for (size_t j = 0; j < expired.size(); ++j) {
+            // Buckets are popped in order of expiry
+            assert(expired[j].first >= prev);
+            assert(!popped[expired[j].second] && expired[j].second != cancelled);
+            popped[expired[j].second] = true;
+            prev = expired[j].first;
+        }
+        total += expired.size();
+        expired.clear();
+    }
+    assert(total == num_keys - 1);
+    assert(!index.pop_expired(curtime, expired, max_entries));
+    cout << "====Test successful====" << endl;
+}
+
+void latency_histogram_test() {
+    cout << "====Test of LatencyHistogram====" << endl;
+    LatencyHistogram histogram;
+    assert(histogram.percentile(50) == 0);
+    for (int i = 1; i <= 100000; ++i) {
+        histogram.record(i);
+    }
+    assert(histogram.count() == 100000);
+    assert(histogram.max() == 100000);
+    assert(histogram.percentile(100) == 100000);
+    // Values are known to within 1/8th
+    long long p50 = histogram.percentile(50);
+    assert(p50 >= 50000 && p50 <= 50000 + 50000 / 8);
+    long long p999 = histogram.percentile(99.9);
+    assert(p999 >= 99900 && p999 <= 100000);
+    // Small values are exact
+    LatencyHistogram small;
+    small.record(3);
+    small.record(5);
+    assert(small.percentile(50) == 3 && small.percentile(100) == 5);
+    histogram.merge(small);
+    assert(histogram.count() == 100002);
+    cout << "====Test successful====" << endl;
+}
+
+template <class Map>
+void eviction_slice_test(const char* name, int num_keys) {
+    cout << "====Test of sliced eviction of " << name << "====" << endl;
+    Map exp_map;
+    // Slices bounded by keys. All entries expire at the same time.
+    exp_map.set_eviction_slice(100 /* keys */);
+    for (int i = 0; i < num_keys; ++i) {
+        exp_map.put(i, i + 1, 10);
+    }
+    TestClock::advance(12000);
+    exp_map.debug_evict();
+    assert(exp_map.debug_size() == 0);
+    LatencyHistogram pauses;
+    exp_map.eviction_pauses(pauses);
+    assert(pauses.count() >= (uint64_t)num_keys / 100);
+    // Slices bounded by time
+    exp_map.set_eviction_slice(SIZE_MAX, 100 /* us */);
+    for (int i = 0; i < num_keys; ++i) {
+        exp_map.put(i, i + 1, 10);
+    }
+    TestClock::advance(12000);
+    exp_map.debug_evict();
+    assert(exp_map.debug_size() == 0);
+    LatencyHistogram all_pauses;
+    exp_map.eviction_pauses(all_pauses);
+    assert(all_pauses.count() > pauses.count());
+    // Every entry was removed 2 ms after its expiry
+    LatencyHistogram lags;
+    exp_map.eviction_lags(lags);
+    assert(lags.count() == 2 * (uint64_t)num_keys);
+    assert(lags.percentile(50) == 2000 && lags.max() == 2000);
+    // Rounds that evict nothing, such as cascades of the timing wheel, do not lock the
+    // data table and record no pause
+    exp_map.put(0, 1, 60000);
+    for (int i = 0; i < 100; ++i) {
+        TestClock::advance(100000);
+        exp_map.debug_evict();
+    }
+    assert(exp_map.get(0) == 1);
+    LatencyHistogram idle_pauses;
+    exp_map.eviction_pauses(idle_pauses);
+    assert(idle_pauses.count() == all_pauses.count());
+    exp_map.remove(0);
+    cout << all_pauses.count() << " slices. Pause p50 " << all_pauses.percentile(50)
+         << " us, p99.9 " << all_pauses.percentile(99.9) << " us, max " << all_pauses.max()
+         << " us" << endl;
+    cout << "====Test successful====" << endl;
+}
+
+size_t test_entry_bytes(const int& key, const int& value) {
+    return 16 + value % 64;
+}
+
+template <class Map>
+void capacity_test(const char* name, int max_entries, int num_keys) {
+    cout << "====Test of capacity limit of " << name << "====" << endl;
+    Map exp_map;
+    // Entry count limit
+    exp_map.set_capacity(max_entries);
+    int hot = max_entries / 16;
+    for (int i = 0; i < num_keys; ++i) {
+        exp_map.put(i, i + 1, 60000);
+        // Keys below hot are read between puts and should survive sampled LRU
+        assert(exp_map.get(i % hot) == 0 || exp_map.get(i % hot) == i % hot + 1);
+        // Accesses are recorded to the millisecond
+        TestClock::advance(1000);
+        assert(exp_map.debug_size() <= max_entries);
+    }
+    assert(exp_map.capacity_evictions() == (uint64_t)(num_keys - exp_map.debug_size()));
+    assert(exp_map.expirations() == 0);
+    int hot_hits = 0;
+    for (int i = 0; i < hot; ++i) {
+        hot_hits += (exp_map.get(i) == i + 1);
+    }
+    assert(hot_hits >= hot * 9 / 10);
+    // Byte limit. Shrinking the limit evicts right away.
+    size_t max_bytes = max_entries * 16;
+    exp_map.set_capacity(SIZE_MAX, max_bytes, test_entry_bytes);
+    assert(exp_map.debug_bytes() <= max_bytes);
+    for (int i = 0; i < num_keys; ++i) {
+        exp_map.put(i, rand(), 60000);
+        assert(exp_map.debug_bytes() <= max_bytes);
+    }
+    // Accounting follows removes and expiry
+    for (int i = 0; i < num_keys; i += 2) {
+        exp_map.remove(i);
+    }
+    uint64_t evicted = exp_map.capacity_evictions();
+    int size = exp_map.debug_size();
+    TestClock::advance(60000 * 1000 + 1000);
+    exp_map.debug_evict();
+    assert(exp_map.debug_size() == 0 && exp_map.debug_bytes() == 0);
+    assert(exp_map.expirations() == (uint64_t)size);
+    assert(exp_map.capacity_evictions() == evicted);
+    cout << evicted << " capacity evictions, " << hot_hits << " of " << hot
+         << " hot keys kept" << endl;
+    cout << "====Test successful====" << endl;
+}
+
+// Value that counts its copies
+struct CountedValue {
+    static int copies;
+    string data;
+    CountedValue() : data() { }
+    CountedValue(size_t size, char c) : data(size, c) { }
+    CountedValue(const CountedValue& other) : data(other.data) { ++copies; }
+    CountedValue(CountedValue&& other) : data(move(other.data)) { }
+    CountedValue& operator=(const CountedValue& other) {
+        data = other.data;
+        ++copies;
+        return *this;
+    }
+    CountedValue& operator=(CountedValue&& other) {
+        data = move(other.data);
+        return *this;
+    }
+};
+int CountedValue::copies = 0;
+
+void value_access_test() {
+    cout << "====Test of value access of ExpireMap====" << endl;
+    // Moves and in place access do not copy values
+    {
+        typedef ExpireMap<string, CountedValue, OrderedExpiryIndex<string>, PthreadRWLock,
+                          TestClock> BlobExpireMap;
+        BlobExpireMap exp_map;
+        CountedValue::copies = 0;
+        CountedValue blob(1 << 16, 'a');
+        exp_map.put("moved", move(blob), 1000);
+        exp_map.emplace("emplaced", 1000, 1 << 16, 'b');
+        exp_map.put("moved", CountedValue(1 << 12, 'c'), 1000);
+        size_t size = 0;
+        assert(exp_map.with_value("moved", [&size](const CountedValue& v) {
+            size = v.data.size();
+        }));
+        assert(size == 1 << 12);
+        assert(exp_map.with_value("emplaced", [](const CountedValue& v) {
+            assert(v.data[0] == 'b');
+        }));
+        assert(!exp_map.with_value("missing", [](const CountedValue& v) { assert(false); }));
+        assert(CountedValue::copies == 0);
+        // try_get and get copy once
+        optional<CountedValue> got = exp_map.try_get("emplaced");
+        assert(got && got->data.size() == 1 << 16);
+        assert(CountedValue::copies == 1);
+        assert(!exp_map.try_get("missing"));
+        TestClock::advance(1001 * 1000);
+        assert(!exp_map.try_get("emplaced"));
+        assert(exp_map.get("moved").data.empty());
+    }
+    // try_get tells a miss apart from a stored default value
+    {
+        TestExpireMap exp_map;
+        exp_map.put(1, 0, 1000);
+        assert(exp_map.get(1) == 0 && exp_map.get(2) == 0);
+        assert(exp_map.try_get(1) && *exp_map.try_get(1) == 0);
+        assert(!exp_map.try_get(2));
+    }
+    // Shared values outlive their entry
+    {
+        SharedValueExpireMap<int, string, OrderedExpiryIndex<int>, PthreadRWLock, TestClock>
+            exp_map;
+        exp_map.put(1, make_shared<const string>(1 << 16, 'x'), 1000);
+        shared_ptr<const string> value = exp_map.get(1);
+        exp_map.put(1, make_shared<const string>("y"), 1000);
+        assert(*exp_map.get(1) == "y");
+        exp_map.remove(1);
+        assert(!exp_map.get(1));
+        assert(value->size() == 1 << 16 && (*value)[0] == 'x');
+    }
+    // Sharded map forwards to its shards
+    {
+        ShardedExpireMap<int, CountedValue,
+                         ExpireMap<int, CountedValue, OrderedExpiryIndex<int>,
+                                   PthreadRWLock, TestClock> > exp_map;
+        CountedValue::copies = 0;
+        for (int i = 0; i < 100; ++i) {
+            exp_map.emplace(i, 1000, i + 1, 'z');
+        }
+        for (int i = 0; i < 100; ++i) {
+            assert(exp_map.with_value(i, [i](const CountedValue& v) {
+                assert(v.data.size() == (size_t)i + 1);
+            }));
+        }
+        assert(CountedValue::copies == 0);
+        assert(exp_map.try_get(7)->data.size() == 8);
+        // A batch copies each value once, like a put per key
+        vector<int> keys;
+        vector<CountedValue> values;
+        for (int i = 0; i < 100; ++i) {
+            keys.push_back(i);
+            values.push_back(CountedValue(i + 2, 'y'));
+        }
+        CountedValue::copies = 0;
+        exp_map.multi_put(keys.begin(), keys.end(), values.begin(), 1000);
+        assert(CountedValue::copies == 100);
+        for (int i = 0; i < 100; ++i) {
+            assert(exp_map.with_value(i, [i](const CountedValue& v) {
+                assert(v.data.size() == (size_t)i + 2 && v.data[0] == 'y');
+            }));
+        }
+        // and a batch get copies each value once out of its shard
+        vector<CountedValue> got(100);
+        vector<bool> hits;
+        CountedValue::copies = 0;
+        assert(exp_map.multi_get(keys.begin(), keys.end(), got.begin(), hits) == 100);
+        assert(CountedValue::copies == 100);
+        for (int i = 0; i < 100; ++i) {
+            assert(hits[i] && got[i].data.size() == (size_t)i + 2);
+        }
+    }
+    cout << "====Test successful====" << endl;
+}
+
+void flat_expire_map_test(int num_keys, int num_ops, long max_timeout_ms) {
+    cout << "====Test of FlatExpireMap====" << endl;
+    // Randomized operations against a shadow copy. Expiry is tracked in milliseconds, so
+    // an entry may stay valid for up to a millisecond past its expiry.
+    {
+        vector<ShadowVal> shadowlist(num_keys);
+        TestFlatExpireMap exp_map(16);
+        for (int i = 0; i < num_ops; ++i) {
+            int idx = rand() % num_keys;
+            long long curtime = TestClock::now();
+            if (shadowlist[idx].expiry != 0 && shadowlist[idx].expiry + 1000 < curtime) {
+                shadowlist[idx].expiry = 0;
+                assert(exp_map.get(idx) == 0);
+            }
+            if (shadowlist[idx].expiry == 0 || rand() % 2 == 0) {
+                int timeout_ms = (rand() % max_timeout_ms) + 1;
+                shadowlist[idx].value = rand();
+                curtime = TestClock::now();
+                exp_map.put(idx, shadowlist[idx].value, timeout_ms);
+                shadowlist[idx].expiry = curtime + timeout_ms * 1000;
+                assert(exp_map.get(idx) == shadowlist[idx].value);
+            } else if (curtime <= shadowlist[idx].expiry) {
+                int got = exp_map.get(idx);
+                curtime = TestClock::now();
+                assert(got == shadowlist[idx].value || curtime > shadowlist[idx].expiry);
+                if (rand() % 4 == 0) {
+                    shadowlist[idx].expiry = 0;
+                    exp_map.remove(idx);
+                    assert(exp_map.get(idx) == 0);
+                }
+            }
+            TestClock::advance(rand() % 400);
+        }
+    }
+    // Expired slots are reused instead of growing the table
+    {
+        TestFlatExpireMap exp_map(1024);
+        for (int i = 0; i < 800; ++i) {
+            exp_map.put(i, i + 1, 1);
+        }
+        TestClock::advance(3000);
+        for (int i = 0; i < 800; ++i) {
+            assert(exp_map.get(i) == 0);
+            exp_map.put(1000 + i, i + 1, 60000);
+        }
+        assert(exp_map.debug_capacity() == 1024);
+        assert(exp_map.debug_size() == 800);
+        for (int i = 0; i < 800; ++i) {
+            assert(exp_map.get(1000 + i) == i + 1);
+        }
+    }
+    // Growth and removal
+    {
+        TestFlatExpireMap exp_map(16);
+        for (int i = 0; i < 100000; ++i) {
+            exp_map.put(i, i + 1, 60000);
+        }
+        for (int i = 0; i < 100000; i += 2) {
+            exp_map.remove(i);
+        }
+        for (int i = 0; i < 100000; ++i) {
+            assert(exp_map.get(i) == (i % 2 == 0 ? 0 : i + 1));
+        }
+        assert(exp_map.debug_size() == 50000);
+    }
+    // The millisecond count neither wraps nor brings entries back after a long idle
+    // period without puts
+    {
+        TestFlatExpireMap exp_map(1024);
+        const long long kDayUs = 24LL * 3600 * 1000000;
+        exp_map.put(1, 1, TestFlatExpireMap::kMaxTimeoutMs);
+        exp_map.put(2, 2, 1000);
+        TestClock::advance(20 * kDayUs);
+        assert(exp_map.get(1) == 1 && exp_map.get(2) == 0);
+        // Past the longest timeout and then past 2^32 ms of the base
+        TestClock::advance(5 * kDayUs);
+        assert(exp_map.get(1) == 0 && exp_map.get(2) == 0);
+        TestClock::advance(30 * kDayUs);
+        assert(exp_map.get(1) == 0 && exp_map.get(2) == 0);
+        // A put restarts the base at the current time
+        exp_map.put(3, 3, 1000);
+        assert(exp_map.get(3) == 3 && exp_map.get(1) == 0);
+        assert(exp_map.debug_size() == 1);
+        TestClock::advance(2000000);
+        assert(exp_map.get(3) == 0);
+        // And puts keep working across further rebases
+        for (int i = 0; i < 4; ++i) {
+            exp_map.put(4, 4 + i, 60000);
+            TestClock::advance(20 * kDayUs);
+            exp_map.put(5, 5 + i, 60000);
+            assert(exp_map.get(5) == 5 + i && exp_map.get(4) == 0);
+        }
+    }
+    cout << "====Test successful====" << endl;
+}
+
+template <class Map>
+void batch_test(const char* name, int num_keys, int num_batches, int max_batch,
+                long max_timeout_ms) {
+    cout << "====Test of batch operations of " << name << "====" << endl;
+    Map exp_map;
+    vector<int> keys;
+    vector<int> values;
+    vector<int> got;
+    vector<bool> hits;
+    for (int i = 0; i < num_batches; ++i) {
+        int batch = (rand() % max_batch) + 1;
+        keys.clear();
+        values.clear();
+        for (int j = 0; j < batch; ++j) {
+            keys.push_back(rand() % num_keys);
+            values.push_back(rand() + 1);
+        }
+        int op = rand() % 3;
+        if (op == 0) {
+            int timeout_ms = (rand() % max_timeout_ms) + 1;
+            exp_map.multi_put(keys.begin(), keys.end(), values.begin(), timeout_ms);
+            // Every key holds the value of its last occurrence in the batch
+            for (int j = 0; j < batch; ++j) {
+                int last = j;
+                for (int k = j + 1; k < batch; ++k) {
+                    if (keys[k] == keys[j]) last = k;
+                }
+                assert(exp_map.get(keys[j]) == values[last]);
+            }
+        } else if (op == 1) {
+            got.assign(batch, -1);
+            size_t found = exp_map.multi_get(keys.begin(), keys.end(), got.begin(), hits);
+            assert(hits.size() == (size_t)batch);
+            size_t expected = 0;
+            for (int j = 0; j < batch; ++j) {
+                // Time does not move within a batch, so results match single gets
+                int val = exp_map.get(keys[j]);
+                assert(got[j] == val);
+                assert(hits[j] == (val != 0));
+                expected += hits[j];
+            }
+            assert(found == expected);
+        } else {
+            // Entries that expired but are not evicted yet may also be removed
+            set<int> distinct(keys.begin(), keys.end());
+            size_t live = 0;
+            for (set<int>::iterator iter = distinct.begin(); iter != distinct.end(); ++iter) {
+                live += (exp_map.get(*iter) != 0);
+            }
+            size_t removed = exp_map.multi_remove(keys.begin(), keys.end());
+            assert(removed >= live && removed <= distinct.size());
+            for (int j = 0; j < batch; ++j) {
+                assert(exp_map.get(keys[j]) == 0);
+            }
+        }
+        TestClock::advance(rand() % 4000);
+    }
+    // All entries of a batch expire together
+    keys.clear();
+    values.clear();
+    for (int j = 0; j < max_batch; ++j) {
+        keys.push_back(num_keys + j);
+        values.push_back(j + 1);
+    }
+    exp_map.multi_put(keys.begin(), keys.end(), values.begin(), 10);
+    assert(exp_map.multi_get(keys.begin(), keys.end(), got.begin(), hits) == (size_t)max_batch);
+    TestClock::advance(12000);
+    assert(exp_map.multi_get(keys.begin(), keys.end(), got.begin(), hits) == 0);
+    cout << "====Test successful====" << endl;
+}
+
+// Waits up to a second of real time for the eviction service to empty the map
+template <class Map>
+bool wait_for_eviction(Map& exp_map) {
+    for (int i = 0; i < 1000 && exp_map.debug_size() != 0; ++i) {
+        usleep(1000);
+    }
+    return exp_map.debug_size() == 0;
+}
+
+void eviction_service_test(int num_maps, int num_keys) {
+    cout << "====Test of EvictionService====" << endl;
+    EvictionService service;
+    vector<TestExpireMap*> maps;
+    for (int i = 0; i < num_maps; ++i) {
+        maps.push_back(new TestExpireMap(&service));
+    }
+    // Idle maps do not wake up the service
+    usleep(20000);
+    long long wakeups = service.debug_wakeups();
+    assert(wakeups <= 1);
+    // Entries of all maps are evicted by the service
+    for (int i = 0; i < num_maps; ++i) {
+        for (int j = 0; j < num_keys; ++j) {
+            maps[i]->put(j, j + 1, (rand() % 4) + 1);
+        }
+    }
+    TestClock::advance(5000);
+    for (int i = 0; i < num_maps; ++i) {
+        assert(wait_for_eviction(*maps[i]));
+    }
+    cout << num_maps * num_keys << " entries of " << num_maps << " maps evicted" << endl;
+    // Puts that expire after the armed deadline do not wake up the service
+    maps[0]->put(0, 1, 1000);
+    usleep(5000);
+    wakeups = service.debug_wakeups();
+    for (int j = 1; j < num_keys; ++j) {
+        maps[0]->put(j, j + 1, 1000 + j);
+    }
+    maps[1]->put(0, 1, 2000);
+    usleep(5000);
+    assert(service.debug_wakeups() == wakeups);
+    // An earlier deadline does
+    maps[1]->put(1, 2, 1);
+    TestClock::advance(2000);
+    for (int i = 0; i < 1000 && maps[1]->debug_size() != 1; ++i) {
+        usleep(1000);
+    }
+    assert(service.debug_wakeups() > wakeups);
+    assert(maps[1]->debug_size() == 1);
+    for (int i = 0; i < num_maps; ++i) {
+        delete maps[i];
+    }
+    // Shards share the service
+    {
+        TestShardedExpireMap exp_map(16 /* num shards */, &service);
+        for (int j = 0; j < num_keys; ++j) {
+            exp_map.put(j, j + 1, (rand() % 4) + 1);
+        }
+        TestClock::advance(5000);
+        assert(wait_for_eviction(exp_map));
+    }
+    cout << "====Test successful====" << endl;
+}
+
+// Memory resource that counts the allocations it passes on to the global heap
+class CountingResource : public pmr::memory_resource {
+    public:
+        atomic<long> allocations;
+        CountingResource() : allocations(0) { }
+    private:
+        void* do_allocate(size_t bytes, size_t alignment) override {
+            allocations.fetch_add(1);
+            return pmr::new_delete_resource()->allocate(bytes, alignment);
+        }
+        void do_deallocate(void* p, size_t bytes, size_t alignment) override {
+            pmr::new_delete_resource()->deallocate(p, bytes, alignment);
+        }
+        bool do_is_equal(const pmr::memory_resource& other) const noexcept override {
+            return this == &other;
+        }
+};
+
+template <class Map>
+void pool_resource_test(const char* name, int num_keys, int num_rounds) {
+    cout << "====Test of NodePoolResource with " << name << "====" << endl;
+    CountingResource upstream;
+    NodePoolResource pool(&upstream);
+    {
+        Map exp_map(NULL /* service */, &pool);
+        long warm_allocations = 0;
+        size_t warm_high_water = 0;
+        for (int round = 0; round < num_rounds; ++round) {
+            for (int i = 0; i < num_keys; ++i) {
+                exp_map.put(i, i + 1, (rand() % 8) + 1);
+            }
+            assert(pool.bytes_in_use() > 0);
+            TestClock::advance(10000);
+            assert(wait_for_eviction(exp_map));
+            // Nodes freed by the eviction thread are reused by the next round
+            if (round == 1) {
+                warm_allocations = upstream.allocations.load();
+                warm_high_water = pool.high_water_mark();
+            } else if (round > 1) {
+                assert(upstream.allocations.load() == warm_allocations);
+                assert(pool.high_water_mark() == warm_high_water);
+            }
+        }
+        cout << num_rounds << " rounds of " << num_keys << " puts, "
+             << warm_allocations << " upstream allocations, high water mark "
+             << warm_high_water << " bytes" << endl;
+    }
+    // Shards allocate from a shared pool on all threads
+    {
+        TestShardedExpireMap exp_map(16 /* num shards */, NULL /* service */, &pool);
+        for (int i = 0; i < num_keys; ++i) {
+            exp_map.put(i, i + 1, (rand() % 8) + 1);
+        }
+        for (int i = 0; i < num_keys; ++i) {
+            assert(exp_map.get(i) == i + 1);
+        }
+        TestClock::advance(10000);
+        assert(wait_for_eviction(exp_map));
+    }
+    cout << "====Test successful====" << endl;
+}
+
+void stats_test(int num_keys) {
+    cout << "====Test of ExpireMap stats====" << endl;
+    // The service is armed in real time for the manual timeouts, so it does not evict
+    // during the test
+    EvictionService service;
+    {
+        StatsExpireMap exp_map(&service);
+        for (int i = 0; i < num_keys; ++i) {
+            exp_map.put(i, i + 1, (i % 2) ? 1000 : 3000);
+        }
+        for (int i = 0; i < num_keys; ++i) {
+            exp_map.put(i, i + 1, (i % 2) ? 1000 : 3000);
+        }
+        for (int i = 0; i < 2 * num_keys; ++i) {
+            assert(exp_map.get(i) == (i < num_keys ? i + 1 : 0));
+        }
+        // Odd keys have expired but are not evicted
+        TestClock::advance(2000000);
+        for (int i = 0; i < num_keys; ++i) {
+            assert(exp_map.get(i) == ((i % 2) ? 0 : i + 1));
+        }
+        exp_map.remove(0);
+        ExpireMapStats stats;
+        exp_map.stats(stats);
+        assert(stats.puts == 2 * (uint64_t)num_keys);
+        assert(stats.hits == (uint64_t)num_keys + num_keys / 2);
+        assert(stats.misses == (uint64_t)num_keys);
+        assert(stats.expired_hits == (uint64_t)num_keys / 2);
+        assert(stats.removes == 1);
+        assert(stats.table_read_locks == 3 * (uint64_t)num_keys);
+        assert(stats.table_write_locks == 2 * (uint64_t)num_keys + 1);
+        assert(stats.queue_locks >= stats.table_write_locks);
+        assert(stats.table_read_waits.count() == 0 && stats.table_write_waits.count() == 0);
+        assert(stats.size == (uint64_t)num_keys - 1 && stats.expiry_queue_size == stats.size);
+        // Eviction metrics
+        exp_map.debug_evict();
+        ExpireMapStats evicted;
+        exp_map.stats(evicted);
+        assert(evicted.expirations == (uint64_t)num_keys / 2);
+        assert(evicted.eviction_batches.count() > 0);
+        assert(evicted.eviction_lags.count() == evicted.expirations);
+        assert(evicted.size == (uint64_t)num_keys / 2 - 1);
+        assert(evicted.expiry_queue_size == evicted.size);
+        cout << evicted.hits << " hits, " << evicted.misses << " misses, "
+             << evicted.expired_hits << " expired hits, " << evicted.eviction_batches.count()
+             << " eviction slices of up to " << evicted.eviction_batches.max() << " keys" << endl;
+    }
+    // Without stats only the always on metrics are filled. Shards add up.
+    {
+        TestShardedExpireMap exp_map(4 /* num shards */, &service);
+        for (int i = 0; i < num_keys; ++i) {
+            exp_map.put(i, i + 1, 1000);
+            assert(exp_map.get(i) == i + 1);
+        }
+        ExpireMapStats stats;
+        exp_map.stats(stats);
+        assert(stats.puts == 0 && stats.hits == 0 && stats.table_read_locks == 0);
+        assert(stats.size == (uint64_t)num_keys && stats.expiry_queue_size == (uint64_t)num_keys);
+    }
+    cout << "====Test successful====" << endl;
+}
+
+typedef EventRing<int> IntRing;
+typedef TestExpireMap::EventStream TestEventStream;
+
+// Pushes 1..count to the ring, waiting while it is full
+typedef struct RingProducerArg {
+    IntRing* ring;
+    int count;
+} RingProducerArg;
+
+void* ring_producer(void* arg) {
+    RingProducerArg* producer = (RingProducerArg*)arg;
+    for (int i = 1; i <= producer->count; ++i) {
+        int value = i;
+        producer->ring->push(move(value));
+    }
+    return NULL;
+}
+
+// Drains the ring in batches till total elements have been popped by all consumers
+typedef struct RingConsumerArg {
+    IntRing* ring;
+    atomic<long long>* popped;
+    long long total;
+    long long sum;
+} RingConsumerArg;
+
+void* ring_consumer(void* arg) {
+    RingConsumerArg* consumer = (RingConsumerArg*)arg;
+    vector<int> batch;
+    while (consumer->popped->load() < consumer->total) {
+        batch.clear();
+        size_t n = consumer->ring->pop_batch(batch, 32);
+        for (size_t i = 0; i < n; ++i) {
+            consumer->sum += batch[i];
+        }
+        consumer->popped->fetch_add(n);
+        if (n == 0) {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+// Drains events from a map in small batches, slower than eviction
+typedef struct EventConsumerArg {
+    TestEventStream* ring;
+    int total;
+    vector<TestExpireMap::Event> events;
+} EventConsumerArg;
+
+void* event_consumer(void* arg) {
+    EventConsumerArg* consumer = (EventConsumerArg*)arg;
+    while ((int)consumer->events.size() < consumer->total) {
+        if (consumer->ring->pop_batch(consumer->events, 4) == 0) {
+            usleep(100);
+        }
+    }
+    return NULL;
+}
+
+void event_ring_test(int num_keys) {
+    cout << "====Test of expiry events====" << endl;
+    // Several producers and consumers on a ring much smaller than the stream. Every
+    // element arrives exactly once.
+    {
+        const int kThreads = 4;
+        const int kCount = 100000;
+        IntRing ring(64, kBlockOnOverflow);
+        atomic<long long> popped(0);
+        pthread_t producers[kThreads];
+        pthread_t consumers[kThreads];
+        RingProducerArg producer_args[kThreads];
+        RingConsumerArg consumer_args[kThreads];
+        for (int i = 0; i < kThreads; ++i) {
+            consumer_args[i].ring = &ring;
+            consumer_args[i].popped = &popped;
+            consumer_args[i].total = (long long)kThreads * kCount;
+            consumer_args[i].sum = 0;
+            pthread_create(&consumers[i], NULL, ring_consumer, &consumer_args[i]);
+            producer_args[i].ring = &ring;
+            producer_args[i].count = kCount;
+            pthread_create(&producers[i], NULL, ring_producer, &producer_args[i]);
+        }
+        long long sum = 0;
+        for (int i = 0; i < kThreads; ++i) {
+            pthread_join(producers[i], NULL);
+            pthread_join(consumers[i], NULL);
+            sum += consumer_args[i].sum;
+        }
+        assert(popped.load() == (long long)kThreads * kCount);
+        assert(sum == (long long)kThreads * kCount * (kCount + 1) / 2);
+        assert(ring.size() == 0 && ring.dropped() == 0);
+    }
+    // The service is armed in real time for the manual timeouts, so it does not evict
+    // during the test
+    EvictionService service;
+    // Every entry leaving the map is published once with its value and reason
+    {
+        TestEventStream ring(num_keys);
+        TestExpireMap exp_map(&service);
+        exp_map.set_event_ring(&ring);
+        for (int i = 0; i < num_keys; ++i) {
+            exp_map.put(i, i + 1, 1000);
+        }
+        // Overwrites publish nothing
+        exp_map.put(0, 1, 1000);
+        assert(ring.size() == 0);
+        int removes = num_keys / 8;
+        for (int i = 0; i < removes; ++i) {
+            exp_map.remove(i);
+        }
+        int max_entries = num_keys / 2;
+        exp_map.set_capacity(max_entries);
+        TestClock::advance(2000000);
+        exp_map.debug_evict();
+        vector<TestExpireMap::Event> events;
+        assert(ring.pop_batch(events, 2 * num_keys) == (size_t)num_keys);
+        vector<int> reasons(num_keys, -1);
+        int counts[3] = { };
+        for (size_t i = 0; i < events.size(); ++i) {
+            assert(events[i].value == events[i].key + 1);
+            assert(reasons[events[i].key] == -1);
+            reasons[events[i].key] = events[i].reason;
+            ++counts[events[i].reason];
+        }
+        for (int i = 0; i < removes; ++i) {
+            assert(reasons[i] == kRemoved);
+        }
+        assert(counts[kRemoved] == removes);
+        assert(counts[kEvicted] == num_keys - removes - max_entries);
+        assert(counts[kExpired] == max_entries);
+        assert(ring.dropped() == 0);
+        // Events stop once the ring is detached
+        exp_map.set_event_ring(NULL);
+        exp_map.put(1, 1, 1000);
+        exp_map.remove(1);
+        assert(ring.size() == 0);
+    }
+    // Shards share a ring
+    {
+        TestEventStream ring(num_keys);
+        TestShardedExpireMap exp_map(4 /* num shards */, &service);
+        exp_map.set_event_ring(&ring);
+        for (int i = 0; i < num_keys; ++i) {
+            exp_map.put(i, i + 1, 1000);
+        }
+        TestClock::advance(2000000);
+        exp_map.debug_evict();
+        assert(ring.size() == (size_t)num_keys);
+    }
+    // A full ring drops and counts events with kDropOnOverflow
+    {
+        TestEventStream ring(16, kDropOnOverflow);
+        TestExpireMap exp_map(&service);
+        exp_map.set_event_ring(&ring);
+        for (int i = 0; i < num_keys; ++i) {
+            exp_map.put(i, i + 1, 1000);
+        }
+        TestClock::advance(2000000);
+        exp_map.debug_evict();
+        assert(exp_map.debug_size() == 0);
+        assert(ring.size() == 16 && ring.dropped() == (uint64_t)num_keys - 16);
+    }
+    // With kBlockOnOverflow eviction waits for a slow consumer and nothing is lost
+    {
+        TestEventStream ring(16, kBlockOnOverflow);
+        TestExpireMap exp_map(&service);
+        exp_map.set_event_ring(&ring);
+        for (int i = 0; i < num_keys; ++i) {
+            exp_map.put(i, i + 1, 1000);
+        }
+        EventConsumerArg consumer;
+        consumer.ring = &ring;
+        consumer.total = num_keys;
+        pthread_t consumer_thread;
+        pthread_create(&consumer_thread, NULL, event_consumer, &consumer);
+        TestClock::advance(2000000);
+        exp_map.debug_evict();
+        pthread_join(consumer_thread, NULL);
+        assert((int)consumer.events.size() == num_keys && ring.dropped() == 0);
+        for (int i = 0; i < num_keys; ++i) {
+            assert(consumer.events[i].reason == kExpired);
+            assert(consumer.events[i].value == consumer.events[i].key + 1);
+        }
+    }
+    // Callers do not wait for a blocking ring. Their events that do not fit are dropped.
+    {
+        TestEventStream ring(16, kBlockOnOverflow);
+        TestExpireMap exp_map(&service);
+        exp_map.set_event_ring(&ring);
+        for (int i = 0; i < num_keys; ++i) {
+            exp_map.put(i, i + 1, 1000);
+        }
+        for (int i = 0; i < num_keys; ++i) {
+            exp_map.remove(i);
+        }
+        assert(exp_map.debug_size() == 0);
+        assert(ring.size() == 16 && ring.dropped() == (uint64_t)num_keys - 16);
+    }
+    // Eviction blocked on a ring nobody drains gives up when the map is destroyed
+    {
+        TestEventStream ring(16, kBlockOnOverflow);
+        {
+            TestExpireMap exp_map;
+            exp_map.set_event_ring(&ring);
+            for (int i = 0; i < num_keys; ++i) {
+                exp_map.put(i, i + 1, 1000);
+            }
+            TestClock::advance(2000000);
+            usleep(20000);
+        }
+        assert(ring.size() <= 16 && ring.size() + ring.dropped() <= (uint64_t)num_keys);
+    }
+    cout << "====Test successful====" << endl;
+}
+
+// Loader for get_or_load. Counts calls and returns key * 10 + version, where version
+// is the number of calls so far. Sleeps in real time to keep loads in flight.
+typedef struct CountingLoader {
+    atomic<int>* loads;
+    useconds_t delay_us;
+    bool fail;
+    int operator()(const int& key) const {
+        int version = loads->fetch_add(1) + 1;
+        usleep(delay_us);
+        if (fail) {
+            throw runtime_error("backend unavailable");
+        }
+        return key * 10 + version;
+    }
+} CountingLoader;
+
+typedef struct LoadThreadArg {
+    TestExpireMap* exp_map;
+    CountingLoader loader;
+    int key;
+    int value;
+} LoadThreadArg;
+
+void* load_thread(void* arg) {
+    LoadThreadArg* load = (LoadThreadArg*)arg;
+    load->value = load->exp_map->get_or_load(load->key, load->loader, 1000);
+    return NULL;
+}
+
+void get_or_load_test(int num_threads) {
+    cout << "====Test of get_or_load====" << endl;
+    // The service is armed in real time for the manual timeouts, so it does not evict
+    // during the test
+    EvictionService service;
+    atomic<int> loads(0);
+    CountingLoader loader = { &loads, 20000, false };
+    // Concurrent misses on a key run the loader once and share its value
+    {
+        TestExpireMap exp_map(&service);
+        vector<pthread_t> threads(num_threads);
+        vector<LoadThreadArg> args(num_threads);
+        for (int i = 0; i < num_threads; ++i) {
+            args[i].exp_map = &exp_map;
+            args[i].loader = loader;
+            args[i].key = 7;
+            args[i].value = 0;
+            pthread_create(&threads[i], NULL, load_thread, &args[i]);
+        }
+        for (int i = 0; i < num_threads; ++i) {
+            pthread_join(threads[i], NULL);
+            assert(args[i].value == 71);
+        }
+        assert(loads.load() == 1);
+        // Hits do not load
+        assert(exp_map.get_or_load(7, loader, 1000) == 71 && exp_map.get(7) == 71);
+        assert(loads.load() == 1);
+        // The loaded value expires like any other
+        TestClock::advance(1001000);
+        assert(exp_map.get(7) == 0);
+        assert(exp_map.get_or_load(7, loader, 1000) == 72 && loads.load() == 2);
+    }
+    // Errors reach the caller and nothing is put
+    {
+        TestExpireMap exp_map(&service);
+        CountingLoader failing = { &loads, 0, true };
+        bool thrown = false;
+        try {
+            exp_map.get_or_load(1, failing, 1000);
+        } catch (const runtime_error&) {
+            thrown = true;
+        }
+        assert(thrown && exp_map.debug_size() == 0);
+        int value = exp_map.get_or_load(1, loader, 1000);
+        assert(value == 10 + loads.load());
+    }
+    // Hits in the last quarter of the timeout reload the key once in the background
+    {
+        LoaderPool pool(2 /* num threads */);
+        TestExpireMap exp_map(&service);
+        exp_map.set_refresh_ahead(&pool, 0.25);
+        loads = 0;
+        assert(exp_map.get_or_load(1, loader, 1000) == 11);
+        TestClock::advance(500000);
+        assert(exp_map.get_or_load(1, loader, 1000) == 11);
+        assert(loads.load() == 1);
+        // Inside the window the current value is returned while one reload runs
+        TestClock::advance(300000);
+        for (int i = 0; i < 10; ++i) {
+            int value = exp_map.get_or_load(1, loader, 1000);
+            assert(value == 11 || value == 12);
+        }
+        for (int i = 0; i < 1000 && exp_map.get(1) != 12; ++i) {
+            usleep(1000);
+        }
+        assert(exp_map.get(1) == 12 && loads.load() == 2);
+        // The reload put the key with a new timeout
+        TestClock::advance(500000);
+        assert(exp_map.get_or_load(1, loader, 1000) == 12 && loads.load() == 2);
+        // The map waits for a reload still running when it is destroyed
+        TestClock::advance(300000);
+        exp_map.get_or_load(1, loader, 1000);
+    }
+    assert(loads.load() == 3);
+    cout << "====Test successful====" << endl;
+}
+
+template <class Map>
+void touch_test(const char* name, int num_keys) {
+    cout << "====Test of touch of " << name << "====" << endl;
+    // The service is armed in real time for the manual timeouts, so it does not evict
+    // during the test
+    EvictionService service;
+    Map exp_map(&service);
+    for (int i = 0; i < num_keys; ++i) {
+        exp_map.put(i, i + 1, 1000);
+    }
+    // Extending the expiry of even keys leaves the expiry queue alone
+    TestClock::advance(800000);
+    for (int i = 0; i < num_keys; i += 2) {
+        if (i % 4) {
+            assert(exp_map.touch(i, 1000));
+        } else {
+            assert(exp_map.get_and_touch(i, 1000) == i + 1);
+        }
+    }
+    assert(!exp_map.touch(num_keys, 1000) && exp_map.get_and_touch(num_keys, 1000) == 0);
+    assert(exp_map.debug_expiry_queue_size() == num_keys);
+    // Eviction at the old expiry removes odd keys and puts even keys back in the queue
+    TestClock::advance(300000);
+    assert(!exp_map.touch(1, 1000));
+    exp_map.debug_evict();
+    assert(exp_map.debug_size() == num_keys / 2);
+    assert(exp_map.debug_expiry_queue_size() == num_keys / 2);
+    assert(exp_map.expirations() == (uint64_t)num_keys / 2);
+    for (int i = 0; i < num_keys; ++i) {
+        assert(exp_map.get(i) == ((i % 2) ? 0 : i + 1));
+    }
+    // Touched keys expire at their new expiry
+    TestClock::advance(800000);
+    exp_map.debug_evict();
+    assert(exp_map.debug_size() == 0 && exp_map.debug_expiry_queue_size() == 0);
+    assert(exp_map.expirations() == (uint64_t)num_keys);
+    // A key touched on every access stays. It is moved in the expiry queue at most
+    // once per timeout.
+    exp_map.put(1, 2, 100);
+    for (int i = 0; i < 50; ++i) {
+        TestClock::advance(50000);
+        assert(exp_map.get_and_touch(1, 100) == 2);
+        exp_map.debug_evict();
+    }
+    assert(exp_map.get(1) == 2 && exp_map.debug_expiry_queue_size() == 1);
+    // Moving the expiry closer takes effect in the expiry queue right away
+    exp_map.put(2, 3, 10000);
+    assert(exp_map.touch(2, 10));
+    TestClock::advance(20000);
+    exp_map.debug_evict();
+    assert(exp_map.get(2) == 0 && exp_map.debug_size() == 1);
+    cout << "====Test successful====" << endl;
+}
+
+// Waits up to a second for map to become the leader, or to lose leadership
+template <class Map>
+bool wait_for_leader(Map& exp_map, bool leader) {
+    for (int i = 0; i < 1000 && exp_map.is_leader() != leader; ++i) {
+        usleep(1000);
+    }
+    return exp_map.is_leader() == leader;
+}
+
+void shared_memory_test(int num_keys) {
+    cout << "====Test of SharedMemoryExpireMap====" << endl;
+    string name = "/test_expire_map." + to_string(getpid());
+    TestSharedMemoryExpireMap::unlink(name);
+    {
+        TestSharedMemoryExpireMap exp_map(name, num_keys, false /* evict */);
+        assert(exp_map.ok() && exp_map.leader_pid() == 0);
+        for (int i = 0; i < num_keys; ++i) {
+            assert(exp_map.put(i, i + 1, (i % 2) ? 1000 : 3000));
+        }
+        assert(exp_map.debug_size() == (size_t)num_keys);
+        // A second mapping of the segment sees the entries without rebuilding anything
+        TestSharedMemoryExpireMap attached(name, 0 /* any capacity */, false /* evict */);
+        assert(attached.ok() && attached.debug_size() == (size_t)num_keys);
+        for (int i = 0; i < num_keys; ++i) {
+            assert(attached.get(i) == i + 1);
+        }
+        // Attaching with other types or capacity fails
+        SharedMemoryExpireMap<int, long long, hash<int>, TestClock> other_type(name, 0, false);
+        assert(!other_type.ok() && other_type.get(1) == 0 && !other_type.put(1, 1, 1000));
+        TestSharedMemoryExpireMap other_capacity(name, 64 * num_keys, false);
+        assert(!other_capacity.ok());
+        // Overwrite and remove, with backward shifts keeping later keys reachable
+        for (int i = 0; i < num_keys; i += 3) {
+            assert(attached.remove(i));
+        }
+        assert(!attached.remove(0));
+        for (int i = 0; i < num_keys; ++i) {
+            assert(exp_map.get(i) == ((i % 3) ? i + 1 : 0));
+        }
+        for (int i = 0; i < num_keys; i += 3) {
+            assert(exp_map.put(i, i + 1, (i % 2) ? 1000 : 3000));
+        }
+        // Expired entries are not returned and are swept by eviction
+        TestClock::advance(2000000);
+        for (int i = 0; i < num_keys; ++i) {
+            assert(exp_map.get(i) == ((i % 2) ? 0 : i + 1));
+        }
+        attached.debug_evict();
+        assert(exp_map.debug_size() == (size_t)num_keys / 2);
+        assert(exp_map.expirations() == (uint64_t)num_keys / 2);
+        for (int i = 0; i < num_keys; ++i) {
+            assert(exp_map.get(i) == ((i % 2) ? 0 : i + 1));
+        }
+        // Full shards reject puts till their entries expire
+        int rejected = 0;
+        for (int i = num_keys; i < 4 * num_keys; ++i) {
+            rejected += !exp_map.put(i, i + 1, 1000);
+        }
+        assert(rejected > 0);
+        TestClock::advance(4000000);
+        assert(exp_map.put(-1, 1, 1000) && exp_map.get(-1) == 1);
+    }
+    TestSharedMemoryExpireMap::unlink(name);
+    // Entries put by another process are hits in this one
+    {
+        TestSharedMemoryExpireMap exp_map(name, num_keys, false /* evict */);
+        pid_t child = fork();
+        if (child == 0) {
+            TestSharedMemoryExpireMap child_map(name, num_keys, false /* evict */);
+            bool ok = child_map.ok();
+            for (int i = 0; ok && i < num_keys / 2; ++i) {
+                ok = child_map.put(i, i + 2, 1000);
+            }
+            _exit(ok ? 0 : 1);
+        }
+        int status = 0;
+        waitpid(child, &status, 0);
+        assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+        for (int i = 0; i < num_keys / 2; ++i) {
+            assert(exp_map.get(i) == i + 2);
+        }
+    }
+    TestSharedMemoryExpireMap::unlink(name);
+    // One map leads eviction. Another takes over when it goes away.
+    {
+        TestSharedMemoryExpireMap* first = new TestSharedMemoryExpireMap(name, num_keys);
+        assert(wait_for_leader(*first, true));
+        TestSharedMemoryExpireMap second(name, num_keys);
+        usleep(20000);
+        assert(!second.is_leader() && second.leader_pid() == getpid());
+        for (int i = 0; i < num_keys; ++i) {
+            second.put(i, i + 1, 1000);
+        }
+        delete first;
+        assert(wait_for_leader(second, true));
+        TestClock::advance(2000000);
+        for (int i = 0; i < 1000 && second.debug_size() > 0; ++i) {
+            usleep(1000);
+        }
+        assert(second.debug_size() == 0);
+    }
+    // The leader process dies. A waiting process takes over.
+    {
+        TestSharedMemoryExpireMap exp_map(name, num_keys, false /* evict */);
+        pid_t child = fork();
+        if (child == 0) {
+            TestSharedMemoryExpireMap child_map(name, num_keys);
+            while (true) {
+                pause();
+            }
+        }
+        for (int i = 0; i < 1000 && exp_map.leader_pid() != child; ++i) {
+            usleep(1000);
+        }
+        assert(exp_map.leader_pid() == child);
+        TestSharedMemoryExpireMap successor(name, num_keys);
+        kill(child, SIGKILL);
+        waitpid(child, NULL, 0);
+        assert(wait_for_leader(successor, true) && successor.leader_pid() == getpid());
+    }
+    TestSharedMemoryExpireMap::unlink(name);
+    // A process dies holding a shard lock. The next locker takes the lock over, and
+    // clears the shard if the process was writing to it.
+    {
+        TestSharedMemoryExpireMap exp_map(name, num_keys, false /* evict */);
+        for (int i = 0; i < num_keys; ++i) {
+            assert(exp_map.put(i, i + 1, 1000));
+        }
+        for (int write = 0; write <= 1; ++write) {
+            pid_t child = fork();
+            if (child == 0) {
+                TestSharedMemoryExpireMap child_map(name, num_keys, false /* evict */);
+                child_map.debug_lock_shard(0, write);
+                _exit(0);
+            }
+            waitpid(child, NULL, 0);
+            int found = 0;
+            for (int i = 0; i < num_keys; ++i) {
+                int value = exp_map.get(i);
+                assert(value == 0 || value == i + 1);
+                found += (value != 0);
+            }
+            assert(exp_map.debug_size() == (size_t)found);
+            if (write) {
+                // Only the shard of key 0 is lost
+                assert(exp_map.get(0) == 0 && found < num_keys && found > num_keys / 2);
+            } else {
+                assert(found == num_keys);
+            }
+        }
+        assert(exp_map.put(0, 1, 1000) && exp_map.get(0) == 1);
+    }
+    TestSharedMemoryExpireMap::unlink(name);
+    // The creator of a segment dies before making it ready. The segment is created
+    // again rather than waited for.
+    {
+        int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+        assert(fd >= 0 && ftruncate(fd, 1 << 16) == 0);
+        close(fd);
+        long long start = SteadyClock::now();
+        TestSharedMemoryExpireMap exp_map(name, num_keys, false /* evict */);
+        assert(exp_map.ok() && exp_map.put(1, 2, 1000) && exp_map.get(1) == 2);
+        assert(SteadyClock::now() - start < 1000000);
+        TestSharedMemoryExpireMap attached(name, num_keys, false /* evict */);
+        assert(attached.ok() && attached.get(1) == 2);
+    }
+    TestSharedMemoryExpireMap::unlink(name);
+    // Same over a mapped file
+    {
+        string path = "test_expire_map.shm";
+        TestSharedMemoryExpireMap::unlink(path, true /* mapped file */);
+        TestSharedMemoryExpireMap exp_map(path, num_keys, false /* evict */, true /* mapped file */);
+        assert(exp_map.ok() && exp_map.put(1, 2, 1000));
+        TestSharedMemoryExpireMap attached(path, num_keys, false /* evict */, true /* mapped file */);
+        assert(attached.ok() && attached.get(1) == 2);
+        assert(TestSharedMemoryExpireMap::unlink(path, true /* mapped file */));
+    }
+    cout << "====Test successful====" << endl;
+}
+
+void scan_test(int num_keys) {
+    cout << "====Test of scans of ExpireMap====" << endl;
+    // The service is armed in real time for the manual timeouts, so it does not evict
+    // during the test
+    EvictionService service;
+    TestExpireMap exp_map(&service);
+    // Odd keys expire before the scans
+    for (int i = 0; i < num_keys; ++i) {
+        exp_map.put(i, i + 1, (i % 2) ? 1000 : 3000);
+    }
+    TestClock::advance(2000000);
+    vector<int> seen(2 * num_keys, 0);
+    size_t visited = exp_map.for_each_live([&seen](const int& key, const int& value) {
+        assert(value == key + 1);
+        ++seen[key];
+    });
+    assert(visited == (size_t)num_keys / 2);
+    for (int i = 0; i < num_keys; ++i) {
+        assert(seen[i] == ((i % 2) ? 0 : 1));
+    }
+    // Writes during a scan do not show in it. The visitor runs without the lock and
+    // rewrites the map on its first call, while most buckets are still to be walked.
+    seen.assign(2 * num_keys, 0);
+    bool written = false;
+    size_t buckets = exp_map.debug_bucket_count();
+    visited = exp_map.for_each_live([&](const int& key, const int& value) {
+        assert(value == key + 1);
+        ++seen[key];
+        if (written) return;
+        written = true;
+        for (int i = 0; i < num_keys; i += 2) {
+            if (i % 4) {
+                exp_map.remove(i);
+            } else {
+                exp_map.put(i, -1, 3000);
+            }
+        }
+        // New keys, enough to rehash the table. The scan saves the buckets it has not
+        // walked yet first.
+        for (int i = num_keys; i < 2 * num_keys; ++i) {
+            exp_map.put(i, i + 1, 3000);
+        }
+        assert(exp_map.debug_bucket_count() > buckets);
+        TestClock::advance(500000);
+        exp_map.debug_evict();
+    });
+    assert(written && visited == (size_t)num_keys / 2);
+    for (int i = 0; i < 2 * num_keys; ++i) {
+        assert(seen[i] == ((i < num_keys && i % 2 == 0) ? 1 : 0));
+    }
+    // The table grows after the scan too
+    for (int i = 2 * num_keys; i < 4 * num_keys; ++i) {
+        exp_map.put(i, i + 1, 3000);
+    }
+    for (int i = 0; i < 4 * num_keys; ++i) {
+        int expected = i + 1;
+        if (i < num_keys) {
+            expected = (i % 2) ? 0 : ((i % 4) ? 0 : -1);
+        }
+        assert(exp_map.get(i) == expected);
+    }
+    // Parallel scans visit each live entry once
+    size_t live = exp_map.debug_size();
+    vector<atomic<int> > counts(4 * num_keys);
+    for (int num_threads = 1; num_threads <= 8; num_threads *= 2) {
+        for (int i = 0; i < 4 * num_keys; ++i) {
+            counts[i] = 0;
+        }
+        atomic<long long> sum(0);
+        visited = exp_map.parallel_for_each_live(num_threads,
+                                                 [&](const int& key, const int& value) {
+            counts[key].fetch_add(1);
+            sum.fetch_add(value);
+        });
+        assert(visited == live);
+        long long expected_sum = 0;
+        for (int i = 0; i < 4 * num_keys; ++i) {
+            int expected = exp_map.get(i);
+            assert(counts[i].load() == (expected != 0 ? 1 : 0));
+            expected_sum += expected;
+        }
+        assert(sum.load() == expected_sum);
+    }
+    // The table rehashes while a scan walks it, also while the other threads of a
+    // parallel scan walk. Keys are spread over the table, so that the rehash moves
+    // entries between buckets, and the value tells the key.
+    auto spread = [](int i) { return (int)((unsigned)i * 2654435761u); };
+    for (int num_threads = 1; num_threads <= 4; num_threads *= 4) {
+        TestExpireMap grown_map(&service);
+        for (int i = 0; i < num_keys; ++i) {
+            grown_map.put(spread(i), i + 1, 3000);
+        }
+        vector<atomic<int> > visits(2 * num_keys);
+        atomic<bool> grown(false);
+        buckets = grown_map.debug_bucket_count();
+        visited = grown_map.parallel_for_each_live(num_threads,
+                                                   [&](const int& key, const int& value) {
+            assert(key == spread(value - 1));
+            visits[value - 1].fetch_add(1);
+            if (grown.exchange(true)) return;
+            for (int i = num_keys; i < 2 * num_keys; ++i) {
+                grown_map.put(spread(i), i + 1, 3000);
+            }
+            assert(grown_map.debug_bucket_count() > buckets);
+        });
+        assert(visited == (size_t)num_keys);
+        for (int i = 0; i < 2 * num_keys; ++i) {
+            assert(visits[i].load() == (i < num_keys ? 1 : 0));
+        }
+    }
+    // A snapshot holds the entries with their expiry
+    vector<TestExpireMap::SnapshotEntry> entries;
+    exp_map.snapshot(entries);
+    assert(entries.size() == live);
+    for (size_t i = 0; i < entries.size(); ++i) {
+        assert(exp_map.get(entries[i].key) == entries[i].value);
+        assert(entries[i].expiry >= TestClock::now());
+    }
+    // A visitor may start scans of its own. On its first call it scans the map, empties
+    // it and scans it again, while the outer scan still visits every entry it started
+    // with.
+    for (int i = 0; i < 4 * num_keys; ++i) {
+        counts[i] = 0;
+    }
+    bool nested = false;
+    visited = exp_map.for_each_live([&](const int& key, const int& value) {
+        counts[key].fetch_add(1);
+        if (nested) return;
+        nested = true;
+        assert(exp_map.for_each_live([](const int& key, const int& value) { }) == live);
+        assert(exp_map.parallel_for_each_live(4, [](const int& key, const int& value) { })
+               == live);
+        for (size_t i = 0; i < entries.size(); ++i) {
+            exp_map.remove(entries[i].key);
+        }
+        vector<TestExpireMap::SnapshotEntry> inner;
+        exp_map.snapshot(inner);
+        assert(inner.empty());
+        const char* path = "test_expire_map.scan.snapshot";
+        assert(exp_map.save_snapshot(path));
+        unlink(path);
+    });
+    assert(nested && visited == live);
+    for (size_t i = 0; i < entries.size(); ++i) {
+        assert(counts[entries[i].key].load() == 1);
+    }
+    assert(exp_map.debug_size() == 0);
+    cout << "====Test successful====" << endl;
+}
+
+// Snapshot codec for strings
+struct StringCodec {
+    void encode_key(const string& key, string& out) { out.append(key); }
+    void encode_value(const string& value, string& out) { out.append(value); }
+    bool decode_key(const char* data, size_t size, string& key) {
+        key.assign(data, size);
+        return true;
+    }
+    bool decode_value(const char* data, size_t size, string& value) {
+        value.assign(data, size);
+        return true;
+    }
+};
+
+template <class Map>
+void snapshot_test(const char* name, int num_keys) {
+    cout << "====Test of snapshots of " << name << "====" << endl;
+    // The service is armed in real time for the manual timeouts, so it does not evict
+    // during the test
+    EvictionService service;
+    const char* path = "test_expire_map.snapshot";
+    {
+        Map exp_map(&service);
+        // Timeouts of 10 to 80 s in steps of 10 s. Key num_keys has expired but is not
+        // evicted yet, so it is not saved.
+        for (int i = 0; i < num_keys; ++i) {
+            exp_map.put(i, i + 1, (i % 8 + 1) * 10000);
+        }
+        exp_map.put(num_keys, 1, 1);
+        TestClock::advance(2000);
+        assert(exp_map.save_snapshot(path));
+    }
+    // Loading preserves values and the remaining time to live. Real time spent since
+    // the save is far less than the 5 s margins.
+    Map loaded(&service);
+    long long start = SteadyClock::now();
+    assert(loaded.load_snapshot(path));
+    long long load_us = SteadyClock::now() - start;
+    assert(loaded.debug_size() == num_keys);
+    assert(loaded.debug_expiry_queue_size() == num_keys);
+    for (int step = 1; step <= 8; ++step) {
+        TestClock::advance(step == 1 ? 5000000 : 10000000);
+        for (int i = 0; i < num_keys; ++i) {
+            // Valid for another 5 s
+            if (i % 8 + 1 >= step) {
+                assert(loaded.get(i) == i + 1);
+            } else {
+                assert(loaded.get(i) == 0);
+            }
+        }
+    }
+    // Entries whose deadline passes before the load are skipped
+    {
+        Map exp_map(&service);
+        exp_map.put(1, 2, 1);
+        exp_map.put(2, 3, 10000);
+        assert(exp_map.save_snapshot(path));
+        usleep(5000);
+        Map later(&service);
+        assert(later.load_snapshot(path));
+        assert(later.debug_size() == 1 && later.get(2) == 3);
+    }
+    // Loading overwrites existing keys and rejects missing and malformed files
+    {
+        Map exp_map(&service);
+        exp_map.put(2, 7, 10000);
+        exp_map.put(3, 4, 10000);
+        assert(exp_map.load_snapshot(path));
+        assert(exp_map.get(2) == 3 && exp_map.get(3) == 4);
+        assert(!exp_map.load_snapshot("no_such.snapshot"));
+        FILE* file = fopen(path, "r+");
+        fseek(file, 0, SEEK_END);
+        fputc(0, file);
+        fclose(file);
+        assert(!exp_map.load_snapshot(path));
+        assert(exp_map.debug_size() == 2);
+    }
+    // Keys and values that are not trivially copyable are saved with a codec
+    {
+        typedef ExpireMap<string, string, OrderedExpiryIndex<string>, PthreadRWLock, TestClock>
+            StringMap;
+        StringMap exp_map(&service);
+        for (int i = 0; i < 1000; ++i) {
+            exp_map.put(to_string(i), string(i % 17, 'a' + i % 26), 1000);
+        }
+        assert(exp_map.save_snapshot(path, StringCodec()));
+        StringMap copy(&service);
+        assert(!copy.load_snapshot(path + string(".missing"), StringCodec()));
+        assert(copy.load_snapshot(path, StringCodec()));
+        assert(copy.debug_size() == 1000);
+        for (int i = 0; i < 1000; ++i) {
+            assert(copy.get(to_string(i)) == string(i % 17, 'a' + i % 26));
+        }
+    }
+    unlink(path);
+    cout << num_keys << " entries loaded in " << load_us << " us" << endl;
+    cout << "====Test successful====" << endl;
+}
+
+void sampled_expire_map_test(int num_keys) {
+    cout << "====Test of expiration functionality of SampledExpireMap====" << endl;
+    TestSampledExpireMap exp_map;
+    // Lazy expiry on get
+    exp_map.put(0, 1, 1);
+    TestClock::advance(2000);
+    assert(exp_map.debug_size() == 1);
+    assert(exp_map.get(0) == 0);
+    assert(exp_map.debug_size() == 0);
+    // Active expiry on put. Expired entries are erased as long as there are puts.
+    for (int i = 0; i < num_keys; ++i) {
+        exp_map.put(i, i + 1, 1);
+    }
+    TestClock::advance(2000);
+    for (int i = 0; i < num_keys; ++i) {
+        exp_map.put(num_keys + i, i + 1, 60000);
+    }
+    int after_puts = exp_map.debug_size() - num_keys;
+    assert(after_puts < num_keys / 2);
+    // Active expiry on tick. Without puts, expired entries are erased by ticks.
+    for (int i = 0; i < num_keys; ++i) {
+        exp_map.put(2 * num_keys + i, i + 1, 1);
+    }
+    TestClock::advance(2000);
+    // A tick stops on the first sample with a quarter or less expired, which a small
+    // sample hits now and then even with half of the table expired. Repeated ticks
+    // bring the table towards a quarter expired.
+    int before_tick = exp_map.debug_size() - num_keys;
+    size_t by_tick = 0;
+    int ticks = 0;
+    while (exp_map.debug_size() - num_keys >= num_keys / 2) {
+        by_tick += exp_map.tick();
+        ++ticks;
+        assert(ticks < num_keys / 16);
+    }
+    int after_tick = exp_map.debug_size() - num_keys;
+    assert(by_tick == (size_t)(before_tick - after_tick));
+    // Gets erase the rest
+    for (int i = 0; i < num_keys; ++i) {
+        assert(exp_map.get(i) == 0);
+        assert(exp_map.get(2 * num_keys + i) == 0);
+        assert(exp_map.get(num_keys + i) == i + 1);
+    }
+    assert(exp_map.debug_size() == num_keys);
+    // A cycle over live entries stops after a single round
+    assert(exp_map.tick() == 0);
+    cout << num_keys - after_puts << " of " << num_keys << " expired entries erased by puts, "
+         << by_tick << " of " << before_tick << " by " << ticks << " ticks" << endl;
+    cout << "====Test successful====" << endl;
+}
+
+void string_key_test(int num_keys) {
+    cout << "====Test of string keys====" << endl;
+    // Keys are stored once. The expiry index refers to the keys in the data table.
+    static_assert(is_same<StringExpireMap::IndexKey, const string*>::value,
+                  "string keys are indexed by address");
+    static_assert(is_same<TestExpireMap::IndexKey, int>::value, "int keys are copied");
+    // Keys too long for the small string buffer, so that a copy allocates
+    vector<string> keys(num_keys);
+    for (int i = 0; i < num_keys; ++i) {
+        keys[i] = "https://example.com/items/" + to_string(i) + "?ref=expire-map-test";
+    }
+    StringRing ring(num_keys);
+    {
+        StringExpireMap exp_map;
+        exp_map.set_event_ring(&ring);
+        // Odd keys expire early
+        for (int i = 0; i < num_keys; ++i) {
+            exp_map.put(keys[i], i, i % 2 ? 4 : 1000);
+        }
+        // Lookups from a string_view, a C string, a string and a hashed view do not
+        // allocate
+        long allocations = heap_allocations;
+        for (int i = 0; i < num_keys; ++i) {
+            string_view view(keys[i]);
+            assert(exp_map.get(view) == i);
+            assert(exp_map.try_get(keys[i].c_str()) == optional<int>(i));
+            assert(exp_map.get(keys[i]) == i);
+            assert(exp_map.get(StringKeyView(view, StringKeyView::hash_of(view))) == i);
+            int found = -1;
+            assert(exp_map.with_value(view, [&found](const int& value) { found = value; }));
+            assert(found == i);
+            assert(exp_map.touch(view, i % 2 ? 4 : 1000));
+        }
+        assert(exp_map.get("https://example.com/items/missing?ref=expire-map-test") == 0);
+        assert(heap_allocations == allocations);
+        for (int i = 0; i < num_keys; i += 4) {
+            exp_map.remove(string_view(keys[i]));
+        }
+        assert(exp_map.get(string_view(keys[0])) == 0);
+        // Overwrite moves the entry in the expiry queue, which still refers to the key in
+        // the data table
+        exp_map.put(keys[2], -2, 1000);
+        assert(exp_map.get(string_view(keys[2])) == -2);
+        assert(exp_map.debug_expiry_queue_size() == exp_map.debug_size());
+        // Eviction finds the entries through the keys the expiry queue refers to
+        TestClock::advance(10000);
+        exp_map.debug_evict();
+        int live = 0;
+        for (int i = 0; i < num_keys; ++i) {
+            live += (i % 4 != 0 && i % 2 == 0);
+        }
+        assert(exp_map.debug_size() == live);
+        assert(exp_map.debug_expiry_queue_size() == live);
+        // Events carry the keys moved out of the data table
+        vector<StringEvent> events;
+        ring.pop_batch(events, SIZE_MAX);
+        assert((int)events.size() == num_keys - live);
+        for (size_t j = 0; j < events.size(); ++j) {
+            int i = events[j].value;
+            assert(events[j].key == keys[i]);
+            assert(events[j].reason == (i % 4 == 0 ? kRemoved : kExpired));
+        }
+    }
+    // Shards are picked with the hash of the view. Without events, removes do not
+    // allocate either.
+    {
+        ShardedExpireMap<string, int, StringExpireMap> exp_map(4 /* num shards */);
+        for (int i = 0; i < num_keys; ++i) {
+            exp_map.put(keys[i], i, 1000);
+        }
+        long allocations = heap_allocations;
+        for (int i = 0; i < num_keys; ++i) {
+            assert(exp_map.get(string_view(keys[i])) == i);
+        }
+        for (int i = 0; i < num_keys; i += 2) {
+            exp_map.remove(keys[i].c_str());
+        }
+        assert(heap_allocations == allocations);
+        assert(exp_map.debug_size() == num_keys / 2);
+        // Batches split views of the keys by shard. They allocate buffers for the
+        // batch, but copy no key.
+        vector<string_view> views(keys.begin(), keys.end());
+        vector<int> values(num_keys);
+        vector<bool> hits;
+        allocations = heap_allocations;
+        assert(exp_map.multi_get(views.begin(), views.end(), values.begin(), hits) ==
+               (size_t)num_keys / 2);
+        assert(exp_map.multi_remove(views.begin(), views.end()) == (size_t)num_keys / 2);
+        assert(heap_allocations - allocations < num_keys / 16);
+        for (int i = 0; i < num_keys; ++i) {
+            assert(hits[i] == (i % 2 == 1) && values[i] == (hits[i] ? i : 0));
+        }
+        assert(exp_map.debug_size() == 0);
+    }
+    cout << num_keys << " string keys looked up without allocating" << endl;
+    cout << "====Test successful====" << endl;
+}
+
+void coarse_clock_test() {
+    cout << "====Test of CoarseClock====" << endl;
+    // The only test that needs real time
+    long long start = CoarseClock<1000>::now();
+    usleep(20000);
+    long long end = CoarseClock<1000>::now();
+    assert(end > start);
+    assert(end <= SteadyClock::now());
+    cout << "Coarse clock moved " << end - start << " us in 20000 us" << endl;
+    cout << "====Test successful====" << endl;
+}
+
 int main(int argc, char *argv[]) {
     single_threaded_test(512 /* num uniq keys */, 10000 /* num ops */, 1024 /* max timeout */);
-    multi_threaded_test(16 /* num threads */, 1024 /* num uni keys */, 10000 /* num ops */,
-                        1024 /* max timeout */);
-    expiration_test(1 << 18 /* Num keys */, 128 /* max timeout */);
+    multi_threaded_test<TestExpireMap>("ExpireMap", 16 /* num threads */,
+                        1024 /* num uni keys */, 10000 /* num ops */, 1024 /* max timeout */);
+    expiration_test<TestExpireMap>("ExpireMap", 1 << 18 /* Num keys */,
+                    128 /* max timeout */);
+    multi_threaded_test<TestShardedExpireMap>("ShardedExpireMap", 16 /* num threads */,
+                        1024 /* num uni keys */, 10000 /* num ops */, 1024 /* max timeout */);
+    expiration_test<TestShardedExpireMap>("ShardedExpireMap", 1 << 18 /* Num keys */,
+                    128 /* max timeout */);
+    overwrite_churn_test<TestExpireMap>("ExpireMap", 1024 /* num uniq keys */,
+                         1 << 18 /* num ops */, 128 /* max timeout */);
+    timing_wheel_test(1 << 16 /* Num keys */, 1LL << 32 /* max delay in us */);
+    expiry_index_slice_test<OrderedExpiryIndex<int> >("OrderedExpiryIndex", 4096 /* Num keys */,
+                                                      100 /* max entries per pop */);
+    expiry_index_slice_test<TimingWheelExpiryIndex<int> >("TimingWheelExpiryIndex",
+                                                          4096 /* Num keys */,
+                                                          100 /* max entries per pop */);
+    latency_histogram_test();
+    capacity_test<TestExpireMap>("ExpireMap", 1024 /* max entries */, 1 << 14 /* num keys */);
+    capacity_test<TestShardedExpireMap>("ShardedExpireMap", 1024 /* max entries */,
+                                        1 << 14 /* num keys */);
+    value_access_test();
+    eviction_slice_test<TestExpireMap>("ExpireMap", 1 << 16 /* Num keys */);
+    eviction_slice_test<WheelExpireMap>("ExpireMap with timing wheel", 1 << 16 /* Num keys */);
+    eviction_slice_test<TestShardedExpireMap>("ShardedExpireMap", 1 << 16 /* Num keys */);
+    multi_threaded_test<WheelExpireMap>("ExpireMap with timing wheel", 16 /* num threads */,
+                        1024 /* num uni keys */, 10000 /* num ops */, 1024 /* max timeout */);
+    expiration_test<WheelExpireMap>("ExpireMap with timing wheel", 1 << 18 /* Num keys */,
+                    128 /* max timeout */);
+    overwrite_churn_test<WheelExpireMap>("ExpireMap with timing wheel", 1024 /* num uniq keys */,
+                         1 << 18 /* num ops */, 128 /* max timeout */);
+    multi_threaded_test<DistLockExpireMap>("ExpireMap with distributed lock", 16 /* num threads */,
+                        1024 /* num uni keys */, 10000 /* num ops */, 1024 /* max timeout */);
+    expiration_test<DistLockExpireMap>("ExpireMap with distributed lock", 1 << 18 /* Num keys */,
+                    128 /* max timeout */);
+    flat_expire_map_test(512 /* num uniq keys */, 10000 /* num ops */, 32 /* max timeout */);
+    batch_test<TestExpireMap>("ExpireMap", 1024 /* num uniq keys */, 2000 /* num batches */,
+                              256 /* max batch */, 1024 /* max timeout */);
+    batch_test<TestShardedExpireMap>("ShardedExpireMap", 1024 /* num uniq keys */,
+                                     2000 /* num batches */, 256 /* max batch */,
+                                     1024 /* max timeout */);
+    batch_test<TestFlatExpireMap>("FlatExpireMap", 1024 /* num uniq keys */,
+                                  2000 /* num batches */, 256 /* max batch */,
+                                  1024 /* max timeout */);
+    multi_threaded_test<TestSampledExpireMap>("SampledExpireMap", 16 /* num threads */,
+                        1024 /* num uni keys */, 10000 /* num ops */, 1024 /* max timeout */);
+    sampled_expire_map_test(1 << 16 /* num keys */);
+    eviction_service_test(64 /* num maps */, 1024 /* num keys */);
+    multi_threaded_test<StatsExpireMap>("ExpireMap with stats", 16 /* num threads */,
+                        1024 /* num uni keys */, 10000 /* num ops */, 1024 /* max timeout */);
+    stats_test(1024 /* num keys */);
+    snapshot_test<TestExpireMap>("ExpireMap", 1 << 16 /* num keys */);
+    event_ring_test(1024 /* num keys */);
+    get_or_load_test(16 /* num threads */);
+    touch_test<TestExpireMap>("ExpireMap", 1 << 14 /* num keys */);
+    touch_test<WheelExpireMap>("ExpireMap with timing wheel", 1 << 14 /* num keys */);
+    shared_memory_test(1 << 12 /* num keys */);
+    scan_test(1 << 14 /* num keys */);
+    fifo_expiry_index_test(1 << 14 /* num keys */, 1000000 /* ttl in us */);
+    eviction_slice_test<FifoExpireMap>("ExpireMap with FIFO index", 1 << 16 /* Num keys */);
+    multi_threaded_test<FifoExpireMap>("ExpireMap with FIFO index", 16 /* num threads */,
+                        1024 /* num uni keys */, 10000 /* num ops */, 1024 /* max timeout */);
+    expiration_test<FifoExpireMap>("ExpireMap with FIFO index", 1 << 18 /* Num keys */,
+                    128 /* max timeout */);
+    overwrite_churn_test<FifoExpireMap>("ExpireMap with FIFO index", 1024 /* num uniq keys */,
+                         1 << 18 /* num ops */, 128 /* max timeout */);
+    touch_test<FifoExpireMap>("ExpireMap with FIFO index", 1 << 14 /* num keys */);
+    string_key_test(1 << 12 /* num keys */);
+    snapshot_test<WheelExpireMap>("ExpireMap with timing wheel", 1 << 16 /* num keys */);
+    pool_resource_test<TestExpireMap>("ExpireMap", 1 << 14 /* num keys */, 5 /* num rounds */);
+    pool_resource_test<WheelExpireMap>("ExpireMap with timing wheel", 1 << 14 /* num keys */,
+                                       5 /* num rounds */);
+    coarse_clock_test();
     return 0;
 }